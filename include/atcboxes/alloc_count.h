@@ -0,0 +1,25 @@
+#ifndef ALLOC_COUNT_H
+#define ALLOC_COUNT_H
+
+#include <cstdint>
+
+// heap allocation counting for test::run's benchmarks (COUNT_ALLOCS). The
+// global operator new is replaced to count a thread's allocations, off by
+// default as every allocation of the server would pay for the check.
+namespace atcboxes::alloc_count {
+
+#ifdef COUNT_ALLOCS
+/**
+ * @brief Count this thread's allocations from 0.
+ */
+void start();
+
+/**
+ * @return allocations made by this thread since start
+ */
+uint64_t stop();
+#endif // COUNT_ALLOCS
+
+} // namespace atcboxes::alloc_count
+
+#endif // ALLOC_COUNT_H
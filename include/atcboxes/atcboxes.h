@@ -1,8 +1,11 @@
 #ifndef ATCBOXES_H
 #define ATCBOXES_H
 
+#include <climits>
 #include <cstdint>
 #include <mutex>
+#include <string>
+#include <vector>
 
 #define STATE_FILE "state.atcb"
 
@@ -18,9 +21,11 @@
 
 #define A_TRILLION 1'000'000'000'000
 #define A_TRILLION_STR "1'000'000'000'000"
+#ifndef SPARSE_STATE
 // this will always be too huge (125GB without color)
-// and color support requires 4000GB
+// and color support requires 4000GB, see sparse.h
 #define USE_MALLOC
+#endif // SPARSE_STATE
 
 #ifdef WITH_COLOR
 #define BUILD_TRILLION_WITH_COLOR
@@ -34,8 +39,10 @@
 #define A_TRILLION_STR "1'000'000'000"
 
 #ifdef WITH_COLOR
+#ifndef SPARSE_STATE
 // we cant put 4GB in the data segment!
 #define USE_MALLOC
+#endif // SPARSE_STATE
 #define BUILD_BILLION_WITH_COLOR
 #else
 #define BUILD_BILLION_NO_COLOR
@@ -45,7 +52,8 @@
 
 namespace atcboxes {
 
-struct cbox_t {
+// 4 byte aligned so a whole cbox_t can be swapped with one 32-bit CAS
+struct alignas(uint32_t) cbox_t {
   uint8_t r;
   uint8_t g;
   uint8_t b;
@@ -63,7 +71,17 @@ constexpr uint64_t STATE_ELEMENT_COUNT = A_TRILLION / STATE_PER_ELEMENT;
 #endif
 constexpr uint64_t STATE_MAX_INDEX = STATE_ELEMENT_COUNT - 1;
 constexpr uint64_t STATE_SIZE_BYTES = STATE_ELEMENT_SIZE * STATE_ELEMENT_COUNT;
+constexpr size_t STATE_ELEMENT_PER_PAGE = SIZE_PER_PAGE / STATE_PER_ELEMENT;
+constexpr size_t STATE_PAGE_SIZE_BYTES =
+    STATE_ELEMENT_SIZE * STATE_ELEMENT_PER_PAGE;
+constexpr uint64_t STATE_PAGE_COUNT = A_TRILLION / SIZE_PER_PAGE;
+// recent writes remembered per page for differential page sync
+constexpr size_t PAGE_CHANGE_RING_SIZE = 64;
 
+/**
+ * @brief Excludes whole state operations (load, save, reset). Toggles don't
+ *        take this lock.
+ */
 struct cbox_lock_guard_t {
   std::lock_guard<std::mutex> lk;
 
@@ -100,15 +118,115 @@ int get_state(uint64_t i
 /**
  * @brief Caller should lock cbox mutex by constructing cbox_lock_guard_t before
  *        calling this function and keeping it alive as long as the return value
- *        is gonna be used.
+ *        is gonna be used. Toggles can still land in the page meanwhile.
+ *        With SPARSE_STATE the page is a copy, valid until the next call on the
+ *        same thread.
  */
 std::pair<CBOX_T const *, size_t> get_state_page(uint64_t page);
 
+/**
+ * @brief Copy a page without blocking toggles. The copy is retried when a
+ *        toggle lands in the page meanwhile, and given up as best-effort after
+ *        a few retries.
+ * @param out resized to STATE_PAGE_SIZE_BYTES
+ * @param version page version the copy represents, only when consistent
+ * @return 0 consistent copy, 1 best-effort copy, -1 err
+ */
+int copy_state_page(uint64_t page, std::string &out,
+                    uint64_t *version = nullptr);
+
+/**
+ * @brief Page versions grow with every completed write to the page, starting
+ *        from a random base on every run.
+ * @return current page version, -1 err
+ */
+int64_t get_page_version(uint64_t page);
+
+/**
+ * @brief Checkboxes written in a page since a version, as long as the page's
+ *        change ring still covers it.
+ * @param offsets checkbox offsets within the page, may repeat
+ * @param version page version the changes lead to
+ * @return 0 success, 1 not covered (fetch the whole page), -1 err
+ */
+int get_page_changes(uint64_t page, uint64_t since,
+                     std::vector<uint32_t> &offsets, uint64_t &version);
+
+struct snapshot_stats_t {
+  uint64_t pages;
+  uint64_t bytes;
+  double ms;
+  // the whole state was written
+  bool full;
+};
+
+/**
+ * @brief Write the pages changed since the last snapshot to the state file in
+ *        place, the whole state when the file isn't known to match. Folds the
+ *        journal when journaling.
+ * @return 0 success, -1 err
+ */
+int snapshot(snapshot_stats_t &stats);
+
 void init_state();
 void free_state();
 
 int get_port();
 
+const char *get_statefile();
+
+unsigned int get_threads();
+
+/**
+ * @return broadcast tick in milliseconds, 0 when disabled
+ */
+unsigned int get_tick_ms();
+
+enum compression_e {
+  COMPRESSION_OFF,
+  // one compressor per thread, no context kept between messages
+  COMPRESSION_SHARED,
+  // one compressor per connection keeping its window, more memory
+  COMPRESSION_DEDICATED
+};
+
+/**
+ * @return permessage-deflate mode
+ */
+compression_e get_compression();
+
+/**
+ * @return per connection backpressure limit in bytes, 0 for uWS default
+ */
+unsigned int get_max_backpressure();
+
+/**
+ * @return largest accepted message in bytes, 0 for uWS default
+ */
+unsigned int get_max_payload();
+
+/**
+ * @return whether toggles go through the single writer thread, see writer.h
+ */
+bool get_single_writer();
+
+/**
+ * @return toggles per second a connection may send, 0 unlimited
+ */
+unsigned int get_rate_limit();
+
+/**
+ * @return toggles per second an IP may send over all its connections, 0
+ *         unlimited
+ */
+unsigned int get_ip_rate_limit();
+
+/**
+ * @return send buffer size above which a connection stops receiving state
+ *         changes until it drained, 0 never
+ */
+unsigned int get_shed_bytes();
+
 int run(const int argc, const char *const argv[]);
 
 } // namespace atcboxes
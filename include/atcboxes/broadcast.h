@@ -0,0 +1,108 @@
+#ifndef BROADCAST_H
+#define BROADCAST_H
+
+#include "atcboxes/atcboxes.h"
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace atcboxes::broadcast {
+
+// every state change
+constexpr const char TOPIC_GLOBAL[] = "global";
+// user count, every connection subscribes to it
+constexpr const char TOPIC_META[] = "meta";
+// binary protocol clients subscribe to the topic name with this suffix
+constexpr const char TOPIC_BIN_SUFFIX[] = ".b";
+
+struct change_t {
+  uint64_t i;
+#ifdef WITH_COLOR
+  cbox_t s;
+#else
+  // state before the first change in this tick and the latest state
+  int initial;
+  int s;
+#endif // WITH_COLOR
+};
+
+/**
+ * @brief State changes accumulated between two ticks, one entry per index in
+ *        the order they first changed.
+ */
+struct delta_t {
+  std::vector<change_t> changes;
+  std::unordered_map<uint64_t, size_t> pos;
+};
+
+// the same changes in both protocols
+struct frames_t {
+  std::string text;
+  std::string bin;
+};
+
+struct page_frames_t {
+  uint64_t page;
+  frames_t f;
+};
+
+/**
+ * @brief Frames for the global topics with every change, and for every page
+ *        topic with only the changes in that page.
+ */
+struct broadcast_t {
+  frames_t global;
+  std::vector<page_frames_t> pages;
+};
+
+// a frame for one topic
+struct message_t {
+  std::string topic;
+  std::string data;
+  // binary protocol frame
+  bool bin;
+};
+
+using messages_t = std::vector<message_t>;
+
+inline uint64_t page_of(uint64_t i) { return i / SIZE_PER_PAGE; }
+
+#ifdef WITH_COLOR
+void add(delta_t &d, uint64_t i, const cbox_t &s);
+
+void single(broadcast_t &out, uint64_t i, const cbox_t &s);
+#else
+void add(delta_t &d, uint64_t i, int s);
+
+void single(broadcast_t &out, uint64_t i, int s);
+#endif // WITH_COLOR
+
+/**
+ * @brief Write topic's name to out.
+ */
+void topic_name(std::string &out, std::string_view topic, bool bin);
+
+/**
+ * @brief Write the name of the topic only subscribers of page receive to out.
+ */
+void page_topic(std::string &out, uint64_t page, bool bin);
+
+/**
+ * @brief Both protocols' frames of b to their topics. Frames are swapped out
+ *        of b and m's entries are reused, so buffers kept from one call to
+ *        the next stop allocating.
+ */
+void messages(broadcast_t &b, messages_t &m);
+
+/**
+ * @brief Build the frames for everything accumulated and reset d. Toggles
+ *        that cancel each other out are dropped. A single change is sent as a
+ *        plain `s;` (OP_STATE) frame, more as one `d;` (OP_DELTA) frame.
+ * @return number of changes in the global frames, 0 nothing to send
+ */
+size_t flush(delta_t &d, broadcast_t &out);
+
+} // namespace atcboxes::broadcast
+
+#endif // BROADCAST_H
@@ -2,23 +2,113 @@
 #define COMMANDS_H
 
 #include "atcboxes/atcboxes.h"
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace atcboxes::commands {
 
 struct command_out_t {
   std::string out;
-  uint64_t flags;
+  // 1: sent as is, 2: already compact, skip permessage-deflate
+  uint64_t flags = 0;
+  // payload shared with other outputs, sent instead of out when set
+  std::shared_ptr<const std::string> shared = nullptr;
+
+  std::string_view data() const {
+    return shared ? std::string_view(*shared) : std::string_view(out);
+  }
+};
+
+struct toggle_t {
+  uint64_t i;
+#ifdef WITH_COLOR
+  cbox_t s;
+#endif // WITH_COLOR
+};
+
+using toggles_t = std::vector<toggle_t>;
+
+/**
+ * @brief Outputs of a command. Meant to be reused: cleared outputs keep their
+ *        string capacity, so answering a message once warmed up doesn't
+ *        allocate.
+ */
+struct command_outs_t {
+  std::vector<command_out_t> v;
+  size_t n = 0;
+  // batched toggles to apply, all validated
+  toggles_t toggles;
+
+  /**
+   * @return next output, empty
+   */
+  command_out_t &push(uint64_t flags) {
+    if (n == v.size())
+      v.emplace_back();
+
+    command_out_t &o = v[n++];
+    o.out.clear();
+    o.flags = flags;
+    o.shared = nullptr;
+    return o;
+  }
+
+  void push_back(command_out_t &&o) { push(o.flags) = std::move(o); }
+
+  void clear() {
+    // don't keep shared pages alive
+    for (size_t i = 0; i < n; i++)
+      v[i].shared = nullptr;
+
+    n = 0;
+    toggles.clear();
+  }
+
+  size_t size() const { return n; }
+  bool empty() const { return n == 0; }
+
+  const command_out_t *begin() const { return v.data(); }
+  const command_out_t *end() const { return v.data() + n; }
 };
 
-using command_outs_t = std::vector<command_out_t>;
+// most pages a connection can subscribe to at once
+constexpr uint64_t MAX_SUBS_PAGES = 16;
+// most toggles in one `bt;` or OP_BATCH message
+constexpr uint64_t MAX_BATCH_TOGGLES = 4096;
 
-std::string p_state(const std::string &n, int s);
+/**
+ * @brief Parse and validate a `sc;<page>;<count>` command, subscribing to
+ *        count pages starting from page. A count of 0 goes back to every page.
+ * @return 0 success, -1 err
+ */
+int subs(std::string_view cmd, uint64_t &page, uint64_t &count);
 
-std::string p_state_wc(uint64_t n, const cbox_t &s);
+/**
+ * @brief Run a text command, anything that isn't one is a toggle:
+ *        `<idx>`, or `<idx>;<r>;<g>;<b>;<a>` with color. `bt;` followed by
+ *        as many of those as MAX_BATCH_TOGGLES toggles them all.
+ * @param i toggle index when returning 1
+ * @return 0 handled, 1 toggle, 2 batch in out.toggles, <0 err
+ */
+#ifdef WITH_COLOR
+int run(std::string_view cmd, command_outs_t &out, uint64_t &i, cbox_t &s);
+#else
+int run(std::string_view cmd, command_outs_t &out, uint64_t &i);
+#endif // WITH_COLOR
 
-int run(std::string_view cmd, command_outs_t &out);
+/**
+ * @brief Binary protocol counterpart of run, see proto.h.
+ * @param i toggle index when returning 1
+ * @return 0 handled, 1 toggle, 2 batch in out.toggles, <0 err
+ */
+#ifdef WITH_COLOR
+int run_bin(std::string_view cmd, command_outs_t &out, uint64_t &i,
+            cbox_t &s);
+#else
+int run_bin(std::string_view cmd, command_outs_t &out, uint64_t &i);
+#endif // WITH_COLOR
 
 } // namespace atcboxes::commands
 
@@ -0,0 +1,94 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "atcboxes/atcboxes.h"
+#include <mutex>
+
+// write-ahead journal: every write to the state is recorded as the checkbox's
+// new value, so replaying a record twice or over a state that already has it
+// is harmless. Records are committed to disk in groups by the journal thread.
+//
+// The journal is split in segments `<state>.wal.<id>`. A checkpoint rotates to
+// a new segment, saves the state, then drops the segments before the new one.
+namespace atcboxes::journal {
+
+// records committed together, a crash loses at most this many milliseconds
+constexpr int COMMIT_MS = 5;
+// lock stripes, a page always maps to the same one
+constexpr size_t STRIPE_COUNT = 64;
+
+#ifdef WITH_COLOR
+using apply_t = void (*)(uint64_t i, const cbox_t &s);
+#else
+using apply_t = void (*)(uint64_t i, bool on);
+#endif // WITH_COLOR
+
+struct stats_t {
+  uint64_t records;
+  uint64_t commits;
+  uint64_t bytes;
+};
+
+/**
+ * @brief Apply every record of every segment of statefile's journal, oldest
+ *        first. A torn commit at the end of a segment is skipped.
+ * @return records applied, -1 err
+ */
+int64_t replay(const char *statefile, apply_t apply);
+
+/**
+ * @brief Start a segment after the newest existing one and the journal
+ *        thread.
+ * @return 0 success, 1 already running, -1 err
+ */
+int start(const char *statefile);
+
+/**
+ * @brief Commit everything still pending and join the journal thread.
+ * @return 0 success, 1 not running
+ */
+int stop();
+
+bool running();
+
+/**
+ * @brief Held while writing a checkbox and appending its record, so records
+ *        of a checkbox are in the same order as its writes.
+ */
+std::unique_lock<std::mutex> lock(uint64_t page);
+
+/**
+ * @brief Caller holds lock(page).
+ */
+#ifdef WITH_COLOR
+void append(uint64_t page, uint64_t i, const cbox_t &s);
+#else
+void append(uint64_t page, uint64_t i, bool on);
+#endif // WITH_COLOR
+
+/**
+ * @brief Commit pending records and continue in a new segment, unless the
+ *        current one is still empty. A state saved after this returns has
+ *        every record of the closed segments. After a failed commit dropped
+ *        records, every segment is closed as the state has those too.
+ * @param closed id of the last closed segment, -1 none
+ * @return 0 success, -1 err
+ */
+int rotate(int64_t &closed);
+
+/**
+ * @brief Delete every segment up to and including last.
+ */
+void drop(int64_t last);
+
+/**
+ * @brief Make the next n commits fail after writing half of their records,
+ *        for test::run.
+ */
+void fail_commits(int n);
+
+stats_t get_stats();
+
+} // namespace atcboxes::journal
+
+#endif // JOURNAL_H
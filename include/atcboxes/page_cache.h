@@ -0,0 +1,32 @@
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace atcboxes::page_cache {
+
+// cached pages, up to 1MB each with color
+constexpr size_t PAGE_CACHE_SIZE = 64;
+
+using frame_t = std::shared_ptr<const std::string>;
+
+/**
+ * @brief Raw page payload shared by every request for the same page version.
+ *        A page is only copied again after a toggle landed in it.
+ * @param version set to the payload's page version, 0 for a best-effort copy
+ * @return nullptr err
+ */
+frame_t get(uint64_t page, uint64_t *version = nullptr);
+
+/**
+ * @brief Like get, encoded with page_codec. Cached along with the raw page.
+ * @param encoding set to the page_codec::encoding_e used
+ * @return nullptr err
+ */
+frame_t get_encoded(uint64_t page, char &encoding, uint64_t *version = nullptr);
+
+} // namespace atcboxes::page_cache
+
+#endif // PAGE_CACHE_H
@@ -0,0 +1,45 @@
+#ifndef PAGE_CODEC_H
+#define PAGE_CODEC_H
+
+#include <string>
+#include <string_view>
+
+// page payload encodings, picked per page and named by the last field of the
+// `we;` header. Counts and offsets are LEB128 varints as in proto.h.
+namespace atcboxes::page_codec {
+
+enum encoding_e : char {
+  // raw CBOX_T memory, same as `gp;`
+  ENC_RAW = 'r',
+  // repeated (varint zero bytes, varint n, n literal bytes)
+  ENC_RLE = 'l',
+  // varint count, then count * varint gap to the previous active checkbox
+  // offset plus one. With color: varint gap to the previous non-zero element
+  // plus one, then its 4 bytes rgba
+  ENC_SPARSE = 's',
+  // zlib stream of the raw page
+  ENC_DEFLATE = 'z',
+};
+
+/**
+ * @brief Encode a raw page with whichever encoding comes out smallest.
+ *        Sparse pages are picked from their popcount without trying the
+ *        others, deflate is only tried when the cheap encodings fall short.
+ * @return encoding used
+ */
+encoding_e encode(std::string_view page, std::string &out);
+
+/**
+ * @brief Encode a raw page with the given encoding, whatever its size.
+ * @return 0 success, -1 err
+ */
+int encode(encoding_e encoding, std::string_view page, std::string &out);
+
+/**
+ * @return 0 success, -1 err
+ */
+int decode(char encoding, std::string_view in, std::string &out);
+
+} // namespace atcboxes::page_codec
+
+#endif // PAGE_CODEC_H
@@ -0,0 +1,93 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include "atcboxes/atcboxes.h"
+#include <string>
+#include <string_view>
+
+// binary wire protocol, negotiated per connection with the `bin;` text
+// command. Every frame starts with an opcode byte, indexes and counts are
+// LEB128 varints, colors are 4 raw bytes (r, g, b, a).
+namespace atcboxes::proto {
+
+enum op_e : uint8_t {
+  // client -> server
+  // toggle: varint idx [rgba]
+  OP_TOGGLE = 0x01,
+  // get checkbox value: varint idx
+  OP_GCV = 0x02,
+  // get global value
+  OP_GV = 0x03,
+  // many toggles: varint count, then count * (zigzag varint idx delta from the
+  // previous idx starting at 0 [rgba])
+  OP_BATCH = 0x04,
+
+  // server -> client
+  // state: varint idx, 1 byte state or rgba
+  OP_STATE = 0x81,
+  // global value: varint
+  OP_GV_OUT = 0x82,
+  // user count: varint
+  OP_UC = 0x83,
+  // many states: varint count, then count * (varint idx, state or rgba)
+  OP_DELTA = 0x84,
+  // refetch pages, state changes were dropped: varint page, varint count (0
+  // every page)
+  OP_RESYNC = 0x85,
+  // toggles dropped by the rate limit or a full writer ring, no payload
+  OP_RATE_LIMITED = 0x86,
+};
+
+/**
+ * @brief Binary frames always start with an opcode below any printable
+ *        character, text commands never do.
+ */
+inline bool is_binary(std::string_view msg) {
+  return !msg.empty() && (uint8_t)msg[0] < 0x20;
+}
+
+void put_varint(std::string &out, uint64_t v);
+
+/**
+ * @param pos read position, advanced past the varint
+ * @return 0 success, -1 err
+ */
+int get_varint(std::string_view in, size_t &pos, uint64_t &v);
+
+// zigzag, small negative values stay small
+void put_svarint(std::string &out, int64_t v);
+
+/**
+ * @return 0 success, -1 err
+ */
+int get_svarint(std::string_view in, size_t &pos, int64_t &v);
+
+#ifdef WITH_COLOR
+void put_state(std::string &out, uint64_t i, const cbox_t &s);
+
+/**
+ * @return 0 success, -1 err
+ */
+int get_state(std::string_view in, size_t &pos, uint64_t &i, cbox_t &s);
+
+/**
+ * @return 0 success, -1 err
+ */
+int get_rgba(std::string_view in, size_t &pos, cbox_t &s);
+
+void p_state(std::string &out, uint64_t i, const cbox_t &s);
+#else
+void put_state(std::string &out, uint64_t i, int s);
+
+void p_state(std::string &out, uint64_t i, int s);
+#endif // WITH_COLOR
+
+void p_gv(std::string &out, uint64_t v);
+
+void p_uc(std::string &out, uint64_t v);
+
+void p_resync(std::string &out, uint64_t page, uint64_t count);
+
+} // namespace atcboxes::proto
+
+#endif // PROTO_H
@@ -1,11 +1,62 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include <cstdint>
+#include <type_traits>
+
 namespace atcboxes::server {
 
+enum ws_data_flags_e : uint8_t {
+  WSDF_NONE = 0,
+  WSDF_C = 1,
+  // negotiated the binary protocol
+  WSDF_BIN = 2,
+  // cached holds a fingerprint
+  WSDF_CACHED = 4,
+  // not receiving state changes until the send buffer drained
+  WSDF_SHED = 8
+};
+
+// token bucket, float tokens refilled by the millisecond
+struct bucket_t {
+  float tokens;
+  // low 32 bits of the millisecond timestamp
+  uint32_t ts;
+};
+
+/**
+ * @brief Per connection state, kept small: a million idle connections cost
+ *        32MB here on top of uWS's own.
+ */
+struct ws_data_t {
+  // fingerprint of the expected challenge answer
+  uint64_t cached;
+  // toggle rate limit
+  bucket_t bucket;
+
+  // subscribed pages, sub_count 0 is subscribed to TOPIC_GLOBAL
+  uint32_t sub_page;
+  // position in this worker's connected_wses
+  uint32_t cws_idx;
+  // low 32 bits of the millisecond timestamp
+  uint32_t last_ts;
+
+  char n_o;
+  char n_i;
+  uint8_t flags;
+  uint8_t sub_count;
+};
+
+static_assert(std::is_trivial_v<ws_data_t> && sizeof(ws_data_t) == 32);
+
 int run();
 int shutdown();
 
+/**
+ * @brief Print traffic and compression metrics of every worker.
+ */
+void print_stats();
+
 } // namespace atcboxes::server
 
 #endif // SERVER_H
@@ -0,0 +1,112 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include "atcboxes/atcboxes.h"
+
+// sparse state engine (SPARSE_STATE): the checkbox space is split in chunks of
+// CHUNK_SIZE checkboxes, each kept as the smallest of a sorted array of
+// offsets, a bitmap or a list of runs (roaring-style), converted as it fills
+// and empties. A chunk without any set checkbox takes no memory at all.
+//
+// A checkbox is set when it's checked, with color when its cbox_t isn't all
+// zero: an unchecked checkbox keeps its color.
+//
+// Every chunk is guarded by one of STRIPE_COUNT locks, element ranges are
+// materialized in the layout of the state file.
+namespace atcboxes::sparse {
+
+constexpr uint64_t CHUNK_SIZE = 1 << 16;
+constexpr uint64_t CHUNK_COUNT = (A_TRILLION + CHUNK_SIZE - 1) / CHUNK_SIZE;
+constexpr uint64_t CHUNK_ELEMENT_COUNT = CHUNK_SIZE / STATE_PER_ELEMENT;
+// a whole chunk in the state file
+constexpr uint64_t CHUNK_SIZE_BYTES = CHUNK_ELEMENT_COUNT * STATE_ELEMENT_SIZE;
+// lock stripes, a chunk always maps to the same one
+constexpr size_t STRIPE_COUNT = 1024;
+// arrays grow into bitmaps (or runs) past this many checkboxes, as big as a
+// bitmap by then. Bitmaps only shrink back below half of it so a chunk toggled
+// around it doesn't flap
+#ifdef WITH_COLOR
+constexpr size_t ARRAY_MAX =
+    CHUNK_SIZE_BYTES / (sizeof(uint16_t) + sizeof(cbox_t));
+#else
+constexpr size_t ARRAY_MAX = CHUNK_SIZE_BYTES / sizeof(uint16_t);
+#endif // WITH_COLOR
+
+enum container_e : uint8_t {
+  CONTAINER_ARRAY,
+  // with color, every cbox_t of the chunk
+  CONTAINER_BITMAP,
+  CONTAINER_RUN,
+  CONTAINER_COUNT
+};
+
+struct stats_t {
+  // chunks per container_e
+  uint64_t chunks[CONTAINER_COUNT];
+  // set checkboxes
+  uint64_t set;
+  // containers and the chunk directory
+  uint64_t bytes;
+};
+
+#ifdef WITH_COLOR
+/**
+ * @brief Flip i's active bit and write s's color, in one go.
+ * @param next i's new state out
+ */
+void toggle(uint64_t i, const cbox_t &s, cbox_t &next);
+
+void set(uint64_t i, const cbox_t &s);
+
+/**
+ * @return 0 off, 1 on
+ */
+int get(uint64_t i, cbox_t &s);
+#else
+/**
+ * @return 0 off, 1 on
+ */
+int toggle(uint64_t i);
+
+void set(uint64_t i, bool on);
+
+/**
+ * @return 0 off, 1 on
+ */
+int get(uint64_t i);
+#endif // WITH_COLOR
+
+/**
+ * @brief Materialize n elements starting from element first.
+ * @return whether any checkbox in them is set
+ */
+bool read(uint64_t first, size_t n, CBOX_T *dst);
+
+/**
+ * @brief Lock-free check that no chunk covering n elements starting from
+ *        element first has a set checkbox, racing toggles.
+ */
+bool empty(uint64_t first, size_t n);
+
+/**
+ * @brief Replace chunk c with CHUNK_ELEMENT_COUNT elements from src.
+ */
+void set_chunk(uint64_t c, const CBOX_T *src);
+
+/**
+ * @return chunk c's container, CONTAINER_COUNT when it has no set checkbox
+ */
+container_e container(uint64_t c);
+
+uint64_t count_active();
+
+/**
+ * @brief Drop every chunk.
+ */
+void clear();
+
+stats_t get_stats();
+
+} // namespace atcboxes::sparse
+
+#endif // SPARSE_H
@@ -0,0 +1,62 @@
+#ifndef STATE_IO_H
+#define STATE_IO_H
+
+#include <cstddef>
+#include <cstdint>
+
+// bulk state file I/O: whole files are read and written in CHUNK_SIZE
+// requests, QUEUE_DEPTH of them in flight. io_uring when the kernel has it,
+// a pread/pwrite thread pool otherwise. With direct I/O the page cache is
+// bypassed wherever the buffer, offset and length are ALIGN aligned.
+namespace atcboxes::state_io {
+
+constexpr size_t ALIGN = 4096;
+constexpr size_t CHUNK_SIZE = 1 << 20;
+constexpr unsigned int QUEUE_DEPTH = 16;
+
+/**
+ * @brief Pick the backend, call once before any I/O.
+ * @param direct O_DIRECT
+ */
+void init(bool direct);
+
+/**
+ * @return "io_uring" or "threads"
+ */
+const char *backend_name();
+
+/**
+ * @return whether init asked for direct I/O
+ */
+bool direct();
+
+/**
+ * @brief Read size bytes from offset off of the file into dst, stopping at
+ *        EOF. Only goes direct from an aligned offset.
+ * @return bytes read, -1 err
+ */
+int64_t read_file(const char *path, void *dst, size_t size, uint64_t off = 0);
+
+struct writer_t;
+
+/**
+ * @brief Sequential writer truncating path, data is copied to aligned chunk
+ *        buffers written out while the next ones fill.
+ * @return nullptr err
+ */
+writer_t *open_writer(const char *path);
+
+/**
+ * @return 0 success, -1 err
+ */
+int write(writer_t *w, const void *data, size_t size);
+
+/**
+ * @brief Write what's left, fsync and close. Frees w either way.
+ * @return 0 success, -1 err
+ */
+int close_writer(writer_t *w);
+
+} // namespace atcboxes::state_io
+
+#endif // STATE_IO_H
@@ -3,15 +3,43 @@
 
 #include "atcboxes/atcboxes.h"
 #include <cstdio>
+#include <string>
+#include <string_view>
 
 namespace atcboxes::util {
 
 FILE *try_open(const char *filepath, const char *mode);
 
+/**
+ * @brief Parse the whole of s as a decimal, no sign or whitespace.
+ * @return 0 success, -1 err
+ */
+int parse_uint(std::string_view s, uint64_t &out);
+
+/**
+ * @brief Append v as a decimal, only allocates when out is out of capacity.
+ */
+void append_uint(std::string &out, uint64_t v);
+
+/**
+ * @brief Parse exactly n `;` separated decimals.
+ * @return 0 success, -1 err
+ */
+int parse_uints(std::string_view s, uint64_t *out, size_t n);
+
 #ifdef WITH_COLOR
-int parse_cbox_wc(const std::string &msg, uint64_t &i, cbox_t &s);
+/**
+ * @brief Parse `idx;r;g;b;a`, every channel 0-255.
+ * @return 0 success, -1 err
+ */
+int parse_cbox_wc(std::string_view msg, uint64_t &i, cbox_t &s);
 
 void cbox_t_to_str(uint64_t i, const cbox_t &s, std::string &str);
+
+/**
+ * @brief Append `idx;r;g;b;a`.
+ */
+void append_cbox_wc(std::string &out, uint64_t i, const cbox_t &s);
 #endif // WITH_COLOR
 
 } // namespace atcboxes::util
@@ -0,0 +1,67 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include "atcboxes/atcboxes.h"
+#include "atcboxes/broadcast.h"
+#include "atcboxes/commands.h"
+
+// optional single writer mode: I/O threads push toggles into a lock-free
+// MPSC ring and one writer thread applies them all, in batches.
+namespace atcboxes::writer {
+
+// ring slots, a power of two. Pushes fail while it's full, I/O threads never
+// wait for the writer
+constexpr size_t RING_SIZE = 1 << 16;
+// most toggles applied before their changes are handed out
+constexpr size_t MAX_BATCH = 4096;
+
+/**
+ * @brief Called on the writer thread with the changes of every applied batch.
+ */
+using on_batch_t = void (*)(broadcast::broadcast_t &&b);
+
+struct stats_t {
+  uint64_t applied;
+  uint64_t batches;
+  // push to applied
+  uint64_t latency_ns_sum;
+  uint64_t latency_ns_max;
+  // pushed while the ring was full
+  uint64_t dropped;
+};
+
+/**
+ * @param on_batch nullptr to drop the changes
+ * @return 0 success, 1 already running
+ */
+int start(on_batch_t on_batch);
+
+/**
+ * @brief Apply everything still in the ring and join the writer thread.
+ * @return 0 success, 1 not running
+ */
+int stop();
+
+bool running();
+
+/**
+ * @brief Queue a toggle, the index must already be validated.
+ * @return false when the ring is full, the toggle is dropped
+ */
+#ifdef WITH_COLOR
+bool push(uint64_t i, const cbox_t &s);
+#else
+bool push(uint64_t i);
+#endif // WITH_COLOR
+
+/**
+ * @brief Queue a validated batch as a whole, at most MAX_BATCH_TOGGLES.
+ * @return false when the ring can't take all of them, none are queued
+ */
+bool push(const commands::toggles_t &toggles);
+
+stats_t get_stats();
+
+} // namespace atcboxes::writer
+
+#endif // WRITER_H
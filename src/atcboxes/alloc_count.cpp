@@ -0,0 +1,41 @@
+#include "atcboxes/alloc_count.h"
+
+#ifdef COUNT_ALLOCS
+
+#include <cstdlib>
+#include <new>
+
+namespace atcboxes::alloc_count {
+
+static thread_local bool counting = false;
+static thread_local uint64_t allocs = 0;
+
+void start() {
+  allocs = 0;
+  counting = true;
+}
+
+uint64_t stop() {
+  counting = false;
+  return allocs;
+}
+
+} // namespace atcboxes::alloc_count
+
+// in their own translation unit, GCC inlining free next to a new it doesn't
+// see replaced warns about mismatched new and delete
+void *operator new(std::size_t n) {
+  if (atcboxes::alloc_count::counting)
+    atcboxes::alloc_count::allocs++;
+
+  if (void *p = malloc(n > 0 ? n : 1))
+    return p;
+
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+void operator delete(void *p, std::size_t) noexcept { free(p); }
+
+#endif // COUNT_ALLOCS
@@ -1,17 +1,37 @@
 #include "atcboxes/atcboxes.h"
+#include "atcboxes/journal.h"
 #include "atcboxes/migrate.h"
 #include "atcboxes/runtime_cli.h"
 #include "atcboxes/server.h"
+#include "atcboxes/sparse.h"
+#include "atcboxes/state_io.h"
 #include "atcboxes/test.h"
 #include "atcboxes/util.h"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cerrno>
 #include <climits>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
 #include <mutex>
+#include <random>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
 #include <threads.h>
+#include <unistd.h>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define ATCB_X86_KERNELS
+#include <immintrin.h>
+#endif
 
 #define ARGV_LOOP(x)                                                           \
   for (int i = 1; i < argc; i++)                                               \
@@ -25,6 +45,24 @@ namespace atcboxes {
 const char *statefile = STATE_FILE;
 const char *runbin = "./atcboxes";
 int port = 3000;
+// server threads, 0 is one per core
+unsigned int threads = 1;
+// broadcast tick, 0 publishes every toggle immediately
+unsigned int tick_ms = 0;
+compression_e compression = COMPRESSION_OFF;
+// 0 leaves them to uWS defaults
+unsigned int max_backpressure = 0;
+unsigned int max_payload = 0;
+bool single_writer = false;
+// 0 disables them
+unsigned int rate_limit = 0;
+unsigned int ip_rate_limit = 0;
+unsigned int shed_bytes = 0;
+bool use_mmap = false;
+bool use_journal = false;
+bool direct_io = false;
+// seconds between snapshots, 0 only at shutdown
+unsigned int snapshot_s = 0;
 
 static void print_spec() {
   fprintf(stderr, "%s Checkboxes - Server\n", A_TRILLION_STR);
@@ -43,209 +81,1215 @@ static void print_spec() {
           STATE_SIZE_BYTES);
 }
 
-#ifdef USE_MALLOC
+#if defined(SPARSE_STATE)
+// no flat state, checkboxes live in sparse chunks
+#elif defined(USE_MALLOC)
 static CBOX_T *cboxes = NULL;
 #else
 // yes, 125MB on the data segment
-static CBOX_T cboxes[STATE_ELEMENT_COUNT] = {{}};
+// aligned for direct I/O
+alignas(state_io::ALIGN) static CBOX_T cboxes_data[STATE_ELEMENT_COUNT] = {{}};
+static CBOX_T *cboxes = cboxes_data;
 #endif // USE_MALLOC
 
-uint64_t gv = 0;
+// cboxes is a MAP_SHARED mapping of the state file
+static bool state_mapped = false;
+// the state file matches cboxes except for dirty pages
+static bool state_file_synced = false;
+
+// active checkbox count, sharded so concurrent toggles don't bounce a single
+// cache line. Each thread sticks to one shard, get_gv() sums them all.
+struct alignas(64) gv_shard_t {
+  std::atomic<int64_t> v = 0;
+};
+
+constexpr size_t GV_SHARD_COUNT = 64;
+static gv_shard_t gv[GV_SHARD_COUNT];
+static std::atomic<size_t> gv_next_shard = 0;
+
+static void gv_add(int64_t d) {
+  thread_local const size_t shard =
+      gv_next_shard.fetch_add(1, std::memory_order_relaxed) % GV_SHARD_COUNT;
+
+  gv[shard].v.fetch_add(d, std::memory_order_relaxed);
+}
+
+static void gv_set(uint64_t v) {
+  for (size_t i = 1; i < GV_SHARD_COUNT; i++)
+    gv[i].v.store(0, std::memory_order_relaxed);
+
+  gv[0].v.store(v, std::memory_order_relaxed);
+}
+
+// per page seqlock for many concurrent writers: begin counts started writes,
+// end counts completed writes. A page is quiescent when both are equal, a
+// reader copy is consistent when begin didn't move while copying.
+//
+// The last PAGE_CHANGE_RING_SIZE writes to a page are kept in a ring, slot
+// (ticket % size) holding the checkbox offset within the page written by the
+// ticket'th write. Allocated on the first write to the page.
+//
+// dirty is set after every write and taken by snapshots before writing the
+// page out, a write racing a snapshot leaves it set for the next one.
+struct page_changes_t {
+  std::atomic<uint32_t> offsets[PAGE_CHANGE_RING_SIZE];
+};
+
+struct page_version_t {
+  std::atomic<uint64_t> begin = 0;
+  std::atomic<uint64_t> end = 0;
+  std::atomic<page_changes_t *> changes = nullptr;
+  std::atomic<bool> dirty = false;
+};
+
+#ifdef SPARSE_STATE
+// like sparse chunks, page versions are found through blocks of
+// VERSION_BLOCK_SIZE pages, a block is allocated on the first write to one of
+// its pages and kept until free_state. A state with few written pages only
+// pays for their blocks.
+constexpr size_t VERSION_BLOCK_SIZE = 1024;
+constexpr size_t VERSION_BLOCK_COUNT =
+    (STATE_PAGE_COUNT + VERSION_BLOCK_SIZE - 1) / VERSION_BLOCK_SIZE;
+
+struct version_block_t {
+  page_version_t pages[VERSION_BLOCK_SIZE];
+};
+
+static std::atomic<version_block_t *> version_blocks[VERSION_BLOCK_COUNT];
+
+// what readers get for a page whose block is missing, never written to
+static page_version_t untouched;
+#else
+static page_version_t page_versions[STATE_PAGE_COUNT];
+#endif // SPARSE_STATE
+
+/**
+ * @param alloc allocate the page's block when missing, for writers
+ * @return the page's versions. With SPARSE_STATE and !alloc, a never written
+ *         page when its block is missing
+ */
+static page_version_t &page_version(uint64_t page, bool alloc) {
+#ifdef SPARSE_STATE
+  std::atomic<version_block_t *> &b = version_blocks[page / VERSION_BLOCK_SIZE];
+
+  version_block_t *p = b.load(std::memory_order_acquire);
+  if (p == nullptr) {
+    if (!alloc)
+      return untouched;
+
+    version_block_t *n = new version_block_t();
+
+    if (b.compare_exchange_strong(p, n, std::memory_order_acq_rel))
+      p = n;
+    else
+      delete n;
+  }
+
+  return p->pages[page % VERSION_BLOCK_SIZE];
+#else
+  (void)alloc;
+  return page_versions[page];
+#endif // SPARSE_STATE
+}
+
+/**
+ * @brief Free every page's change ring, and the version blocks with
+ *        SPARSE_STATE. Nothing may write or read the state anymore.
+ */
+static void free_page_versions() {
+  auto free_changes = [](page_version_t &v) {
+    delete v.changes.exchange(nullptr, std::memory_order_acq_rel);
+  };
+
+#ifdef SPARSE_STATE
+  for (std::atomic<version_block_t *> &b : version_blocks) {
+    version_block_t *p = b.exchange(nullptr, std::memory_order_acq_rel);
+    if (p == nullptr)
+      continue;
+
+    for (page_version_t &v : p->pages)
+      free_changes(v);
+
+    delete p;
+  }
+#else
+  for (page_version_t &v : page_versions)
+    free_changes(v);
+#endif // SPARSE_STATE
+}
+
+// a page under a toggle storm might never be quiet for a whole read
+constexpr int PAGE_READ_MAX_RETRY = 16;
+
+static uint64_t make_version_base() {
+  std::random_device rd;
+  uint64_t r = ((uint64_t)rd() << 32) | rd();
+
+  // plenty of room below INT64_MAX, never 0
+  return ((r & ((1ULL << 61) - 1)) & ~0xffffffffULL) | (1ULL << 40);
+}
+
+// versions are reported offset by this, a version a client kept from a
+// previous run won't match a version of this run
+static const uint64_t version_base = make_version_base();
+
+/**
+ * @param offset checkbox offset within the page
+ */
+static void page_write_begin(uint64_t page, uint32_t offset) {
+  page_version_t &v = page_version(page, true);
+  const uint64_t ticket = v.begin.fetch_add(1, std::memory_order_relaxed);
+
+  page_changes_t *c = v.changes.load(std::memory_order_acquire);
+  if (c == nullptr) {
+    page_changes_t *n = new page_changes_t();
+
+    if (v.changes.compare_exchange_strong(c, n, std::memory_order_acq_rel))
+      c = n;
+    else
+      delete n;
+  }
+
+  // pairs with the acquire fence in copy_state_page and get_page_changes
+  std::atomic_thread_fence(std::memory_order_release);
+
+  c->offsets[ticket % PAGE_CHANGE_RING_SIZE].store(offset,
+                                                   std::memory_order_relaxed);
+}
+
+static void page_write_end(uint64_t page) {
+  page_version_t &v = page_version(page, true);
+
+  v.end.fetch_add(1, std::memory_order_release);
+  // a plain store on a line the write already owns
+  v.dirty.store(true, std::memory_order_release);
+}
+
+/**
+ * @return whether the page was written since the last call
+ */
+static bool take_dirty(uint64_t page) {
+  std::atomic<bool> &d = page_version(page, false).dirty;
+
+  return d.load(std::memory_order_relaxed) &&
+         d.exchange(false, std::memory_order_acquire);
+}
 
+// only serializes whole state operations (load, save, map, reset), toggles and
+// reads are lock-free atomics on cboxes
 std::mutex cb_m;
-std::mutex gv_m;
 
 cbox_lock_guard_t::cbox_lock_guard_t() : lk(cb_m) {}
 
+#ifndef SPARSE_STATE
+/**
+ * active checkbox counting kernels, each counts n elements starting from p
+ */
+using count_kernel_t = uint64_t (*)(const CBOX_T *p, size_t n);
+
+static uint64_t count_active_scalar(const CBOX_T *p, size_t n) {
+  uint64_t c = 0;
+  for (size_t i = 0; i < n; i++) {
+#ifdef WITH_COLOR
+    c += p[i].a & 1;
+#else
+    c += __builtin_popcountll(p[i]);
+#endif // WITH_COLOR
+  }
+
+  return c;
+}
+
+#ifdef ATCB_X86_KERNELS
+__attribute__((target("popcnt"))) static uint64_t
+count_active_popcnt(const CBOX_T *p, size_t n) {
+  return count_active_scalar(p, n);
+}
+
+__attribute__((target("avx2"))) static uint64_t
+count_active_avx2(const CBOX_T *p, size_t n) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i acc = zero;
+  size_t i = 0;
+
+#ifdef WITH_COLOR
+  // bit 0 of a is bit 24 of each 32-bit lane
+  const __m256i active = _mm256_set1_epi32(1 << 24);
+  constexpr size_t per_vec = sizeof(__m256i) / sizeof(CBOX_T);
+
+  for (; i + per_vec <= n; i += per_vec) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    __m256i b = _mm256_srli_epi32(_mm256_and_si256(v, active), 24);
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(b, zero));
+  }
+#else
+  // nibble lookup popcount (Mula), byte counts summed with sad
+  const __m256i lookup =
+      _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1,
+                       2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  constexpr size_t per_vec = sizeof(__m256i) / sizeof(CBOX_T);
+
+  for (; i + per_vec <= n; i += per_vec) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    __m256i lo = _mm256_and_si256(v, low_mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+    __m256i b = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                                _mm256_shuffle_epi8(lookup, hi));
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(b, zero));
+  }
+#endif // WITH_COLOR
+
+  uint64_t c = (uint64_t)_mm256_extract_epi64(acc, 0) +
+               (uint64_t)_mm256_extract_epi64(acc, 1) +
+               (uint64_t)_mm256_extract_epi64(acc, 2) +
+               (uint64_t)_mm256_extract_epi64(acc, 3);
+
+  return c + count_active_popcnt(p + i, n - i);
+}
+#endif // ATCB_X86_KERNELS
+
+static std::pair<count_kernel_t, const char *> get_count_kernel() {
+#ifdef ATCB_X86_KERNELS
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2"))
+    return {count_active_avx2, "avx2"};
+
+  if (__builtin_cpu_supports("popcnt"))
+    return {count_active_popcnt, "popcnt"};
+#endif // ATCB_X86_KERNELS
+
+  return {count_active_scalar, "scalar"};
+}
+
+/**
+ * @brief Count active checkboxes in p, splitting it across every core.
+ * @param tag log prefix for the timing line
+ */
+static uint64_t count_active(const CBOX_T *p, size_t n, const char *tag) {
+  const auto start = std::chrono::steady_clock::now();
+  const auto kernel = get_count_kernel();
+
+  // not worth a thread below this many elements
+  constexpr size_t min_per_thread = 1 << 20;
+
+  size_t tc = std::thread::hardware_concurrency();
+  tc = std::max<size_t>(1, std::min(tc, n / min_per_thread));
+
+  std::vector<uint64_t> counts(tc, 0);
+  std::vector<std::thread> threads;
+  threads.reserve(tc - 1);
+
+  const size_t per_thread = n / tc;
+  for (size_t t = 1; t < tc; t++) {
+    const size_t b = t * per_thread;
+    const size_t e = t == tc - 1 ? n : b + per_thread;
+
+    threads.emplace_back([&counts, &kernel, p, t, b, e]() {
+      counts[t] = kernel.first(p + b, e - b);
+    });
+  }
+
+  counts[0] = kernel.first(p, tc == 1 ? n : per_thread);
+
+  uint64_t c = 0;
+  for (size_t t = 0; t < tc; t++) {
+    if (t > 0)
+      threads[t - 1].join();
+
+    c += counts[t];
+  }
+
+  const std::chrono::duration<double, std::milli> took =
+      std::chrono::steady_clock::now() - start;
+
+  fprintf(stderr,
+          "[%s] Counted %lu active checkbox(es) in %.3f ms (%zu thread(s), "
+          "%s)\n",
+          tag, c, took.count(), tc, kernel.second);
+
+  return c;
+}
+#endif // SPARSE_STATE
+
+/**
+ * @brief Count active checkboxes in the whole state.
+ * @param tag log prefix for the timing line
+ */
+static uint64_t count_state(const char *tag) {
+#ifdef SPARSE_STATE
+  const auto start = std::chrono::steady_clock::now();
+  const uint64_t c = sparse::count_active();
+
+  const std::chrono::duration<double, std::milli> took =
+      std::chrono::steady_clock::now() - start;
+
+  fprintf(stderr, "[%s] Counted %lu active checkbox(es) in %.3f ms (sparse)\n",
+          tag, c, took.count());
+
+  return c;
+#else
+  return count_active(cboxes, STATE_ELEMENT_COUNT, tag);
+#endif // SPARSE_STATE
+}
+
+static int pwrite_all(int fd, const void *data, uint64_t len, uint64_t off) {
+  const char *p = (const char *)data;
+
+  while (len > 0) {
+    ssize_t w = pwrite(fd, p, len, off);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+
+      return -1;
+    }
+
+    p += w;
+    off += w;
+    len -= w;
+  }
+
+  return 0;
+}
+
+#ifdef SPARSE_STATE
+static int pread_all(int fd, void *data, uint64_t len, uint64_t off) {
+  char *p = (char *)data;
+
+  while (len > 0) {
+    ssize_t r = pread(fd, p, len, off);
+    if (r < 0 && errno == EINTR)
+      continue;
+
+    // the file is sized up front, it can't end early
+    if (r <= 0)
+      return -1;
+
+    p += r;
+    off += r;
+    len -= r;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Zero a range of the state file, freeing its blocks when the
+ *        filesystem can.
+ */
+static int punch_hole(int fd, uint64_t off, uint64_t len) {
+  if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) == 0)
+    return 0;
+
+  if (errno != EOPNOTSUPP) {
+    perror("[punch_hole ERROR] fallocate");
+    return -1;
+  }
+
+  static const std::string zeros(STATE_PAGE_SIZE_BYTES, '\0');
+
+  for (uint64_t n = 0; n < len; n += zeros.size()) {
+    const uint64_t w = std::min<uint64_t>(zeros.size(), len - n);
+
+    if (pwrite_all(fd, zeros.data(), w, off + n) != 0) {
+      perror("[punch_hole ERROR] pwrite");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static bool is_zero(const char *p, uint64_t n) {
+  return n == 0 || (p[0] == 0 && memcmp(p, p + 1, n - 1) == 0);
+}
+
+/**
+ * @brief Write a page at off, its all zero filesystem blocks as holes, so a
+ *        single set checkbox doesn't allocate its whole page.
+ * @param punch punch the holes, a new file already has them
+ * @return 0 success, -1 err
+ */
+static int write_page(int fd, const char *p, uint64_t off, bool punch) {
+  constexpr uint64_t block = state_io::ALIGN;
+  uint64_t pos = 0;
+
+  while (pos < STATE_PAGE_SIZE_BYTES) {
+    uint64_t end = pos;
+    bool zero = true;
+
+    // blocks alike in one go, block boundaries are file offsets
+    while (end < STATE_PAGE_SIZE_BYTES) {
+      const uint64_t next = std::min<uint64_t>(
+          STATE_PAGE_SIZE_BYTES, (off + end) / block * block + block - off);
+      const bool z = is_zero(p + end, next - end);
+
+      if (end > pos && z != zero)
+        break;
+
+      zero = z;
+      end = next;
+    }
+
+    if (!zero && pwrite_all(fd, p + pos, end - pos, off + pos) != 0) {
+      perror("[write_page ERROR] pwrite");
+      return -1;
+    }
+
+    if (zero && punch && punch_hole(fd, off + pos, end - pos) != 0)
+      return -1;
+
+    pos = end;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Read the data of a (sparse) state file chunk by chunk, holes are
+ *        skipped and stay empty chunks.
+ * @return bytes covered (STATE_SIZE_BYTES), -1 err
+ */
+static int64_t read_sparse_state(const char *filepath) {
+  int fd = open(filepath, O_RDONLY);
+  if (fd == -1) {
+    perror("[load_state ERROR]");
+    return -1;
+  }
+
+  sparse::clear();
+
+  constexpr uint64_t chunk_bytes = sparse::CHUNK_SIZE_BYTES;
+  std::vector<CBOX_T> buf(sparse::CHUNK_ELEMENT_COUNT);
+  int64_t status = STATE_SIZE_BYTES;
+  uint64_t data = 0;
+
+  // a filesystem without SEEK_DATA reports the whole file as data
+  off_t off = lseek(fd, 0, SEEK_DATA);
+  while (off >= 0) {
+    off_t hole = lseek(fd, off, SEEK_HOLE);
+    if (hole < 0)
+      hole = STATE_SIZE_BYTES;
+
+    const uint64_t end = (hole + chunk_bytes - 1) / chunk_bytes;
+    for (uint64_t c = off / chunk_bytes; c < end; c++) {
+      const uint64_t at = c * chunk_bytes;
+      const uint64_t len = std::min(chunk_bytes, STATE_SIZE_BYTES - at);
+
+      // the state doesn't end on a chunk boundary
+      if (len < chunk_bytes)
+        std::fill(buf.begin(), buf.end(), CBOX_T{});
+
+      if (pread_all(fd, buf.data(), len, at) != 0) {
+        perror("[load_state ERROR] pread");
+        status = -1;
+        break;
+      }
+
+      sparse::set_chunk(c, buf.data());
+      data += len;
+    }
+
+    if (status < 0)
+      break;
+
+    off = lseek(fd, end * chunk_bytes, SEEK_DATA);
+  }
+
+  // ENXIO is no data past off
+  if (off < 0 && errno != ENXIO) {
+    perror("[load_state ERROR] lseek");
+    status = -1;
+  }
+
+  close(fd);
+
+  fprintf(stderr, "[load_state] Read %lu byte(s) of data\n", data);
+
+  return status;
+}
+#endif // SPARSE_STATE
+
 static int load_state(const char *filepath) {
   fprintf(stderr, "[load_state] Loading `%s`\n", filepath);
 
   std::lock_guard lk(cb_m);
-  std::lock_guard lj(gv_m);
 
-  FILE *f = util::try_open(filepath, "rb");
+  struct stat st;
+  if (stat(filepath, &st) != 0) {
+    perror("[load_state ERROR]");
+    return -1;
+  }
+
+  gv_set(0);
+
+  // read straight into cboxes, a file of any other size is corrupt
+  int64_t read = st.st_size;
+  if ((uint64_t)st.st_size == STATE_SIZE_BYTES)
+#ifdef SPARSE_STATE
+    read = read_sparse_state(filepath);
+#else
+    read = state_io::read_file(filepath, cboxes, STATE_SIZE_BYTES);
+#endif // SPARSE_STATE
+
+  const size_t total_el = read > 0 ? read / STATE_ELEMENT_SIZE : 0;
+  fprintf(stderr, "[load_state] Read %zu elements from `%s`\n", total_el,
+          filepath);
+
+  if ((uint64_t)read != STATE_SIZE_BYTES) {
+    fprintf(stderr, "[load_state FATAL] Corrupted state file (total_el != "
+                    "STATE_ELEMENT_COUNT)\n");
+
+    fprintf(stderr, "\nIf this state file ever valid before, try running the "
+                    "migrate command:\n\n");
+
+    fprintf(stderr, "\t%s migrate '%s'\n\n", runbin, filepath);
+
+    fprintf(stderr, "Exiting...\n");
+
+    exit(3);
+  }
+
+  gv_set(count_state("load_state"));
+  state_file_synced = true;
+
+  fprintf(stderr, "[load_state] Loaded state `%s`\n", filepath);
+
+  return 0;
+}
+
+#ifdef SPARSE_STATE
+/**
+ * @brief Pages with a set checkbox are written to a file next to the state
+ *        file, sized up front so every other page is a hole, and renamed over
+ *        the state file once on disk. Pages are copied like page downloads
+ *        are, a page too busy for a consistent copy stays dirty.
+ */
+static int save_state(const char *filepath) {
+  fprintf(stderr, "[save_state] Saving state to `%s`\n", filepath);
+
+  std::lock_guard lk(cb_m);
+
+  const std::string tmp = std::string(filepath) + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    perror("[save_state ERROR] open");
+    return -1;
+  }
+
+  int status = 0;
+  if (ftruncate(fd, STATE_SIZE_BYTES) != 0) {
+    perror("[save_state ERROR] ftruncate");
+    status = 1;
+  }
+
+  std::string page_copy;
+  uint64_t wrote = 0;
+  uint64_t busy = 0;
+  for (uint64_t page = 0; status == 0 && page < STATE_PAGE_COUNT; page++) {
+    take_dirty(page);
+
+    if (sparse::empty(page * STATE_ELEMENT_PER_PAGE, STATE_ELEMENT_PER_PAGE))
+      continue;
+
+    if (copy_state_page(page, page_copy) != 0) {
+      page_version(page, true).dirty.store(true, std::memory_order_relaxed);
+      busy++;
+    }
+
+    if (write_page(fd, page_copy.data(), page * STATE_PAGE_SIZE_BYTES,
+                   false) != 0)
+      status = 1;
+
+    wrote++;
+  }
+
+  fprintf(stderr, "[save_state] Wrote %lu page(s) to `%s`, %lu busy page(s)\n",
+          wrote, tmp.c_str(), busy);
+
+  if (status == 0 && fsync(fd) != 0) {
+    perror("[save_state ERROR] fsync");
+    status = 1;
+  }
+
+  close(fd);
+
+  if (status == 0 && rename(tmp.c_str(), filepath) != 0) {
+    perror("[save_state ERROR] rename");
+    status = 1;
+  }
+
+  return status;
+}
+
+// chunks live on the heap, there's nothing to map
+static int map_state(const char *filepath) {
+  fprintf(stderr, "[map_state ERROR] Can't map `%s`, the sparse state is "
+                  "loaded and saved\n",
+          filepath);
+
+  return -1;
+}
+
+static int sync_state() { return -1; }
+
+static int unmap_state(bool) { return -1; }
+#else
+/**
+ * @brief Streamed page by page to a file next to the state file and renamed
+ *        over it once on disk, a crash while saving leaves the previous state
+ *        intact. Pages are copied like page downloads are, toggles never wait:
+ *        every page is written at a single version, a page that was too busy
+ *        for a consistent copy stays dirty for the next snapshot.
+ */
+static int save_state(const char *filepath) {
+  fprintf(stderr, "[save_state] Saving state to `%s`\n", filepath);
+
+  std::lock_guard lk(cb_m);
+
+  const std::string tmp = std::string(filepath) + ".tmp";
+  state_io::writer_t *w = state_io::open_writer(tmp.c_str());
+  int status = 0;
+
+  if (!w)
+    return -1;
+
+  std::string page_copy;
+  size_t wrote = 0;
+  uint64_t busy = 0;
+  for (uint64_t page = 0; page < STATE_PAGE_COUNT; page++) {
+    take_dirty(page);
+
+    if (copy_state_page(page, page_copy) != 0) {
+      page_version(page, true).dirty.store(true, std::memory_order_relaxed);
+      busy++;
+    }
+
+    if (state_io::write(w, page_copy.data(), STATE_PAGE_SIZE_BYTES) != 0)
+      break;
+
+    wrote += STATE_ELEMENT_PER_PAGE;
+  }
+
+  fprintf(stderr, "[save_state] Wrote %zu elements to `%s`, %lu busy page(s)\n",
+          wrote, tmp.c_str(), busy);
+
+  // written out and synced by close_writer
+  if (state_io::close_writer(w) != 0 || wrote != STATE_ELEMENT_COUNT) {
+    fprintf(stderr, "[save_state ERROR] Failed saving state to `%s`\n",
+            filepath);
+
+    status = 1;
+  }
+
+  if (status == 0 && rename(tmp.c_str(), filepath) != 0) {
+    perror("[save_state ERROR] rename");
+    status = 1;
+  }
+
+  return status;
+}
+
+/**
+ * @brief Map the state file as cboxes, creating it when it doesn't exist yet.
+ *        Dirty pages are written back by the kernel, nothing to load or save.
+ */
+static int map_state(const char *filepath) {
+  fprintf(stderr, "[map_state] Mapping `%s`\n", filepath);
+
+  std::lock_guard lk(cb_m);
+
+  int fd = open(filepath, O_RDWR | O_CREAT, 0644);
+  if (fd == -1) {
+    perror("[map_state ERROR]");
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    perror("[map_state ERROR] fstat");
+    close(fd);
+    return -1;
+  }
+
+  if (st.st_size == 0) {
+    fprintf(stderr, "[map_state] Creating new state file `%s`\n", filepath);
+
+    // sparse file, reads as all zero
+    if (ftruncate(fd, STATE_SIZE_BYTES) != 0) {
+      perror("[map_state ERROR] ftruncate");
+      close(fd);
+      return -1;
+    }
+  } else if ((uint64_t)st.st_size != STATE_SIZE_BYTES) {
+    fprintf(stderr, "[map_state FATAL] Corrupted state file (st_size != "
+                    "STATE_SIZE_BYTES)\n");
+
+    fprintf(stderr, "\nIf this state file ever valid before, try running the "
+                    "migrate command:\n\n");
+
+    fprintf(stderr, "\t%s migrate '%s'\n\n", runbin, filepath);
+
+    fprintf(stderr, "Exiting...\n");
+
+    exit(3);
+  }
+
+  void *m = mmap(NULL, STATE_SIZE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 fd, 0);
+
+  // the mapping keeps its own reference to the file
+  close(fd);
+
+  if (m == MAP_FAILED) {
+    perror("[map_state ERROR] mmap");
+    return -1;
+  }
+
+  cboxes = (CBOX_T *)m;
+  state_mapped = true;
+  state_file_synced = true;
+
+  gv_set(count_active(cboxes, STATE_ELEMENT_COUNT, "map_state"));
+
+  fprintf(stderr, "[map_state] Mapped %zu bytes from `%s`\n", STATE_SIZE_BYTES,
+          filepath);
+
+  return 0;
+}
+
+static int sync_state() {
+  std::lock_guard lk(cb_m);
+
+  if (msync(cboxes, STATE_SIZE_BYTES, MS_SYNC) != 0) {
+    perror("[sync_state ERROR] msync");
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * @param sync msync before unmapping, blocking until the state is on disk
+ */
+static int unmap_state(bool sync) {
+  std::lock_guard lk(cb_m);
+
+  if (!state_mapped) {
+    fprintf(stderr, "[unmap_state ERROR] State not mapped\n");
+    return -1;
+  }
+
   int status = 0;
+  if (sync) {
+    fprintf(stderr, "[unmap_state] Syncing state...\n");
+
+    if (msync(cboxes, STATE_SIZE_BYTES, MS_SYNC) != 0) {
+      perror("[unmap_state ERROR] msync");
+      status = 1;
+    }
+  }
+
+  if (munmap(cboxes, STATE_SIZE_BYTES) != 0) {
+    perror("[unmap_state ERROR] munmap");
+    status = 1;
+  }
+
+#ifdef USE_MALLOC
+  cboxes = NULL;
+#else
+  cboxes = cboxes_data;
+#endif // USE_MALLOC
+  state_mapped = false;
+
+  return status;
+}
+
+#endif // SPARSE_STATE
+
+// !TODO: make a command for this or smt
+static int reset_state() {
+  std::lock_guard lk(cb_m);
+
+#ifdef SPARSE_STATE
+  sparse::clear();
+#else
+  memset(cboxes, 0, STATE_SIZE_BYTES);
+#endif // SPARSE_STATE
+  gv_set(0);
+  state_file_synced = false;
+
+  fprintf(stderr, "[reset_state] State resetted\n");
+
+  return 0;
+}
+
+#ifndef WITH_COLOR
+/**
+ * @param c column (index)
+ * @param bit zero based (0-63)
+ * @return 0 off, 1 on, -1 err
+ */
+static int switch_c(uint64_t c, uint64_t bit) {
+  if (c > STATE_MAX_INDEX)
+    return -1;
+
+  const uint64_t page = c / STATE_ELEMENT_PER_PAGE;
+  const uint64_t offset = (c % STATE_ELEMENT_PER_PAGE) * STATE_PER_ELEMENT;
+
+  std::unique_lock<std::mutex> jlk;
+  if (journal::running())
+    jlk = journal::lock(page);
+
+  page_write_begin(page, offset + bit);
+
+#ifdef SPARSE_STATE
+  const int ret = sparse::toggle(c * STATE_PER_ELEMENT + bit);
+#else
+  const uint64_t b = (uint64_t)1 << bit;
+
+  // the previous word tells whether we turned it on or off
+  const uint64_t prev = __atomic_fetch_xor(cboxes + c, b, __ATOMIC_RELAXED);
+
+  const int ret = (prev & b) == 0 ? 1 : 0;
+#endif // SPARSE_STATE
+
+  page_write_end(page);
+
+  if (jlk.owns_lock())
+    journal::append(page, c * STATE_PER_ELEMENT + bit, ret);
+
+  gv_add(ret ? 1 : -1);
+
+  return ret;
+}
+#endif // WITH_COLOR
+
+[[maybe_unused]] static std::pair<uint64_t, uint64_t> get_cb(uint64_t i) {
+#ifdef WITH_COLOR
+  // is this function even used??
+  // lets keep it here for comedy, muhaha
+  return {i, 1};
+#else
+  uint64_t c = i > 0 ? i / 64 : 0;
+  uint64_t b = i > 0 ? i % 64 : 0;
 
-  if (!f)
+  return {c, b};
+#endif
+}
+
+#ifdef WITH_COLOR
+static void replay_apply(uint64_t i, const cbox_t &s) {
+#ifdef SPARSE_STATE
+  sparse::set(i, s);
+#else
+  cboxes[i] = s;
+#endif // SPARSE_STATE
+  page_version(i / STATE_ELEMENT_PER_PAGE, true).dirty = true;
+}
+#else
+static void replay_apply(uint64_t i, bool on) {
+#ifdef SPARSE_STATE
+  sparse::set(i, on);
+#else
+  auto cb = get_cb(i);
+  const uint64_t b = (uint64_t)1 << cb.second;
+
+  if (on)
+    cboxes[cb.first] |= b;
+  else
+    cboxes[cb.first] &= ~b;
+#endif // SPARSE_STATE
+
+  page_version(i / SIZE_PER_PAGE, true).dirty = true;
+}
+#endif // WITH_COLOR
+
+/**
+ * @brief Apply a journal left by a crash and save right away, so it never
+ *        replays over newer state when the next run doesn't journal.
+ * @return 0 success, -1 err
+ */
+static int recover_journal() {
+  int64_t n = 0;
+
+  {
+    std::lock_guard lk(cb_m);
+
+    n = journal::replay(statefile, replay_apply);
+    if (n <= 0)
+      return n == 0 ? 0 : -1;
+
+    gv_set(count_state("recover_journal"));
+  }
+
+  snapshot_stats_t st;
+  if (snapshot(st) != 0)
     return -1;
 
-  gv = 0;
-  constexpr size_t bufsiz = 1024;
-  CBOX_T temp[bufsiz] = {{}};
+  journal::drop(INT64_MAX);
+  return 0;
+}
+
+#ifdef SPARSE_STATE
+/**
+ * @brief Pages are materialized one at a time, a page left without a set
+ *        checkbox is punched out of the file.
+ * @param fd state file, off and len page aligned
+ * @return 0 success, -1 err
+ */
+static int write_range(int fd, uint64_t off, uint64_t len) {
+  // snapshots are serialized
+  static std::string page;
+  page.resize(STATE_PAGE_SIZE_BYTES);
+
+  for (; len > 0; off += STATE_PAGE_SIZE_BYTES, len -= STATE_PAGE_SIZE_BYTES) {
+    const uint64_t first = off / STATE_ELEMENT_SIZE;
+
+    if (sparse::empty(first, STATE_ELEMENT_PER_PAGE) ||
+        !sparse::read(first, STATE_ELEMENT_PER_PAGE, (CBOX_T *)page.data())) {
+      if (punch_hole(fd, off, STATE_PAGE_SIZE_BYTES) != 0)
+        return -1;
+
+      continue;
+    }
 
-  size_t total_el = 0;
-  ssize_t read = 0;
-  while ((read = fread(temp, STATE_ELEMENT_SIZE, bufsiz, f)) > 0) {
-    size_t synched = 0;
-    for (size_t i = 0; i < read && (i + total_el) < STATE_ELEMENT_COUNT; i++) {
-      cboxes[i + total_el] = temp[i];
+    if (write_page(fd, page.data(), off, true) != 0)
+      return -1;
+  }
 
-#ifdef WITH_COLOR
-      if (temp[i].a & 1)
-        gv++;
+  return 0;
+}
 #else
-      uint64_t l = 1;
-      while (l) {
-        if (temp[i] & l)
-          gv++;
+/**
+ * @param fd state file, -1 when mapped
+ * @return 0 success, -1 err
+ */
+static int write_range(int fd, uint64_t off, uint64_t len) {
+  const char *p = (const char *)cboxes + off;
 
-        l <<= 1;
-      }
-#endif // WITH_COLOR
+  if (fd == -1) {
+    // msync wants a page aligned address
+    static const uint64_t os_page = sysconf(_SC_PAGESIZE);
+    const uint64_t pad = (uintptr_t)p % os_page;
 
-      synched++;
+    if (msync((void *)(p - pad), len + pad, MS_SYNC) != 0) {
+      perror("[snapshot ERROR] msync");
+      return -1;
     }
 
-    if (synched != read) {
-      fprintf(stderr, "[load_state ERROR] Corrupted state file (synched != "
-                      "read), probably code error.\nExiting...\n");
-
-      exit(2);
-    }
+    return 0;
+  }
 
-    total_el += read;
+  if (pwrite_all(fd, p, len, off) != 0) {
+    perror("[snapshot ERROR] pwrite");
+    return -1;
   }
 
-  fprintf(stderr, "[load_state] Read %zu elements from `%s`\n", total_el,
-          filepath);
+  return 0;
+}
+#endif // SPARSE_STATE
 
-  if (total_el != STATE_ELEMENT_COUNT) {
-    fprintf(stderr, "[load_state FATAL] Corrupted state file (total_el != "
-                    "STATE_ELEMENT_COUNT)\n");
+/**
+ * @brief Write the dirty pages in place, runs of them in one write. Caller
+ *        holds cb_m.
+ * @return 0 success, -1 err
+ */
+static int write_dirty_pages(snapshot_stats_t &st) {
+  int fd = -1;
+  if (!state_mapped) {
+    fd = open(statefile, O_WRONLY);
+    if (fd == -1) {
+      perror("[snapshot ERROR] open");
+      return -1;
+    }
+  }
 
-    fprintf(stderr, "\nIf this state file ever valid before, try running the "
-                    "migrate command:\n\n");
+  int status = 0;
+  uint64_t page = 0;
+  while (page < STATE_PAGE_COUNT) {
+    if (!take_dirty(page)) {
+      page++;
+      continue;
+    }
 
-    fprintf(stderr, "\t%s migrate '%s'\n\n", runbin, filepath);
+    uint64_t end = page + 1;
+    while (end < STATE_PAGE_COUNT && take_dirty(end))
+      end++;
 
-    fprintf(stderr, "Exiting...\n");
+    const uint64_t off = page * STATE_PAGE_SIZE_BYTES;
+    const uint64_t len = (end - page) * STATE_PAGE_SIZE_BYTES;
+    if (write_range(fd, off, len) != 0) {
+      status = -1;
+      break;
+    }
 
-    exit(3);
+    st.pages += end - page;
+    st.bytes += len;
+    page = end;
   }
 
-  fprintf(stderr, "[load_state] Loaded state `%s`\n", filepath);
+  if (fd != -1) {
+    if (status == 0 && fdatasync(fd) != 0) {
+      perror("[snapshot ERROR] fdatasync");
+      status = -1;
+    }
 
-  fclose(f);
-  f = NULL;
+    close(fd);
+  }
 
   return status;
 }
 
-static int save_state(const char *filepath) {
-  fprintf(stderr, "[save_state] Saving state to `%s`\n", filepath);
+static std::mutex snapshot_m;
 
-  std::lock_guard lk(cb_m);
+int snapshot(snapshot_stats_t &st) {
+  std::lock_guard slk(snapshot_m);
 
-  FILE *f = util::try_open(filepath, "wb");
-  int status = 0;
+  st = {};
+  const auto start = std::chrono::steady_clock::now();
 
-  if (!f)
+  // every record of the closed segments is in a page already marked dirty
+  int64_t closed = -1;
+  if (journal::running() && journal::rotate(closed) != 0)
     return -1;
 
-  ssize_t wrote = fwrite(cboxes, STATE_ELEMENT_SIZE, STATE_ELEMENT_COUNT, f);
-  fprintf(stderr, "[save_state] Wrote %zu elements to `%s`\n", wrote, filepath);
-
-  if (wrote != STATE_ELEMENT_COUNT) {
-    fprintf(stderr, "[save_state ERROR] Failed saving state to `%s`\n",
-            filepath);
+  int status = 0;
+  if (state_file_synced) {
+    std::lock_guard lk(cb_m);
+    status = write_dirty_pages(st);
+  } else {
+    // the file doesn't match, every page goes out
+    if (state_mapped) {
+      for (uint64_t page = 0; page < STATE_PAGE_COUNT; page++)
+        take_dirty(page);
+
+      status = sync_state();
+    } else {
+      status = save_state(statefile);
+    }
 
-    status = 1;
+    st.full = true;
+    st.pages = STATE_PAGE_COUNT;
+    st.bytes = STATE_SIZE_BYTES;
   }
 
-  fclose(f);
-  f = NULL;
-
-  return status;
-}
+  // pages already taken might not have made it, write everything next time
+  if (status != 0) {
+    state_file_synced = false;
+    return -1;
+  }
 
-// !TODO: make a command for this or smt
-static int reset_state() {
-  std::lock_guard lk(cb_m);
-  std::lock_guard lj(gv_m);
+  state_file_synced = true;
 
-  memset(cboxes, 0, STATE_SIZE_BYTES);
-  gv = 0;
+  if (closed >= 0)
+    journal::drop(closed);
 
-  fprintf(stderr, "[reset_state] State resetted\n");
+  const std::chrono::duration<double, std::milli> took =
+      std::chrono::steady_clock::now() - start;
+  st.ms = took.count();
 
   return 0;
 }
 
-/**
- * @param c column (index)
- * @param bit zero based (0-63)
- * @return 0 off, 1 on, -1 err
- */
-static int switch_c(uint64_t c, [[maybe_unused]] uint64_t bit) {
-  if (c > STATE_MAX_INDEX)
-    return -1;
-
-  uint64_t b = 1;
-#ifdef WITH_COLOR
-#define CMP cboxes[c].a
-#else
-#define CMP cboxes[c]
-  b <<= bit;
-
-  std::lock_guard lk(cb_m);
-  std::lock_guard lj(gv_m);
-#endif // WITH_COLOR
+static std::thread snapshot_thread;
+static std::mutex snapshot_wait_m;
+static std::condition_variable snapshot_cv;
+static bool snapshot_stop = false;
 
-  bool had = (CMP & b) != 0;
+static void run_snapshots() {
+  std::unique_lock lk(snapshot_wait_m);
 
-  CMP = had ? CMP & (~b) // remove if had it
-            : CMP | b;   // else add
+  while (!snapshot_cv.wait_for(lk, std::chrono::seconds(snapshot_s),
+                               []() { return snapshot_stop; })) {
+    lk.unlock();
 
-#undef CMP
+    snapshot_stats_t st;
+    if (snapshot(st) != 0)
+      fprintf(stderr, "[run_snapshots ERROR] Snapshot failed\n");
+    else if (st.pages > 0)
+      fprintf(stderr,
+              "[run_snapshots] Wrote %lu byte(s), %lu page(s) in %.3f ms\n",
+              st.bytes, st.pages, st.ms);
 
-  int ret = !had ? 1 : 0;
+    lk.lock();
+  }
+}
 
-  ret ? gv++ : gv--;
+static void start_snapshots() {
+  if (snapshot_s == 0)
+    return;
 
-  return ret;
+  snapshot_stop = false;
+  snapshot_thread = std::thread(run_snapshots);
 }
 
-[[maybe_unused]] static std::pair<uint64_t, uint64_t> get_cb(uint64_t i) {
-#ifdef WITH_COLOR
-  // is this function even used??
-  // lets keep it here for comedy, muhaha
-  return {i, 1};
-#else
-  uint64_t c = i > 0 ? i / 64 : 0;
-  uint64_t b = i > 0 ? i % 64 : 0;
+static void stop_snapshots() {
+  {
+    std::lock_guard lk(snapshot_wait_m);
+    snapshot_stop = true;
+  }
 
-  return {c, b};
-#endif
+  snapshot_cv.notify_one();
+
+  if (snapshot_thread.joinable())
+    snapshot_thread.join();
 }
 
 static void init_main() {
+  if (use_mmap) {
+    if (map_state(statefile) != 0)
+      exit(1);
+
+    return;
+  }
+
   init_state();
 
   load_state(statefile);
 }
 
 static void free_main(bool nosave) {
+  stop_snapshots();
+
+  // the journal is only dropped once the state made it to disk
+  const bool journaled = journal::stop() == 0;
+  int status = 1;
+
+  if (state_mapped) {
+    // the kernel still writes back dirty pages when nosave, we just don't
+    // wait for it
+    status = unmap_state(nosave == false);
+    free_page_versions();
+  } else {
 #ifdef USE_MALLOC
-  if (cboxes == NULL) {
-    fprintf(stderr, "[free_main ERROR] State freed\n");
-    return;
-  }
+    if (cboxes == NULL) {
+      fprintf(stderr, "[free_main ERROR] State freed\n");
+      return;
+    }
+#endif // USE_MALLOC
 
-  if (nosave == false)
-    save_state(statefile);
+    if (nosave == false) {
+      snapshot_stats_t st;
+      status = snapshot(st);
+    }
 
-  free(cboxes);
-  cboxes = NULL;
-#else
-  if (nosave == false)
-    save_state(statefile);
-#endif // USE_MALLOC
+    free_state();
+  }
+
+  if (journaled && nosave == false && status == 0)
+    journal::drop(INT64_MAX);
 }
 
 uint64_t get_gv() {
-  std::lock_guard lj(gv_m);
+  int64_t v = 0;
+  for (size_t i = 0; i < GV_SHARD_COUNT; i++)
+    v += gv[i].v.load(std::memory_order_relaxed);
 
-  return gv;
+  // shards are read one by one, never report a transient negative sum
+  return v > 0 ? v : 0;
 }
 
 #ifdef WITH_COLOR
@@ -253,10 +1297,13 @@ static int get_cv(uint64_t c, cbox_t &s) {
   if (c > STATE_MAX_INDEX)
     return -1;
 
-  std::lock_guard lk(cb_m);
-  s = cboxes[c];
+#ifdef SPARSE_STATE
+  return sparse::get(c, s);
+#else
+  __atomic_load(cboxes + c, &s, __ATOMIC_RELAXED);
 
-  return (cboxes[c].a & 1) ? 1 : 0;
+  return (s.a & 1) ? 1 : 0;
+#endif // SPARSE_STATE
 }
 
 /**
@@ -268,20 +1315,40 @@ int switch_state(uint64_t i, const CBOX_T &s) {
   if (i > STATE_MAX_INDEX)
     return -1;
 
-  std::lock_guard lk(cb_m);
-  std::lock_guard lj(gv_m);
+  const uint64_t page = i / STATE_ELEMENT_PER_PAGE;
 
-  uint8_t prev = cboxes[i].a & 1;
-  cboxes[i] = s;
+  cbox_t next;
 
-  // keep previous active state
-  if (prev != 0)
-    cboxes[i].a |= 1;
-  else
-    cboxes[i].a &= (~1);
+  std::unique_lock<std::mutex> jlk;
+  if (journal::running())
+    jlk = journal::lock(page);
+
+  page_write_begin(page, i % STATE_ELEMENT_PER_PAGE);
+
+#ifdef SPARSE_STATE
+  sparse::toggle(i, s, next);
+#else
+  cbox_t prev;
+  __atomic_load(cboxes + i, &prev, __ATOMIC_RELAXED);
+
+  // write the new color and flip the previous active state in one CAS
+  do {
+    next = s;
+    next.a = (s.a & (~1)) | ((prev.a & 1) ^ 1);
+  } while (!__atomic_compare_exchange(cboxes + i, &prev, &next, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+#endif // SPARSE_STATE
+
+  page_write_end(page);
+
+  if (jlk.owns_lock())
+    journal::append(page, i, next);
+
+  int ret = next.a & 1;
 
-  // actually do the toggle
-  return switch_c(i, 1);
+  gv_add(ret ? 1 : -1);
+
+  return ret;
 }
 
 /**
@@ -297,12 +1364,13 @@ static int get_cv(uint64_t c, uint64_t bit) {
   if (c > STATE_MAX_INDEX)
     return -1;
 
-  uint64_t b = 1;
-  b <<= bit;
-
-  std::lock_guard lk(cb_m);
+#ifdef SPARSE_STATE
+  return sparse::get(c * STATE_PER_ELEMENT + bit);
+#else
+  const uint64_t b = (uint64_t)1 << bit;
 
-  return (cboxes[c] & b) ? 1 : 0;
+  return (__atomic_load_n(cboxes + c, __ATOMIC_RELAXED) & b) ? 1 : 0;
+#endif // SPARSE_STATE
 }
 
 /**
@@ -327,19 +1395,126 @@ int get_state(uint64_t i) {
 #endif // WITH_COLOR
 
 std::pair<CBOX_T const *, size_t> get_state_page(uint64_t page) {
-  constexpr const size_t el_per_page = SIZE_PER_PAGE / STATE_PER_ELEMENT;
-  constexpr const size_t max_page = (A_TRILLION / SIZE_PER_PAGE) - 1;
-
-  if (page > max_page)
+  if (page >= STATE_PAGE_COUNT)
     return {NULL, 0};
 
-  return {cboxes + (page * el_per_page), el_per_page};
+#ifdef SPARSE_STATE
+  thread_local std::string copy;
+  copy_state_page(page, copy);
+
+  return {(CBOX_T const *)copy.data(), STATE_ELEMENT_PER_PAGE};
+#else
+  return {cboxes + (page * STATE_ELEMENT_PER_PAGE), STATE_ELEMENT_PER_PAGE};
+#endif // SPARSE_STATE
+}
+
+int copy_state_page(uint64_t page, std::string &out, uint64_t *version) {
+  if (page >= STATE_PAGE_COUNT)
+    return -1;
+
+  // after PAGE_READ_MAX_RETRY, every element is still copied atomically and
+  // the toggles are broadcasted anyway
+#ifndef SPARSE_STATE
+  const CBOX_T *src = cboxes + (page * STATE_ELEMENT_PER_PAGE);
+#endif // SPARSE_STATE
+  out.resize(STATE_PAGE_SIZE_BYTES);
+  CBOX_T *dst = (CBOX_T *)out.data();
+
+  for (int retry = 0; retry <= PAGE_READ_MAX_RETRY; retry++) {
+    const page_version_t &v = page_version(page, false);
+    const uint64_t e = v.end.load(std::memory_order_acquire);
+    const uint64_t b = v.begin.load(std::memory_order_acquire);
+
+#ifdef SPARSE_STATE
+    sparse::read(page * STATE_ELEMENT_PER_PAGE, STATE_ELEMENT_PER_PAGE, dst);
+#else
+    for (size_t i = 0; i < STATE_ELEMENT_PER_PAGE; i++)
+      __atomic_load(src + i, dst + i, __ATOMIC_RELAXED);
+#endif // SPARSE_STATE
+
+    // a writer still in progress or started meanwhile, try again
+    if (b != e)
+      continue;
+
+    // a first write to a page without versions yet allocates them
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (v.begin.load(std::memory_order_relaxed) != b ||
+        &page_version(page, false) != &v)
+      continue;
+
+    if (version)
+      *version = version_base + e;
+
+    return 0;
+  }
+
+  return 1;
+}
+
+int64_t get_page_version(uint64_t page) {
+  if (page >= STATE_PAGE_COUNT)
+    return -1;
+
+  return version_base +
+         page_version(page, false).end.load(std::memory_order_acquire);
+}
+
+int get_page_changes(uint64_t page, uint64_t since,
+                     std::vector<uint32_t> &offsets, uint64_t &version) {
+  if (page >= STATE_PAGE_COUNT)
+    return -1;
+
+  const page_version_t &v = page_version(page, false);
+
+  for (int retry = 0; retry <= PAGE_READ_MAX_RETRY; retry++) {
+    const uint64_t e = v.end.load(std::memory_order_acquire);
+    const uint64_t b = v.begin.load(std::memory_order_acquire);
+
+    if (b != e)
+      continue;
+
+    // not a version of this run
+    if (since < version_base || since - version_base > e)
+      return 1;
+
+    const uint64_t from = since - version_base;
+    if (e - from > PAGE_CHANGE_RING_SIZE)
+      return 1;
+
+    offsets.clear();
+
+    page_changes_t *c = v.changes.load(std::memory_order_acquire);
+    for (uint64_t t = from; t < e; t++) {
+      const auto &slot = c->offsets[t % PAGE_CHANGE_RING_SIZE];
+      offsets.push_back(slot.load(std::memory_order_relaxed));
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (v.begin.load(std::memory_order_relaxed) != b)
+      continue;
+
+    version = version_base + e;
+    return 0;
+  }
+
+  // too busy, the whole page it is
+  return 1;
 }
 
 void init_state() {
+#ifdef SPARSE_STATE
+  fprintf(stderr,
+          "[init_state] Sparse state, %lu chunk(s) of %lu checkboxes "
+          "allocated as they get set\n",
+          sparse::CHUNK_COUNT, sparse::CHUNK_SIZE);
+#endif // SPARSE_STATE
+
 #ifdef USE_MALLOC
   fprintf(stderr, "[init_state] Allocating %zu bytes...\n", STATE_SIZE_BYTES);
-  cboxes = (CBOX_T *)malloc(STATE_SIZE_BYTES);
+  // aligned for direct I/O, aligned_alloc wants a multiple of the alignment
+  cboxes = (CBOX_T *)aligned_alloc(
+      state_io::ALIGN, (STATE_SIZE_BYTES + state_io::ALIGN - 1) /
+                           state_io::ALIGN * state_io::ALIGN);
 
   if (cboxes == NULL) {
     // dont have enough ram? die
@@ -353,6 +1528,13 @@ void init_state() {
 }
 
 void free_state() {
+  free_page_versions();
+
+  if (state_mapped) {
+    unmap_state(false);
+    return;
+  }
+
 #ifdef USE_MALLOC
   if (cboxes == NULL) {
     fprintf(stderr, "[free_state ERROR] State freed\n");
@@ -361,6 +1543,8 @@ void free_state() {
 
   free(cboxes);
   cboxes = NULL;
+#elif defined(SPARSE_STATE)
+  sparse::clear();
 #endif
 }
 
@@ -370,12 +1554,67 @@ int get_port() {
   return port;
 }
 
+const char *get_statefile() { return statefile; }
+
+unsigned int get_threads() {
+  if (threads > 0)
+    return threads;
+
+  unsigned int hc = std::thread::hardware_concurrency();
+  return hc > 0 ? hc : 1;
+}
+
+unsigned int get_tick_ms() { return tick_ms; }
+
+compression_e get_compression() { return compression; }
+
+unsigned int get_max_backpressure() { return max_backpressure; }
+
+unsigned int get_max_payload() { return max_payload; }
+
+bool get_single_writer() { return single_writer; }
+
+unsigned int get_rate_limit() { return rate_limit; }
+
+unsigned int get_ip_rate_limit() { return ip_rate_limit; }
+
+unsigned int get_shed_bytes() { return shed_bytes; }
+
+static int parse_uint(const char *s, unsigned int &out) {
+  size_t idx = 0;
+
+  try {
+    long long v = std::stoll(s, &idx);
+    if (v < 0 || v > UINT_MAX || s[idx] != '\0')
+      return -1;
+
+    out = v;
+  } catch (...) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static int parse_compression(const char *s, compression_e &out) {
+  if (strcmp(s, "off") == 0)
+    out = COMPRESSION_OFF;
+  else if (strcmp(s, "shared") == 0)
+    out = COMPRESSION_SHARED;
+  else if (strcmp(s, "dedicated") == 0)
+    out = COMPRESSION_DEDICATED;
+  else
+    return -1;
+
+  return 0;
+}
+
 ////////////////////
 
 static void print_help() {
   fprintf(stderr, "Usage: %s [COMMAND] [OPTION...]\n\n", runbin);
 
-  constexpr const char roptfmt[] = "  %2s, %-8s %-24s %s\n";
+  constexpr const char roptfmt[] = "  %2s, %-18s %-24s %s\n";
   constexpr const char cfmt[] = "  %-12s %-24s %s\n";
 
   fprintf(stderr, "Run options:\n");
@@ -383,6 +1622,33 @@ static void print_help() {
   fprintf(stderr, roptfmt, "-s", "--state", "</path/to/state.atcb>",
           "Use this state file.");
   fprintf(stderr, roptfmt, "-p", "--port", "<PORT>", "Listening port.");
+  fprintf(stderr, roptfmt, "-m", "--mmap", "",
+          "Map the state file instead of loading and saving it.");
+  fprintf(stderr, roptfmt, "-t", "--threads", "<N>",
+          "Server threads sharing the port, 0 for one per core.");
+  fprintf(stderr, roptfmt, "", "--tick", "<MS>",
+          "Batch broadcasted state changes every MS milliseconds.");
+  fprintf(stderr, roptfmt, "-c", "--compression", "<off|shared|dedicated>",
+          "permessage-deflate mode, off by default.");
+  fprintf(stderr, roptfmt, "", "--max-backpressure", "<BYTES>",
+          "Per connection send buffer limit.");
+  fprintf(stderr, roptfmt, "", "--max-payload", "<BYTES>",
+          "Largest accepted message.");
+  fprintf(stderr, roptfmt, "-w", "--writer", "",
+          "Apply every toggle on one writer thread.");
+  fprintf(stderr, roptfmt, "-j", "--journal", "",
+          "Journal every toggle, replayed after a crash.");
+  fprintf(stderr, roptfmt, "", "--direct-io", "",
+          "Bypass the page cache loading and saving state.");
+  fprintf(stderr, roptfmt, "", "--snapshot", "<SECONDS>",
+          "Write changed pages (and fold the journal) this often, only at "
+          "shutdown by default.");
+  fprintf(stderr, roptfmt, "", "--rate", "<N>",
+          "Toggles per second per connection.");
+  fprintf(stderr, roptfmt, "", "--ip-rate", "<N>",
+          "Toggles per second per IP.");
+  fprintf(stderr, roptfmt, "", "--shed", "<BYTES>",
+          "Pause state changes to connections buffering more than this.");
   fprintf(stderr, "\n");
 
   fprintf(stderr, "Commands:\n");
@@ -414,6 +1680,24 @@ int run(const int argc, const char *const argv[]) {
   bool getstatefile = false;
   bool getport = false;
   bool portset = false;
+  bool getthreads = false;
+  bool threadsset = false;
+  bool gettick = false;
+  bool tickset = false;
+  bool getcompression = false;
+  bool compressionset = false;
+  bool getbackpressure = false;
+  bool backpressureset = false;
+  bool getpayload = false;
+  bool payloadset = false;
+  bool getrate = false;
+  bool rateset = false;
+  bool getiprate = false;
+  bool iprateset = false;
+  bool getshed = false;
+  bool shedset = false;
+  bool getsnapshot = false;
+  bool snapshotset = false;
   std::string migratefile = "";
 
   ARGV_LOOP({
@@ -428,6 +1712,104 @@ int run(const int argc, const char *const argv[]) {
       getstatefile = true;
     } else if (ARGCMP("--port") || ARGCMP("-p")) {
       getport = true;
+    } else if (ARGCMP("--mmap") || ARGCMP("-m")) {
+      use_mmap = true;
+    } else if (ARGCMP("--writer") || ARGCMP("-w")) {
+      single_writer = true;
+    } else if (ARGCMP("--journal") || ARGCMP("-j")) {
+      use_journal = true;
+    } else if (ARGCMP("--direct-io")) {
+      direct_io = true;
+    } else if (ARGCMP("--threads") || ARGCMP("-t")) {
+      getthreads = true;
+    } else if (getthreads) {
+      if (parse_uint(ARGVAL, threads) != 0) {
+        fprintf(stderr, "Invalid thread count, exiting...");
+        return -1;
+      }
+
+      threadsset = true;
+      getthreads = false;
+    } else if (ARGCMP("--tick")) {
+      gettick = true;
+    } else if (gettick) {
+      if (parse_uint(ARGVAL, tick_ms) != 0) {
+        fprintf(stderr, "Invalid tick, exiting...");
+        return -1;
+      }
+
+      tickset = true;
+      gettick = false;
+    } else if (ARGCMP("--compression") || ARGCMP("-c")) {
+      getcompression = true;
+    } else if (getcompression) {
+      if (parse_compression(ARGVAL, compression) != 0) {
+        fprintf(stderr, "Invalid compression, exiting...");
+        return -1;
+      }
+
+      compressionset = true;
+      getcompression = false;
+    } else if (ARGCMP("--max-backpressure")) {
+      getbackpressure = true;
+    } else if (getbackpressure) {
+      if (parse_uint(ARGVAL, max_backpressure) != 0) {
+        fprintf(stderr, "Invalid max backpressure, exiting...");
+        return -1;
+      }
+
+      backpressureset = true;
+      getbackpressure = false;
+    } else if (ARGCMP("--max-payload")) {
+      getpayload = true;
+    } else if (getpayload) {
+      if (parse_uint(ARGVAL, max_payload) != 0) {
+        fprintf(stderr, "Invalid max payload, exiting...");
+        return -1;
+      }
+
+      payloadset = true;
+      getpayload = false;
+    } else if (ARGCMP("--rate")) {
+      getrate = true;
+    } else if (getrate) {
+      if (parse_uint(ARGVAL, rate_limit) != 0) {
+        fprintf(stderr, "Invalid rate, exiting...");
+        return -1;
+      }
+
+      rateset = true;
+      getrate = false;
+    } else if (ARGCMP("--ip-rate")) {
+      getiprate = true;
+    } else if (getiprate) {
+      if (parse_uint(ARGVAL, ip_rate_limit) != 0) {
+        fprintf(stderr, "Invalid IP rate, exiting...");
+        return -1;
+      }
+
+      iprateset = true;
+      getiprate = false;
+    } else if (ARGCMP("--shed")) {
+      getshed = true;
+    } else if (getshed) {
+      if (parse_uint(ARGVAL, shed_bytes) != 0) {
+        fprintf(stderr, "Invalid shed size, exiting...");
+        return -1;
+      }
+
+      shedset = true;
+      getshed = false;
+    } else if (ARGCMP("--snapshot")) {
+      getsnapshot = true;
+    } else if (getsnapshot) {
+      if (parse_uint(ARGVAL, snapshot_s) != 0) {
+        fprintf(stderr, "Invalid snapshot interval, exiting...");
+        return -1;
+      }
+
+      snapshotset = true;
+      getsnapshot = false;
     } else if (getport) {
       size_t idx = std::string::npos;
 
@@ -466,6 +1848,106 @@ int run(const int argc, const char *const argv[]) {
       }
   }
 
+  if (!threadsset) {
+    char *envthreads = getenv("THREADS");
+
+    if (envthreads != NULL && parse_uint(envthreads, threads) != 0) {
+      fprintf(stderr, "Invalid THREADS variable, exiting...");
+      return -1;
+    }
+  }
+
+  if (!tickset) {
+    char *envtick = getenv("TICK_MS");
+
+    if (envtick != NULL && parse_uint(envtick, tick_ms) != 0) {
+      fprintf(stderr, "Invalid TICK_MS variable, exiting...");
+      return -1;
+    }
+  }
+
+  if (!compressionset) {
+    char *envcompression = getenv("COMPRESSION");
+
+    if (envcompression != NULL &&
+        parse_compression(envcompression, compression) != 0) {
+      fprintf(stderr, "Invalid COMPRESSION variable, exiting...");
+      return -1;
+    }
+  }
+
+  if (!backpressureset) {
+    char *envbackpressure = getenv("MAX_BACKPRESSURE");
+
+    if (envbackpressure != NULL &&
+        parse_uint(envbackpressure, max_backpressure) != 0) {
+      fprintf(stderr, "Invalid MAX_BACKPRESSURE variable, exiting...");
+      return -1;
+    }
+  }
+
+  if (!payloadset) {
+    char *envpayload = getenv("MAX_PAYLOAD");
+
+    if (envpayload != NULL && parse_uint(envpayload, max_payload) != 0) {
+      fprintf(stderr, "Invalid MAX_PAYLOAD variable, exiting...");
+      return -1;
+    }
+  }
+
+  if (!rateset) {
+    char *envrate = getenv("RATE_LIMIT");
+
+    if (envrate != NULL && parse_uint(envrate, rate_limit) != 0) {
+      fprintf(stderr, "Invalid RATE_LIMIT variable, exiting...");
+      return -1;
+    }
+  }
+
+  if (!iprateset) {
+    char *enviprate = getenv("IP_RATE_LIMIT");
+
+    if (enviprate != NULL && parse_uint(enviprate, ip_rate_limit) != 0) {
+      fprintf(stderr, "Invalid IP_RATE_LIMIT variable, exiting...");
+      return -1;
+    }
+  }
+
+  if (!shedset) {
+    char *envshed = getenv("SHED_BYTES");
+
+    if (envshed != NULL && parse_uint(envshed, shed_bytes) != 0) {
+      fprintf(stderr, "Invalid SHED_BYTES variable, exiting...");
+      return -1;
+    }
+  }
+
+  if (!snapshotset) {
+    char *envsnapshot = getenv("SNAPSHOT_S");
+
+    if (envsnapshot != NULL && parse_uint(envsnapshot, snapshot_s) != 0) {
+      fprintf(stderr, "Invalid SNAPSHOT_S variable, exiting...");
+      return -1;
+    }
+  }
+
+  if (!single_writer) {
+    char *envwriter = getenv("WRITER");
+    single_writer = envwriter != NULL && strcmp(envwriter, "1") == 0;
+  }
+
+  if (!use_journal) {
+    char *envjournal = getenv("JOURNAL");
+    use_journal = envjournal != NULL && strcmp(envjournal, "1") == 0;
+  }
+
+  if (!direct_io) {
+    char *envdirect = getenv("DIRECT_IO");
+    direct_io = envdirect != NULL && strcmp(envdirect, "1") == 0;
+  }
+
+  state_io::init(direct_io);
+
   if (migrating || !migratefile.empty())
     return migrate::run(migratefile);
 
@@ -473,10 +1955,23 @@ int run(const int argc, const char *const argv[]) {
 
   init_main();
 
+  if (recover_journal() != 0) {
+    fprintf(stderr, "[run FATAL] Failed recovering the journal, exiting...\n");
+    free_main(true);
+    return 1;
+  }
+
   int status = 0;
   if (testing)
+#ifdef SPARSE_STATE
+    status = test::run(nullptr);
+#else
     status = test::run(cboxes);
-  else {
+#endif // SPARSE_STATE
+  else if (use_journal && journal::start(statefile) != 0) {
+    status = 1;
+  } else {
+    start_snapshots();
     runtime_cli::run();
     status = server::run();
   }
@@ -0,0 +1,174 @@
+#include "atcboxes/broadcast.h"
+#include "atcboxes/proto.h"
+#include "atcboxes/util.h"
+#include <algorithm>
+
+namespace atcboxes::broadcast {
+
+#ifdef WITH_COLOR
+void add(delta_t &d, uint64_t i, const cbox_t &s) {
+  auto it = d.pos.find(i);
+  if (it != d.pos.end()) {
+    d.changes[it->second].s = s;
+    return;
+  }
+
+  d.pos.emplace(i, d.changes.size());
+  d.changes.push_back({i, s});
+}
+
+static void append_change(std::string &out, const change_t &c) {
+  util::append_uint(out, c.i);
+  out += ';';
+  util::append_uint(out, c.s.r);
+  out += ';';
+  util::append_uint(out, c.s.g);
+  out += ';';
+  util::append_uint(out, c.s.b);
+  out += ';';
+  util::append_uint(out, c.s.a);
+}
+
+static bool cancelled(const change_t &) {
+  // previous color isn't known, only repeated writes are coalesced
+  return false;
+}
+#else
+void add(delta_t &d, uint64_t i, int s) {
+  auto it = d.pos.find(i);
+  if (it != d.pos.end()) {
+    d.changes[it->second].s = s;
+    return;
+  }
+
+  d.pos.emplace(i, d.changes.size());
+  d.changes.push_back({i, !s, s});
+}
+
+static void append_change(std::string &out, const change_t &c) {
+  util::append_uint(out, c.i);
+  out += c.s ? ";1" : ";0";
+}
+
+static bool cancelled(const change_t &c) { return c.s == c.initial; }
+#endif // WITH_COLOR
+
+using change_iter_t = const change_t *const *;
+
+static void build(frames_t &f, change_iter_t b, change_iter_t e) {
+  const size_t n = e - b;
+
+  f.text = n == 1 ? "s;" : "d;";
+  f.bin = (char)(n == 1 ? proto::OP_STATE : proto::OP_DELTA);
+
+  if (n > 1)
+    proto::put_varint(f.bin, n);
+
+  for (auto i = b; i != e; i++) {
+    if (i != b)
+      f.text += ';';
+
+    append_change(f.text, **i);
+    proto::put_state(f.bin, (*i)->i, (*i)->s);
+  }
+}
+
+#ifdef WITH_COLOR
+void single(broadcast_t &out, uint64_t i, const cbox_t &s) {
+  const change_t c = {i, s};
+#else
+void single(broadcast_t &out, uint64_t i, int s) {
+  const change_t c = {i, !s, s};
+#endif // WITH_COLOR
+  const change_t *l[] = {&c};
+
+  build(out.global, l, l + 1);
+
+  // assigned, not pushed, to keep the page's buffers
+  out.pages.resize(1);
+  out.pages[0].page = page_of(i);
+  out.pages[0].f.text = out.global.text;
+  out.pages[0].f.bin = out.global.bin;
+}
+
+void topic_name(std::string &out, std::string_view topic, bool bin) {
+  out = topic;
+  if (bin)
+    out += TOPIC_BIN_SUFFIX;
+}
+
+void page_topic(std::string &out, uint64_t page, bool bin) {
+  out = "p:";
+  util::append_uint(out, page);
+  if (bin)
+    out += TOPIC_BIN_SUFFIX;
+}
+
+// f's buffers go to m, m's old ones back to f for the next build
+static void swap_frames(message_t *m, frames_t &f) {
+  m[0].data.swap(f.text);
+  m[0].bin = false;
+  m[1].data.swap(f.bin);
+  m[1].bin = true;
+}
+
+void messages(broadcast_t &b, messages_t &m) {
+  m.resize((b.pages.size() + 1) * 2);
+
+  topic_name(m[0].topic, TOPIC_GLOBAL, false);
+  topic_name(m[1].topic, TOPIC_GLOBAL, true);
+  swap_frames(m.data(), b.global);
+
+  for (size_t n = 0; n < b.pages.size(); n++) {
+    message_t *p = m.data() + (n + 1) * 2;
+
+    page_topic(p[0].topic, b.pages[n].page, false);
+    page_topic(p[1].topic, b.pages[n].page, true);
+    swap_frames(p, b.pages[n].f);
+  }
+}
+
+size_t flush(delta_t &d, broadcast_t &out) {
+  out.global = {};
+  out.pages.clear();
+
+  std::vector<const change_t *> l;
+  l.reserve(d.changes.size());
+
+  for (const auto &c : d.changes)
+    if (!cancelled(c))
+      l.push_back(&c);
+
+  // group by page, keeping the order within a page
+  std::stable_sort(l.begin(), l.end(),
+                   [](const change_t *a, const change_t *b) {
+                     return page_of(a->i) < page_of(b->i);
+                   });
+
+  const change_iter_t end = l.data() + l.size();
+
+  if (!l.empty())
+    build(out.global, l.data(), end);
+
+  change_iter_t b = l.data();
+  while (b != end) {
+    const uint64_t page = page_of((*b)->i);
+
+    change_iter_t e = b;
+    while (e != end && page_of((*e)->i) == page)
+      e++;
+
+    out.pages.push_back({page, {}});
+    build(out.pages.back().f, b, e);
+    b = e;
+  }
+
+  const size_t n = l.size();
+
+  d.changes.clear();
+  d.pos.clear();
+
+  return n;
+}
+
+} // namespace atcboxes::broadcast
@@ -1,158 +1,385 @@
 #include "atcboxes/commands.h"
 #include "atcboxes/atcboxes.h"
+#include "atcboxes/page_cache.h"
+#include "atcboxes/proto.h"
 #include "atcboxes/util.h"
+#include <algorithm>
 #include <cstdint>
-#include <regex>
 #include <string_view>
 
 namespace atcboxes::commands {
 
-static std::pair<int64_t, int64_t> get_subs_pc(const std::string &s) {
-  std::regex word_regex("(\\d+)");
-  auto begin = std::sregex_iterator(s.begin(), s.end(), word_regex);
+static int parse_subs(std::string_view args, uint64_t &page,
+                      uint64_t &count) {
+  uint64_t pc[2];
+  if (util::parse_uints(args, pc, 2) != 0)
+    return -1;
 
-  auto end = std::sregex_iterator();
-  if (begin == end)
-    return {-1, -1};
+  page = pc[0];
+  count = pc[1];
 
-  std::string p = (*begin).str();
-  begin++;
+  if (count > MAX_SUBS_PAGES || page >= STATE_PAGE_COUNT ||
+      count > STATE_PAGE_COUNT - page)
+    return -1;
 
-  if (begin == end)
-    return {-1, -1};
+  return 0;
+}
 
-  std::string c = (*begin).str();
+int subs(std::string_view cmd, uint64_t &page, uint64_t &count) {
+  if (cmd.substr(0, 3) != "sc;")
+    return -1;
 
-  return {std::stoll(p), std::stoll(c)};
+  return parse_subs(cmd.substr(3), page, count);
 }
 
-static int subs(const std::string &s) {
-  auto pc = get_subs_pc(s);
+static int p_gv(command_outs_t &out) {
+  std::string &o = out.push(0).out;
+  o += "v;";
+  util::append_uint(o, get_gv());
+  return 0;
+}
 
-  if (pc.first == -1 || pc.second == -1)
+/**
+ * @brief Whole page, headed by `ws;<page>`.
+ * @param versioned add `;<version>` to the header when the copy is
+ *        consistent, only for clients that asked with a version
+ * @return 0 success, -1 err
+ */
+static int gp(uint64_t page, bool versioned, command_outs_t &out) {
+  uint64_t version = 0;
+  page_cache::frame_t frame = page_cache::get(page, &version);
+  if (frame == nullptr) {
     return -1;
+  }
+
+  std::string header = "ws;" + std::to_string(page);
+  if (versioned && version) {
+    header += ';' + std::to_string(version);
+  }
+
+  out.push_back({std::move(header), 0});
+  out.push_back({"", 1, std::move(frame)});
+  return 0;
+}
 
-  // !TODO: subs per page? maybe not
+/**
+ * @brief Whole page in the smallest page_codec encoding, headed by
+ *        `we;<page>;<version>;<encoding>`. Version is 0 for a best-effort copy.
+ * @return 0 success, -1 err
+ */
+static int gpe(uint64_t page, command_outs_t &out) {
+  uint64_t version = 0;
+  char encoding = 0;
+  page_cache::frame_t frame = page_cache::get_encoded(page, encoding, &version);
+  if (frame == nullptr) {
+    return -1;
+  }
 
+  out.push_back({"we;" + std::to_string(page) + ';' + std::to_string(version) +
+                     ';' + encoding,
+                 0});
+  out.push_back({"", 3, std::move(frame)});
   return 0;
 }
 
+/**
+ * @brief Only the checkboxes changed since version, falls back to the whole
+ *        page when the change ring doesn't reach back that far.
+ * @param encoded whole page fallback with gpe instead of gp
+ * @return 0 success, -1 err
+ */
+static int gp_since(uint64_t page, uint64_t since, bool encoded,
+                    command_outs_t &out) {
+  std::vector<uint32_t> offsets;
+  uint64_t version = 0;
+
+  int r = get_page_changes(page, since, offsets, version);
+  if (r == -1) {
+    return -1;
+  }
+
+  if (r == 1) {
+    return encoded ? gpe(page, out) : gp(page, true, out);
+  }
+
+  // a checkbox toggled many times only needs its current state once
+  std::sort(offsets.begin(), offsets.end());
+  offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+
+  std::string &d = out.push(0).out;
+  d += "wd;";
+  util::append_uint(d, page);
+  d += ';';
+  util::append_uint(d, version);
+
+  for (uint32_t o : offsets) {
+    const uint64_t n = page * SIZE_PER_PAGE + o;
+    d += ';';
 #ifdef WITH_COLOR
-static int gcv(const std::string &s, cbox_t &cs) {
-  size_t idx = 0;
-  int r = get_state(std::stoull(s, &idx), cs);
-  return idx > 0 ? r : -1;
+    cbox_t s = {};
+    get_state(n, s);
+    util::append_cbox_wc(d, n, s);
+#else
+    util::append_uint(d, n);
+    d += get_state(n) ? ";1" : ";0";
+#endif // WITH_COLOR
+  }
+
+  return 0;
 }
 
-static int gcv(uint64_t s, cbox_t &cs) {
-  int r = get_state(s, cs);
-  return r;
+static int cmd_sc(std::string_view args, command_outs_t &) {
+  // the subscription itself is per connection, done by the server
+  uint64_t page = 0;
+  uint64_t count = 0;
+  return parse_subs(args, page, count);
 }
+
+static int cmd_gcv(std::string_view args, command_outs_t &out) {
+  uint64_t n = 0;
+  if (util::parse_uint(args, n) != 0) {
+    return -2;
+  }
+
+#ifdef WITH_COLOR
+  cbox_t cs = {};
+  int s = get_state(n, cs);
 #else
-static int gcv(const std::string &s) {
-  size_t idx = 0;
-  int r = get_state(std::stoull(s, &idx));
-  return idx > 0 ? r : -1;
-}
+  int s = get_state(n);
 #endif // WITH_COLOR
 
-static std::string p_gv() { return "v;" + std::to_string(get_gv()); }
+  if (s == -1) {
+    return -2;
+  }
+
+  // inactive checkboxes get no answer
+  if (s) {
+    std::string &o = out.push(1).out;
+    o += "s;";
+#ifdef WITH_COLOR
+    util::append_cbox_wc(o, n, cs);
+#else
+    util::append_uint(o, n);
+    o += ";1";
+#endif // WITH_COLOR
+  }
+
+  return 0;
+}
+
+/**
+ * @brief `gp;<page>[;<version>]` and `gpe;`. Copied without locking, toggles
+ *        never wait for a page download. Every request for an unchanged page
+ *        shares the same copy. With a version only what changed since the
+ *        version a previous `ws;` carried is sent, a plain `gp;<page>` gets
+ *        the `ws;<page>` header it always had. `gp;<page>;0` asks for the
+ *        whole page headed by `ws;<page>;<version>`.
+ */
+static int page_command(std::string_view args, bool encoded,
+                        command_outs_t &out) {
+  const size_t sep = args.find(';');
+
+  uint64_t page = 0;
+  if (util::parse_uint(args.substr(0, sep), page) != 0) {
+    return -3;
+  }
+
+  if (sep == std::string_view::npos) {
+    int r = encoded ? gpe(page, out) : gp(page, false, out);
+    return r == 0 ? 0 : -3;
+  }
+
+  uint64_t since = 0;
+  if (util::parse_uint(args.substr(sep + 1), since) != 0) {
+    return -3;
+  }
+
+  return gp_since(page, since, encoded, out) == 0 ? 0 : -3;
+}
+
+static int cmd_gp(std::string_view args, command_outs_t &out) {
+  return page_command(args, false, out);
+}
+
+static int cmd_gpe(std::string_view args, command_outs_t &out) {
+  return page_command(args, true, out);
+}
 
-static std::pair<CBOX_T const *, size_t> gp(const std::string &s) {
-  size_t idx = 0;
-  uint64_t p = std::stoull(s, &idx);
-  if (idx == 0) {
-    return {NULL, 0};
+static int cmd_gv(std::string_view args, command_outs_t &out) {
+  if (!args.empty()) {
+    return -4;
   }
 
-  return get_state_page(p);
+  return p_gv(out);
 }
 
-std::string p_state_wc(uint64_t n, const cbox_t &s) {
+/**
+ * @brief `bt;` toggles, validated as a whole: nothing is applied when any of
+ *        them is invalid.
+ * @return 2 success, -6 err
+ */
+static int parse_batch(std::string_view args, toggles_t &toggles) {
+  size_t pos = 0;
+
+  while (pos < args.size()) {
+    if (toggles.size() == MAX_BATCH_TOGGLES)
+      return -6;
+
 #ifdef WITH_COLOR
-  std::string str = "";
-  util::cbox_t_to_str(n, s, str);
+    // idx;r;g;b;a is 5 fields
+    size_t end = pos;
+    for (int f = 0; f < 5 && end != std::string_view::npos; f++)
+      end = args.find(';', f == 0 ? end : end + 1);
+#else
+    size_t end = args.find(';', pos);
+#endif // WITH_COLOR
 
-  return "s;" + str;
+    std::string_view field = args.substr(pos, end == std::string_view::npos
+                                                  ? end
+                                                  : end - pos);
+    toggle_t t = {};
+#ifdef WITH_COLOR
+    if (util::parse_cbox_wc(field, t.i, t.s) != 0)
 #else
-  return "";
+    if (util::parse_uint(field, t.i) != 0)
 #endif // WITH_COLOR
+      return -6;
+
+    // a checkbox index, not a state element's
+    if (t.i > A_TRILLION - 1)
+      return -6;
+
+    toggles.push_back(t);
+
+    if (end == std::string_view::npos)
+      break;
+
+    // no trailing `;`
+    pos = end + 1;
+    if (pos == args.size())
+      return -6;
+  }
+
+  return toggles.empty() ? -6 : 2;
 }
 
-std::string p_state(const std::string &n, int s) {
-  return "s;" + n + ';' + (s ? "1" : "0");
+struct command_t {
+  std::string_view prefix;
+  int (*handler)(std::string_view args, command_outs_t &out);
+};
+
+// matched in order, anything else is a toggle
+static constexpr command_t COMMANDS[] = {
+    {"sc;", cmd_sc},   {"gcv;", cmd_gcv}, {"gpe;", cmd_gpe},
+    {"gp;", cmd_gp},   {"gv;", cmd_gv},
+};
+
+#ifdef WITH_COLOR
+int run(std::string_view cmd, command_outs_t &out, uint64_t &i, cbox_t &s) {
+#else
+int run(std::string_view cmd, command_outs_t &out, uint64_t &i) {
+#endif // WITH_COLOR
+  for (const command_t &c : COMMANDS) {
+    if (cmd.substr(0, c.prefix.size()) == c.prefix)
+      return c.handler(cmd.substr(c.prefix.size()), out);
+  }
+
+  // toggles, nothing to answer
+  if (cmd.substr(0, 3) == "bt;")
+    return parse_batch(cmd.substr(3), out.toggles);
+
+#ifdef WITH_COLOR
+  return util::parse_cbox_wc(cmd, i, s) == 0 ? 1 : -1;
+#else
+  return util::parse_uint(cmd, i) == 0 ? 1 : -1;
+#endif // WITH_COLOR
 }
 
-int run(std::string_view cmd, command_outs_t &out) {
-  if (cmd.find("sc;") == 0) {
-    if (cmd.length() < 6 || subs(std::string(cmd.substr(3))) == -1) {
+#ifdef WITH_COLOR
+int run_bin(std::string_view cmd, command_outs_t &out, uint64_t &i,
+            cbox_t &s) {
+#else
+int run_bin(std::string_view cmd, command_outs_t &out, uint64_t &i) {
+#endif // WITH_COLOR
+  size_t pos = 1;
+
+  switch ((uint8_t)cmd[0]) {
+  case proto::OP_TOGGLE:
+#ifdef WITH_COLOR
+    if (proto::get_state(cmd, pos, i, s) != 0 || pos != cmd.size())
       return -1;
-    }
+#else
+    if (proto::get_varint(cmd, pos, i) != 0 || pos != cmd.size())
+      return -1;
+#endif // WITH_COLOR
 
-    // TODO
+    return 1;
 
-    return 0;
-  }
+  case proto::OP_GCV: {
+    uint64_t n = 0;
+    if (proto::get_varint(cmd, pos, n) != 0 || pos != cmd.size())
+      return -2;
 
-  else if (cmd.find("gcv;") == 0) {
 #ifdef WITH_COLOR
-    int s = 0;
     cbox_t cs = {};
-    size_t idx = 0;
-    auto n = std::stoull(std::string(cmd.substr(4)));
-
-    if (idx == 0 || cmd.length() < 5 || (s = gcv(n, cs)) == -1) {
+    int st = get_state(n, cs);
+    if (st == -1)
       return -2;
-    }
 
-    if (s) {
-      out.push_back({p_state_wc(n, cs), 1});
-      return 0;
-    }
+    if (st)
+      proto::p_state(out.push(1).out, n, cs);
 #else
-    int s = 0;
-    auto n = std::string(cmd.substr(4));
-
-    if (cmd.length() < 5 || (s = gcv(n)) == -1) {
+    int st = get_state(n);
+    if (st == -1)
       return -2;
-    }
 
-    if (s) {
-      out.push_back({p_state(n, s), 1});
-      return 0;
-    }
+    if (st)
+      proto::p_state(out.push(1).out, n, st);
 #endif // WITH_COLOR
+
+    return 0;
   }
 
-  else if (cmd.find("gp;") == 0) {
-    // calling get_state_page in gp should lock cbox mutex
-    atcboxes::cbox_lock_guard_t lk;
+  case proto::OP_BATCH: {
+    uint64_t count = 0;
+    if (proto::get_varint(cmd, pos, count) != 0 || count == 0 ||
+        count > MAX_BATCH_TOGGLES)
+      return -6;
 
-    std::pair<CBOX_T const *, size_t> s = {NULL, 0};
-    std::string page_number(cmd.substr(3));
+    uint64_t prev = 0;
+    for (uint64_t n = 0; n < count; n++) {
+      int64_t d = 0;
+      if (proto::get_svarint(cmd, pos, d) != 0)
+        return -6;
 
-    if (cmd.length() < 4 || (s = gp(page_number)).first == NULL) {
-      return -3;
-    }
+      toggle_t t = {};
+      t.i = prev + d;
+#ifdef WITH_COLOR
+      if (proto::get_rgba(cmd, pos, t.s) != 0)
+        return -6;
+#endif // WITH_COLOR
+
+      // wrapped around below 0 ends up here too
+      if (t.i > A_TRILLION - 1)
+        return -6;
 
-    if (s.first) {
-      constexpr const size_t conversion = sizeof(CBOX_T);
-      out.push_back({std::string("ws;") + page_number, 0});
-      out.push_back({{(const char *)s.first, s.second * conversion}, 1});
-      return 0;
+      out.toggles.push_back(t);
+      prev = t.i;
     }
+
+    return pos == cmd.size() ? 2 : -6;
   }
 
-  else if (cmd.find("gv;") == 0) {
-    if (cmd.length() != 3) {
+  case proto::OP_GV: {
+    if (cmd.size() != 1)
       return -4;
-    }
 
-    out.push_back({p_gv(), 0});
+    proto::p_gv(out.push(0).out, get_gv());
     return 0;
   }
+  }
 
-  return 1;
+  return -5;
 }
 
 } // namespace atcboxes::commands
@@ -0,0 +1,509 @@
+#include "atcboxes/journal.h"
+#include "atcboxes/proto.h"
+#include "atcboxes/util.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+namespace atcboxes::journal {
+
+// a segment starts with this header, then commits of
+// (uint32 size, uint32 crc32, size bytes of records). A record is the
+// checkbox's new state as OP_STATE carries it (proto::put_state).
+struct segment_header_t {
+  char magic[8];
+  uint64_t element_size;
+  uint64_t element_count;
+};
+
+constexpr char MAGIC[8] = {'A', 'T', 'C', 'B', 'W', 'A', 'L', '1'};
+
+struct commit_header_t {
+  uint32_t size;
+  uint32_t crc;
+};
+
+struct alignas(64) stripe_t {
+  std::mutex m;
+  std::string pending;
+  uint64_t records = 0;
+};
+
+static stripe_t stripes[STRIPE_COUNT];
+
+// attempts at a commit before giving up on the journal
+constexpr int COMMIT_TRIES = 3;
+
+static std::string wal_prefix;
+static int fd = -1;
+static int64_t segment_id = -1;
+// commits in the current segment
+static uint64_t segment_commits = 0;
+// end of the last commit on disk, a failed one is truncated back to it
+static uint64_t segment_size = 0;
+
+// header and records of the commit being written, kept until it's on disk
+static std::string block;
+static uint64_t block_records = 0;
+// consecutive failed attempts at writing block
+static int commit_fails = 0;
+// records are dropped until a checkpoint opens a new segment, the state it
+// saves has them
+static bool failed = false;
+// commits made to fail halfway by test::run
+static int failing_commits = 0;
+
+// commits and rotations, the journal thread and checkpoints
+static std::mutex commit_m;
+static std::thread journal_thread;
+static std::atomic<bool> is_running = false;
+static std::mutex wake_m;
+static std::condition_variable wake_cv;
+
+static std::atomic<uint64_t> records = 0;
+static std::atomic<uint64_t> commits = 0;
+static std::atomic<uint64_t> bytes = 0;
+
+static std::string segment_path(int64_t id) {
+  return wal_prefix + std::to_string(id);
+}
+
+/**
+ * @return ids of the existing segments, ascending
+ */
+static std::vector<int64_t> list_segments() {
+  std::vector<int64_t> ids;
+
+  const size_t slash = wal_prefix.rfind('/');
+  const std::string dir =
+      slash == std::string::npos ? "." : wal_prefix.substr(0, slash + 1);
+  const std::string name =
+      slash == std::string::npos ? wal_prefix : wal_prefix.substr(slash + 1);
+
+  DIR *d = opendir(dir.c_str());
+  if (d == NULL) {
+    perror("[journal ERROR] opendir");
+    return ids;
+  }
+
+  while (struct dirent *e = readdir(d)) {
+    if (strncmp(e->d_name, name.c_str(), name.size()) != 0)
+      continue;
+
+    uint64_t id = 0;
+    if (util::parse_uint(e->d_name + name.size(), id) == 0)
+      ids.push_back((int64_t)id);
+  }
+
+  closedir(d);
+
+  std::sort(ids.begin(), ids.end());
+  return ids;
+}
+
+static bool write_all(int wfd, const void *data, size_t size) {
+  const char *p = (const char *)data;
+
+  while (size > 0) {
+    ssize_t w = write(wfd, p, size);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+
+      return false;
+    }
+
+    p += w;
+    size -= w;
+  }
+
+  return true;
+}
+
+static int open_segment(int64_t id) {
+  const std::string path = segment_path(id);
+
+  int nfd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (nfd == -1) {
+    perror("[journal ERROR] open");
+    return -1;
+  }
+
+  segment_header_t h = {};
+  memcpy(h.magic, MAGIC, sizeof(MAGIC));
+  h.element_size = STATE_ELEMENT_SIZE;
+  h.element_count = STATE_ELEMENT_COUNT;
+
+  if (!write_all(nfd, &h, sizeof(h)) || fdatasync(nfd) != 0) {
+    perror("[journal ERROR] write");
+    close(nfd);
+    return -1;
+  }
+
+  fd = nfd;
+  segment_id = id;
+  segment_commits = 0;
+  segment_size = sizeof(h);
+  return 0;
+}
+
+static void fail() {
+  failed = true;
+
+  fprintf(stderr, "[journal ERROR] Journal failed, dropped %lu record(s). "
+                  "Toggles are not journaled until the next checkpoint, a "
+                  "crash loses everything since the last one\n",
+          block_records);
+
+  block.clear();
+  block_records = 0;
+  commit_fails = 0;
+}
+
+/**
+ * @brief Drop the failed attempt at block, keeping it to try again in this
+ *        segment if it can be truncated back, in a new one otherwise.
+ */
+static void commit_failed(bool sync_failed) {
+  commit_fails++;
+
+  // half a commit would end replay of this segment, hiding every later one
+  const bool truncated = ftruncate(fd, segment_size) == 0;
+  if (!truncated)
+    perror("[journal ERROR] ftruncate");
+
+  if (commit_fails >= COMMIT_TRIES) {
+    fail();
+    return;
+  }
+
+  // after a failed sync, what the segment has on disk is unknown
+  if (truncated && !sync_failed)
+    return;
+
+  const int ofd = fd;
+  if (open_segment(segment_id + 1) != 0) {
+    fail();
+    return;
+  }
+
+  close(ofd);
+  fprintf(stderr, "[journal] Continuing in `%s`\n",
+          segment_path(segment_id).c_str());
+}
+
+/**
+ * @brief Write every stripe's pending records as one commit, with a failed
+ *        commit's records ahead of them. Caller holds commit_m.
+ */
+static void commit() {
+  static std::string taken;
+
+  if (block.empty())
+    block.assign(sizeof(commit_header_t), '\0');
+
+  for (stripe_t &s : stripes) {
+    {
+      std::lock_guard lk(s.m);
+      if (s.pending.empty())
+        continue;
+
+      // keep both buffers' capacity around
+      taken.swap(s.pending);
+      block_records += s.records;
+      s.records = 0;
+    }
+
+    if (!failed)
+      block += taken;
+    taken.clear();
+  }
+
+  if (failed || block_records == 0) {
+    block_records = 0;
+    return;
+  }
+
+  commit_header_t h;
+  h.size = (uint32_t)(block.size() - sizeof(h));
+  h.crc = (uint32_t)crc32(0, (const Bytef *)block.data() + sizeof(h), h.size);
+  memcpy(block.data(), &h, sizeof(h));
+
+  bool written = false;
+  if (failing_commits > 0) {
+    // what a full disk leaves behind
+    failing_commits--;
+    write_all(fd, block.data(), block.size() / 2);
+    errno = EIO;
+  } else {
+    // one write and one sync for everything since the last commit
+    written = write_all(fd, block.data(), block.size());
+  }
+
+  if (!written) {
+    perror("[journal ERROR] write");
+    commit_failed(false);
+    return;
+  }
+
+  if (fdatasync(fd) != 0) {
+    perror("[journal ERROR] fdatasync");
+    commit_failed(true);
+    return;
+  }
+
+  segment_commits++;
+  segment_size += block.size();
+  records.fetch_add(block_records, std::memory_order_relaxed);
+  commits.fetch_add(1, std::memory_order_relaxed);
+  bytes.fetch_add(block.size(), std::memory_order_relaxed);
+
+  block.clear();
+  block_records = 0;
+  commit_fails = 0;
+}
+
+static void run_journal() {
+  while (is_running) {
+    {
+      std::unique_lock lk(wake_m);
+      wake_cv.wait_for(lk, std::chrono::milliseconds(COMMIT_MS));
+    }
+
+    std::lock_guard lk(commit_m);
+    commit();
+  }
+
+  std::lock_guard lk(commit_m);
+  commit();
+}
+
+/**
+ * @return 0 success, 1 wrong build, -1 err
+ */
+static int replay_segment(const std::string &path, apply_t apply,
+                          int64_t &applied) {
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f) {
+    perror("[journal::replay ERROR]");
+    return -1;
+  }
+
+  segment_header_t h;
+  if (fread(&h, sizeof(h), 1, f) != 1) {
+    // crashed before the header made it, nothing in it
+    fclose(f);
+    return 0;
+  }
+
+  if (memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      h.element_size != STATE_ELEMENT_SIZE ||
+      h.element_count != STATE_ELEMENT_COUNT) {
+    fprintf(stderr, "[journal::replay ERROR] `%s` is not a journal of this "
+                    "build\n",
+            path.c_str());
+    fclose(f);
+    return 1;
+  }
+
+  std::string block;
+  commit_header_t c;
+  while (fread(&c, sizeof(c), 1, f) == 1) {
+    block.resize(c.size);
+
+    if (fread(block.data(), 1, c.size, f) != c.size ||
+        (uint32_t)crc32(0, (const Bytef *)block.data(), c.size) != c.crc) {
+      // the commit being written when the process died
+      fprintf(stderr, "[journal::replay] Torn commit at the end of `%s`\n",
+              path.c_str());
+      break;
+    }
+
+    size_t pos = 0;
+    while (pos < block.size()) {
+      uint64_t i = 0;
+#ifdef WITH_COLOR
+      cbox_t s = {};
+      if (proto::get_state(block, pos, i, s) != 0 || i > STATE_MAX_INDEX)
+        break;
+
+      apply(i, s);
+#else
+      if (proto::get_varint(block, pos, i) != 0 || pos >= block.size() ||
+          i >= A_TRILLION)
+        break;
+
+      apply(i, block[pos++] != 0);
+#endif // WITH_COLOR
+      applied++;
+    }
+  }
+
+  fclose(f);
+  return 0;
+}
+
+int64_t replay(const char *statefile, apply_t apply) {
+  wal_prefix = std::string(statefile) + ".wal.";
+
+  int64_t applied = 0;
+  const std::vector<int64_t> ids = list_segments();
+
+  for (int64_t id : ids) {
+    if (replay_segment(segment_path(id), apply, applied) != 0)
+      return -1;
+  }
+
+  if (!ids.empty())
+    fprintf(stderr, "[journal::replay] Replayed %ld record(s) from %zu "
+                    "segment(s)\n",
+            applied, ids.size());
+
+  return applied;
+}
+
+int start(const char *statefile) {
+  if (is_running)
+    return 1;
+
+  wal_prefix = std::string(statefile) + ".wal.";
+
+  const std::vector<int64_t> ids = list_segments();
+  if (open_segment(ids.empty() ? 0 : ids.back() + 1) != 0)
+    return -1;
+
+  records = 0;
+  commits = 0;
+  bytes = 0;
+  block.clear();
+  block_records = 0;
+  commit_fails = 0;
+  failed = false;
+
+  is_running = true;
+  journal_thread = std::thread(run_journal);
+
+  fprintf(stderr, "[journal::start] Journaling to `%s`\n",
+          segment_path(segment_id).c_str());
+  return 0;
+}
+
+int stop() {
+  if (!is_running)
+    return 1;
+
+  {
+    std::lock_guard lk(wake_m);
+    is_running = false;
+    wake_cv.notify_one();
+  }
+
+  if (journal_thread.joinable())
+    journal_thread.join();
+
+  // the last commit failed, only the state saved next has them
+  if (block_records > 0)
+    fprintf(stderr, "[journal::stop ERROR] %lu record(s) not committed\n",
+            block_records);
+
+  close(fd);
+  fd = -1;
+
+  fprintf(stderr, "[journal::stop] Committed %lu record(s) in %lu commit(s)\n",
+          records.load(), commits.load());
+  return 0;
+}
+
+bool running() { return is_running; }
+
+std::unique_lock<std::mutex> lock(uint64_t page) {
+  return std::unique_lock(stripes[page % STRIPE_COUNT].m);
+}
+
+#ifdef WITH_COLOR
+void append(uint64_t page, uint64_t i, const cbox_t &s) {
+#else
+void append(uint64_t page, uint64_t i, bool on) {
+#endif // WITH_COLOR
+  stripe_t &st = stripes[page % STRIPE_COUNT];
+
+#ifdef WITH_COLOR
+  proto::put_state(st.pending, i, s);
+#else
+  proto::put_state(st.pending, i, on);
+#endif // WITH_COLOR
+  st.records++;
+}
+
+int rotate(int64_t &closed) {
+  std::lock_guard lk(commit_m);
+
+  if (fd == -1)
+    return -1;
+
+  commit();
+
+  if (failed) {
+    // what was dropped is in the state saved next, so are the segments
+    closed = segment_id;
+
+    const int ofd = fd;
+    if (open_segment(segment_id + 1) != 0)
+      return 0;
+
+    close(ofd);
+    failed = false;
+    fprintf(stderr, "[journal::rotate] Journaling again to `%s`\n",
+            segment_path(segment_id).c_str());
+    return 0;
+  }
+
+  // nothing to close
+  if (segment_commits == 0) {
+    closed = segment_id - 1;
+    return 0;
+  }
+
+  const int ofd = fd;
+  if (open_segment(segment_id + 1) != 0)
+    return -1;
+
+  close(ofd);
+  closed = segment_id - 1;
+  return 0;
+}
+
+void drop(int64_t last) {
+  for (int64_t id : list_segments()) {
+    if (id > last)
+      break;
+
+    if (unlink(segment_path(id).c_str()) != 0)
+      perror("[journal::drop ERROR] unlink");
+  }
+}
+
+void fail_commits(int n) {
+  std::lock_guard lk(commit_m);
+  failing_commits = n;
+}
+
+stats_t get_stats() {
+  return {records.load(std::memory_order_relaxed),
+          commits.load(std::memory_order_relaxed),
+          bytes.load(std::memory_order_relaxed)};
+}
+
+} // namespace atcboxes::journal
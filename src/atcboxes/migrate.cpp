@@ -1,5 +1,6 @@
 #include "atcboxes/migrate.h"
 #include "atcboxes/atcboxes.h"
+#include "atcboxes/state_io.h"
 #include "atcboxes/util.h"
 #include <cstdint>
 #include <sys/stat.h>
@@ -148,27 +149,22 @@ int run(const std::string &file) {
     // just reset the state
     fprintf(stderr, "Resetting state file...\n");
 
-    FILE *f = util::try_open(file.c_str(), "wb");
-    if (f == NULL)
+    state_io::writer_t *w = state_io::open_writer(file.c_str());
+    if (w == NULL)
       return -1;
 
     size_t wrote = 0;
-    size_t current_wrote = 0;
-    while (wrote < STATE_ELEMENT_COUNT &&
-           (current_wrote = fwrite(TEMP_VAL, STATE_ELEMENT_SIZE,
-                                   (wrote + 4096) > STATE_ELEMENT_COUNT
-                                       ? STATE_ELEMENT_COUNT - wrote
-                                       : 4096,
-                                   f)) > 0) {
-      wrote += current_wrote;
+    while (wrote < STATE_ELEMENT_COUNT) {
+      const size_t n = std::min<size_t>(4096, STATE_ELEMENT_COUNT - wrote);
+      if (state_io::write(w, TEMP_VAL, n * STATE_ELEMENT_SIZE) != 0)
+        break;
+
+      wrote += n;
     }
 
     fprintf(stderr, "Wrote %zu elements to `%s`\n", wrote, file.c_str());
 
-    fclose(f);
-    f = NULL;
-
-    if (wrote != STATE_ELEMENT_COUNT) {
+    if (state_io::close_writer(w) != 0 || wrote != STATE_ELEMENT_COUNT) {
       fprintf(stderr, "Mismatched written element count, check your code!\n");
       return -1;
     }
@@ -176,29 +172,29 @@ int run(const std::string &file) {
   }
   case 0: {
 #ifdef BUILD_BILLION_WITH_COLOR
-    static uint64_t TEMP_IN[4096] = {0};
+    // a window of the input at a time, aligned for direct I/O
+    alignas(state_io::ALIGN) static uint64_t
+        TEMP_IN[state_io::CHUNK_SIZE / sizeof(uint64_t)] = {0};
 
     const std::string writepath = file + ".migrated-bc";
 
     int status = -1;
     size_t readsiz = 0;
-    size_t curread = 0;
     size_t wrote = 0;
     uint64_t temp_bit = 1;
     size_t tv_idx = 0;
+    int64_t read = 0;
 
     fprintf(stderr, "Opening new file for writing: %s\n", writepath.c_str());
-    FILE *fout = util::try_open(writepath.c_str(), "wb");
+    state_io::writer_t *fout = state_io::open_writer(writepath.c_str());
     if (fout == NULL)
       return -1;
 
-    FILE *fin = util::try_open(file.c_str(), "rb");
-    if (fin == NULL)
-      goto ferr0;
-
     // currently only handles BILLION_NO_COLOR to BILLION_WITH_COLOR only
     // !TODO: handle other cases
-    while ((curread = fread(TEMP_IN, sizeof(uint64_t), 4096, fin)) > 0) {
+    while ((read = state_io::read_file(file.c_str(), TEMP_IN, sizeof(TEMP_IN),
+                                       readsiz * sizeof(uint64_t))) > 0) {
+      const size_t curread = read / sizeof(uint64_t);
       readsiz += curread;
 
       // put TEMP_IN into new format TEMP_VAL
@@ -209,7 +205,8 @@ int run(const std::string &file) {
         do {
           if (tv_idx == 4096) {
             // write when it hit the end
-            wrote += fwrite(TEMP_VAL, sizeof(CBOX_T), 4096, fout);
+            if (state_io::write(fout, TEMP_VAL, sizeof(TEMP_VAL)) == 0)
+              wrote += 4096;
 
             tv_idx = 0;
           }
@@ -219,12 +216,20 @@ int run(const std::string &file) {
         } while (temp_bit);
         temp_bit = 1;
       }
+
+      // a partial element would be read again forever
+      if ((size_t)read < sizeof(TEMP_IN))
+        break;
     }
 
+    if (read < 0)
+      goto ferr0;
+
     // write if theres remaining unwritten element
     if (tv_idx > 0) {
       // write when it hit the end
-      wrote += fwrite(TEMP_VAL, sizeof(CBOX_T), tv_idx, fout);
+      if (state_io::write(fout, TEMP_VAL, tv_idx * sizeof(CBOX_T)) == 0)
+        wrote += tv_idx;
 
       tv_idx = 0;
     }
@@ -238,25 +243,21 @@ int run(const std::string &file) {
     if (readsiz != BILLION_NO_COLOR_ELEMENT_COUNT) {
       fprintf(stderr, "Mismatch read size from input file.\n");
       fprintf(stderr, "New state file is corrupted: %s\n", writepath.c_str());
-      goto ferr1;
+      goto ferr0;
     }
 
-    fprintf(stderr, "State file migrated to: %s\n", writepath.c_str());
+    if (state_io::close_writer(fout) != 0) {
+      fout = NULL;
+      fprintf(stderr, "New state file is corrupted: %s\n", writepath.c_str());
+      goto ferr0;
+    }
 
-    fclose(fin);
-    fin = NULL;
-    fclose(fout);
-    fout = NULL;
+    fprintf(stderr, "State file migrated to: %s\n", writepath.c_str());
     break;
 
-  ferr1:
-    if (fin) {
-      fclose(fin);
-      fin = NULL;
-    }
   ferr0:
     if (fout) {
-      fclose(fout);
+      state_io::close_writer(fout);
       fout = NULL;
     }
     return status;
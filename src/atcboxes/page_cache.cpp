@@ -0,0 +1,99 @@
+#include "atcboxes/page_cache.h"
+#include "atcboxes/atcboxes.h"
+#include "atcboxes/page_codec.h"
+#include <mutex>
+
+namespace atcboxes::page_cache {
+
+struct entry_t {
+  std::mutex m;
+  uint64_t page = 0;
+  uint64_t version = 0;
+  frame_t frame = nullptr;
+  // encoded frame, same version
+  frame_t encoded = nullptr;
+  char encoding = 0;
+};
+
+// direct mapped, a page always lands in the same slot
+static entry_t cache[PAGE_CACHE_SIZE];
+
+frame_t get(uint64_t page, uint64_t *version) {
+  const int64_t v = get_page_version(page);
+  if (v < 0)
+    return nullptr;
+
+  entry_t &e = cache[page % PAGE_CACHE_SIZE];
+
+  {
+    std::lock_guard lk(e.m);
+    if (e.frame && e.page == page && e.version == (uint64_t)v) {
+      if (version)
+        *version = e.version;
+
+      return e.frame;
+    }
+  }
+
+  // copy outside the slot lock, concurrent misses just copy twice
+  std::string buf;
+  uint64_t copied = 0;
+  int r = copy_state_page(page, buf, &copied);
+  if (r == -1)
+    return nullptr;
+
+  frame_t frame = std::make_shared<const std::string>(std::move(buf));
+
+  // best-effort copies don't represent any version, never cache them
+  if (r == 0) {
+    std::lock_guard lk(e.m);
+    if (!e.frame || e.page != page || e.version < copied) {
+      e.page = page;
+      e.version = copied;
+      e.frame = frame;
+      e.encoded = nullptr;
+    }
+  }
+
+  if (version)
+    *version = r == 0 ? copied : 0;
+
+  return frame;
+}
+
+frame_t get_encoded(uint64_t page, char &encoding, uint64_t *version) {
+  uint64_t v = 0;
+  frame_t raw = get(page, &v);
+  if (raw == nullptr)
+    return nullptr;
+
+  if (version)
+    *version = v;
+
+  entry_t &e = cache[page % PAGE_CACHE_SIZE];
+
+  if (v) {
+    std::lock_guard lk(e.m);
+    if (e.encoded && e.page == page && e.version == v) {
+      encoding = e.encoding;
+      return e.encoded;
+    }
+  }
+
+  std::string buf;
+  encoding = page_codec::encode(*raw, buf);
+
+  frame_t frame = std::make_shared<const std::string>(std::move(buf));
+
+  if (v) {
+    std::lock_guard lk(e.m);
+    if (e.page == page && e.version == v) {
+      e.encoded = frame;
+      e.encoding = encoding;
+    }
+  }
+
+  return frame;
+}
+
+} // namespace atcboxes::page_cache
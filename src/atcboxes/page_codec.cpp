@@ -0,0 +1,301 @@
+#include "atcboxes/page_codec.h"
+#include "atcboxes/atcboxes.h"
+#include "atcboxes/proto.h"
+#include <cstring>
+#include <zlib.h>
+
+namespace atcboxes::page_codec {
+
+#ifdef WITH_COLOR
+// worst case gap varint plus rgba
+constexpr size_t SPARSE_ENTRY_MAX = 3 + sizeof(cbox_t);
+
+static size_t count_entries(std::string_view page) {
+  size_t n = 0;
+
+  for (size_t i = 0; i + sizeof(uint32_t) <= page.size();
+       i += sizeof(uint32_t)) {
+    uint32_t v;
+    memcpy(&v, page.data() + i, sizeof(v));
+    n += v != 0;
+  }
+
+  return n;
+}
+
+static void encode_sparse(std::string_view page, size_t count,
+                          std::string &out) {
+  proto::put_varint(out, count);
+
+  uint64_t next = 0;
+  for (size_t i = 0; i + sizeof(uint32_t) <= page.size();
+       i += sizeof(uint32_t)) {
+    uint32_t v;
+    memcpy(&v, page.data() + i, sizeof(v));
+    if (v == 0)
+      continue;
+
+    const uint64_t e = i / sizeof(uint32_t);
+    proto::put_varint(out, e - next);
+    out.append(page.data() + i, sizeof(uint32_t));
+    next = e + 1;
+  }
+}
+
+static int decode_sparse(std::string_view in, std::string &out) {
+  size_t pos = 0;
+  uint64_t count = 0;
+  if (proto::get_varint(in, pos, count) != 0)
+    return -1;
+
+  out.assign(STATE_PAGE_SIZE_BYTES, '\0');
+
+  uint64_t next = 0;
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t gap = 0;
+    if (proto::get_varint(in, pos, gap) != 0 || pos + 4 > in.size())
+      return -1;
+
+    const uint64_t e = next + gap;
+    if (e >= STATE_PAGE_SIZE_BYTES / sizeof(uint32_t))
+      return -1;
+
+    memcpy(out.data() + e * sizeof(uint32_t), in.data() + pos, 4);
+    pos += 4;
+    next = e + 1;
+  }
+
+  return pos == in.size() ? 0 : -1;
+}
+#else
+// worst case gap varint
+constexpr size_t SPARSE_ENTRY_MAX = 3;
+
+static size_t count_entries(std::string_view page) {
+  size_t n = 0;
+
+  for (size_t i = 0; i + sizeof(uint64_t) <= page.size();
+       i += sizeof(uint64_t)) {
+    uint64_t v;
+    memcpy(&v, page.data() + i, sizeof(v));
+    n += __builtin_popcountll(v);
+  }
+
+  return n;
+}
+
+static void encode_sparse(std::string_view page, size_t count,
+                          std::string &out) {
+  proto::put_varint(out, count);
+
+  uint64_t next = 0;
+  for (size_t i = 0; i + sizeof(uint64_t) <= page.size();
+       i += sizeof(uint64_t)) {
+    uint64_t v;
+    memcpy(&v, page.data() + i, sizeof(v));
+
+    while (v) {
+      const uint64_t o = (i / sizeof(uint64_t)) * 64 + __builtin_ctzll(v);
+      proto::put_varint(out, o - next);
+      next = o + 1;
+      v &= v - 1;
+    }
+  }
+}
+
+static int decode_sparse(std::string_view in, std::string &out) {
+  size_t pos = 0;
+  uint64_t count = 0;
+  if (proto::get_varint(in, pos, count) != 0)
+    return -1;
+
+  out.assign(STATE_PAGE_SIZE_BYTES, '\0');
+
+  uint64_t next = 0;
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t gap = 0;
+    if (proto::get_varint(in, pos, gap) != 0)
+      return -1;
+
+    const uint64_t o = next + gap;
+    if (o >= SIZE_PER_PAGE)
+      return -1;
+
+    uint64_t v;
+    memcpy(&v, out.data() + (o / 64) * 8, sizeof(v));
+    v |= (uint64_t)1 << (o % 64);
+    memcpy(out.data() + (o / 64) * 8, &v, sizeof(v));
+    next = o + 1;
+  }
+
+  return pos == in.size() ? 0 : -1;
+}
+#endif // WITH_COLOR
+
+// shorter zero runs stay in the literal, a run costs two varints
+constexpr size_t RLE_MIN_ZEROS = 4;
+
+static void encode_rle(std::string_view page, std::string &out) {
+  const size_t n = page.size();
+  size_t i = 0;
+
+  while (i < n) {
+    size_t zeros = 0;
+    while (i + zeros < n && page[i + zeros] == 0)
+      zeros++;
+
+    i += zeros;
+
+    // literal until the next long enough zero run
+    size_t lit = 0;
+    size_t run = 0;
+    while (i + lit + run < n) {
+      if (page[i + lit + run] != 0) {
+        lit += run + 1;
+        run = 0;
+      } else if (++run == RLE_MIN_ZEROS) {
+        break;
+      }
+    }
+
+    if (i + lit + run == n)
+      lit += run;
+
+    proto::put_varint(out, zeros);
+    proto::put_varint(out, lit);
+    out.append(page.data() + i, lit);
+    i += lit;
+  }
+}
+
+static int decode_rle(std::string_view in, std::string &out) {
+  size_t pos = 0;
+  out.clear();
+
+  while (pos < in.size()) {
+    uint64_t zeros = 0;
+    uint64_t lit = 0;
+    if (proto::get_varint(in, pos, zeros) != 0 ||
+        proto::get_varint(in, pos, lit) != 0 || lit > in.size() - pos ||
+        out.size() + zeros + lit > STATE_PAGE_SIZE_BYTES)
+      return -1;
+
+    out.append(zeros, '\0');
+    out.append(in.data() + pos, lit);
+    pos += lit;
+  }
+
+  return out.size() == STATE_PAGE_SIZE_BYTES ? 0 : -1;
+}
+
+static int encode_deflate(std::string_view page, std::string &out) {
+  uLongf len = compressBound(page.size());
+  out.resize(len);
+
+  // cached per page version, speed over ratio
+  if (compress2((Bytef *)out.data(), &len, (const Bytef *)page.data(),
+                page.size(), Z_BEST_SPEED) != Z_OK)
+    return -1;
+
+  out.resize(len);
+  return 0;
+}
+
+static int decode_deflate(std::string_view in, std::string &out) {
+  uLongf len = STATE_PAGE_SIZE_BYTES;
+  out.resize(len);
+
+  if (uncompress((Bytef *)out.data(), &len, (const Bytef *)in.data(),
+                 in.size()) != Z_OK ||
+      len != STATE_PAGE_SIZE_BYTES)
+    return -1;
+
+  return 0;
+}
+
+encoding_e encode(std::string_view page, std::string &out) {
+  out.clear();
+
+  const size_t count = count_entries(page);
+
+  // sure to win, mostly empty pages shrink to a few bytes
+  if (count * SPARSE_ENTRY_MAX <= page.size() / 64) {
+    encode_sparse(page, count, out);
+    return ENC_SPARSE;
+  }
+
+  encoding_e best = ENC_RAW;
+  size_t best_size = page.size();
+
+  if (count * SPARSE_ENTRY_MAX < best_size) {
+    encode_sparse(page, count, out);
+    if (out.size() < best_size) {
+      best = ENC_SPARSE;
+      best_size = out.size();
+    }
+  }
+
+  std::string buf;
+  encode_rle(page, buf);
+  if (buf.size() < best_size) {
+    best = ENC_RLE;
+    best_size = buf.size();
+    out.swap(buf);
+  }
+
+  // noisy page, worth the deflate
+  if (best_size > page.size() / 8) {
+    buf.clear();
+    if (encode_deflate(page, buf) == 0 && buf.size() < best_size) {
+      best = ENC_DEFLATE;
+      best_size = buf.size();
+      out.swap(buf);
+    }
+  }
+
+  if (best == ENC_RAW)
+    out.assign(page);
+
+  return best;
+}
+
+int encode(encoding_e encoding, std::string_view page, std::string &out) {
+  out.clear();
+
+  switch (encoding) {
+  case ENC_RAW:
+    out.assign(page);
+    return 0;
+  case ENC_RLE:
+    encode_rle(page, out);
+    return 0;
+  case ENC_SPARSE:
+    encode_sparse(page, count_entries(page), out);
+    return 0;
+  case ENC_DEFLATE:
+    return encode_deflate(page, out);
+  }
+
+  return -1;
+}
+
+int decode(char encoding, std::string_view in, std::string &out) {
+  switch (encoding) {
+  case ENC_RAW:
+    if (in.size() != STATE_PAGE_SIZE_BYTES)
+      return -1;
+
+    out.assign(in);
+    return 0;
+  case ENC_RLE:
+    return decode_rle(in, out);
+  case ENC_SPARSE:
+    return decode_sparse(in, out);
+  case ENC_DEFLATE:
+    return decode_deflate(in, out);
+  }
+
+  return -1;
+}
+
+} // namespace atcboxes::page_codec
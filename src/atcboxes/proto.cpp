@@ -0,0 +1,102 @@
+#include "atcboxes/proto.h"
+
+namespace atcboxes::proto {
+
+void put_varint(std::string &out, uint64_t v) {
+  while (v >= 0x80) {
+    out += (char)((v & 0x7f) | 0x80);
+    v >>= 7;
+  }
+
+  out += (char)v;
+}
+
+int get_varint(std::string_view in, size_t &pos, uint64_t &v) {
+  v = 0;
+
+  // 10 bytes covers 64 bits
+  for (int shift = 0; shift < 64 && pos < in.size(); shift += 7) {
+    uint8_t b = in[pos++];
+    v |= (uint64_t)(b & 0x7f) << shift;
+
+    if ((b & 0x80) == 0)
+      return 0;
+  }
+
+  return -1;
+}
+
+void put_svarint(std::string &out, int64_t v) {
+  put_varint(out, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+int get_svarint(std::string_view in, size_t &pos, int64_t &v) {
+  uint64_t u = 0;
+  if (get_varint(in, pos, u) != 0)
+    return -1;
+
+  v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+  return 0;
+}
+
+#ifdef WITH_COLOR
+void put_state(std::string &out, uint64_t i, const cbox_t &s) {
+  put_varint(out, i);
+  out += (char)s.r;
+  out += (char)s.g;
+  out += (char)s.b;
+  out += (char)s.a;
+}
+
+int get_state(std::string_view in, size_t &pos, uint64_t &i, cbox_t &s) {
+  if (get_varint(in, pos, i) != 0)
+    return -1;
+
+  return get_rgba(in, pos, s);
+}
+
+int get_rgba(std::string_view in, size_t &pos, cbox_t &s) {
+  if (in.size() - pos < 4)
+    return -1;
+
+  s.r = in[pos++];
+  s.g = in[pos++];
+  s.b = in[pos++];
+  s.a = in[pos++];
+
+  return 0;
+}
+
+void p_state(std::string &out, uint64_t i, const cbox_t &s) {
+  out = (char)OP_STATE;
+  put_state(out, i, s);
+}
+#else
+void put_state(std::string &out, uint64_t i, int s) {
+  put_varint(out, i);
+  out += (char)(s ? 1 : 0);
+}
+
+void p_state(std::string &out, uint64_t i, int s) {
+  out = (char)OP_STATE;
+  put_state(out, i, s);
+}
+#endif // WITH_COLOR
+
+void p_gv(std::string &out, uint64_t v) {
+  out = (char)OP_GV_OUT;
+  put_varint(out, v);
+}
+
+void p_uc(std::string &out, uint64_t v) {
+  out = (char)OP_UC;
+  put_varint(out, v);
+}
+
+void p_resync(std::string &out, uint64_t page, uint64_t count) {
+  out = (char)OP_RESYNC;
+  put_varint(out, page);
+  put_varint(out, count);
+}
+
+} // namespace atcboxes::proto
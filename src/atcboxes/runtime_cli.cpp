@@ -1,6 +1,10 @@
 #include "atcboxes/runtime_cli.h"
 #include "atcboxes/atcboxes.h"
 #include "atcboxes/commands.h"
+#include "atcboxes/server.h"
+#include "atcboxes/util.h"
+#include <atomic>
+#include <cstring>
 #include <sys/poll.h>
 #include <thread>
 #include <unistd.h>
@@ -45,8 +49,34 @@ static void run_thread() {
     if (strlen(line) == 0)
       continue;
 
+    if (strcmp(line, "stats") == 0) {
+      server::print_stats();
+      continue;
+    }
+
+    if (strcmp(line, "snapshot") == 0) {
+      snapshot_stats_t st;
+      if (snapshot(st) == 0)
+        fprintf(stderr, "Wrote %lu byte(s), %lu page(s)%s in %.3f ms\n",
+                st.bytes, st.pages, st.full ? " (full)" : "", st.ms);
+      else
+        fprintf(stderr, "Snapshot failed\n");
+
+      continue;
+    }
+
     commands::command_outs_t out;
-    int status = commands::run(line, out);
+    uint64_t g = 0;
+#ifdef WITH_COLOR
+    cbox_t s;
+    int status = commands::run(line, out, g, s);
+
+    // a bare index reads the checkbox here, no color needed
+    if (status < 0 && util::parse_uint(line, g) == 0)
+      status = 1;
+#else
+    int status = commands::run(line, out, g);
+#endif // WITH_COLOR
     if (status < 0) {
       goto cmd_cont;
     } else
@@ -54,13 +84,15 @@ static void run_thread() {
       case 0: {
         bool pstate = false;
         for (const auto &i : out) {
-          if (i.out.find("ws;") == 0) {
+          std::string_view d = i.data();
+
+          if (d.find("ws;") == 0) {
             pstate = true;
             continue;
           }
           if (pstate) {
-            for (size_t j = 0; j < i.out.size(); j++) {
-              uint8_t s = i.out[j];
+            for (size_t j = 0; j < d.size(); j++) {
+              uint8_t s = d[j];
               fprintf(stderr, "%ld(%d) ", j, s);
             }
             fprintf(stderr, "\n");
@@ -69,23 +101,11 @@ static void run_thread() {
             continue;
           }
 
-          fprintf(stderr, "%s\n", i.out.c_str());
+          fprintf(stderr, "%.*s\n", (int)d.size(), d.data());
         }
       } break;
       case 1: {
-        int64_t g = -1;
-        try {
-          g = std::stoll(line);
-        } catch (const std::exception &e) {
-          fprintf(stderr, "[runtime_cli::run ERROR]: %s\n", e.what());
-          goto cmd_cont;
-        }
-
-        if (g < 0)
-          goto cmd_cont;
-
 #ifdef WITH_COLOR
-        cbox_t s;
         int a = get_state(g, s);
         fprintf(stderr, "%d, %d %d %d %d\n", a, s.r, s.g, s.b, s.a);
 #else
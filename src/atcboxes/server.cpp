@@ -1,32 +1,118 @@
 #include "atcboxes/server.h"
 #include "atcboxes/atcboxes.h"
+#include "atcboxes/broadcast.h"
 #include "atcboxes/commands.h"
+#include "atcboxes/proto.h"
+#include "atcboxes/sparse.h"
 #include "atcboxes/util.h"
+#include "atcboxes/writer.h"
 #include "uWebSockets/src/App.h"
+#include <algorithm>
 #include <csignal>
 #include <cstdint>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <zlib.h>
 
 namespace atcboxes::server {
 
 using App = uWS::App;
+using broadcast::messages_t;
+using broadcast::TOPIC_GLOBAL;
+using broadcast::TOPIC_META;
 
-enum ws_data_flags_e : long { WSDF_NONE = 0, WSDF_C = 1 };
+// ws_data_t::sub_page and sub_count
+static_assert(STATE_PAGE_COUNT <= UINT32_MAX &&
+              commands::MAX_SUBS_PAGES <= UINT8_MAX);
 
-struct ws_data_t {
-  char n_o;
-  char n_i;
-  long flags;
-  std::string cached;
+// user count broadcast interval
+constexpr int UC_INTERVAL_MS = 1000;
+// how often every connection's send buffer is checked when shedding
+constexpr int SHED_INTERVAL_MS = 1000;
+// event loop stall probe
+constexpr int LAG_INTERVAL_MS = 100;
 
-  long long last_ts;
-  // int inv_p;
+using WS = uWS::WebSocket<false, true, ws_data_t>;
+using ws_list_t = std::vector<WS *>;
+
+// shared by every connection of an IP on a worker
+struct ip_bucket_t {
+  bucket_t b;
+  uint32_t conns;
 };
 
-using WS = uWS::WebSocket<false, true, ws_data_t>;
+// smaller frames go out uncompressed, deflate framing eats the gain
+constexpr size_t COMPRESS_MIN_SIZE = 64;
+// one in this many compressed frames is deflated again to estimate the cost
+constexpr uint64_t COMPRESS_SAMPLE_RATE = 64;
+
+// frames as handed to uWS, before topic fan-out. permessage-deflate happens
+// inside uWS, its cost and ratio are estimated from the samples. Only written
+// by the owning worker's thread.
+struct compress_stats_t {
+  std::atomic<uint64_t> frames = 0;
+  std::atomic<uint64_t> bytes = 0;
+  std::atomic<uint64_t> raw_frames = 0;
+  std::atomic<uint64_t> raw_bytes = 0;
+  std::atomic<uint64_t> sampled_in = 0;
+  std::atomic<uint64_t> sampled_out = 0;
+  std::atomic<uint64_t> sampled_ns = 0;
+};
+
+// how late the lag timer fires, time the loop spent stuck elsewhere. Only
+// added to by the owning worker's thread, print_stats takes and resets all of
+// them.
+struct lag_stats_t {
+  std::atomic<uint64_t> samples = 0;
+  std::atomic<uint64_t> sum_us = 0;
+  std::atomic<uint64_t> max_us = 0;
+};
+
+// one App and Loop per thread, all listening on the same port
+struct worker_t {
+  size_t id = 0;
+  std::thread thread;
+  std::atomic<App *> app = nullptr;
+  std::atomic<uWS::Loop *> loop = nullptr;
+
+  // WS pointers can only be touched from this worker's loop
+  ws_list_t connected_wses;
+
+  // state changes waiting for the next tick
+  broadcast::delta_t delta;
+  us_timer_t *tick_timer = nullptr;
+  // first worker only, publishes the user count when it changed
+  us_timer_t *uc_timer = nullptr;
+  us_timer_t *shed_timer = nullptr;
+  us_timer_t *lag_timer = nullptr;
+  int64_t lag_last_us = 0;
+
+  // keyed by remote address fingerprint
+  std::unordered_map<uint64_t, ip_bucket_t> ip_buckets;
+  // a batch toggle's changes when there's no tick
+  broadcast::delta_t batch;
+
+  compress_stats_t stats;
+  lag_stats_t lag;
+
+  // reused by every message handled on this loop
+  commands::command_outs_t out;
+  // reused by every toggle published on its own, without a tick
+  broadcast::broadcast_t single;
+  messages_t single_msgs;
+};
+
+std::vector<std::unique_ptr<worker_t>> workers;
+std::atomic<bool> workers_ready = false;
+// keeps a worker's loop alive while other threads defer to it
+std::mutex workers_m;
+thread_local worker_t *this_worker = nullptr;
 
-App *_app_ptr = nullptr;
-uWS::Loop *_loop_ptr = nullptr;
 std::atomic<bool> shutting_down = false;
 std::atomic<int> status = 0;
 std::atomic<int> int_count = 0;
@@ -41,6 +127,12 @@ static long long get_current_ts_seed() {
   return std::chrono::high_resolution_clock::now().time_since_epoch().count();
 }
 
+static int64_t now_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
 static void try_exit() {
   shutdown();
 
@@ -69,37 +161,155 @@ static void on_sigterm(int) {
   try_exit();
 }
 
-static int get_rand() {
-  srand(get_current_ts_seed());
-  return rand();
+static uint64_t splitmix64(uint64_t &x) {
+  uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
 }
 
-static int get_rand_modulo(size_t mod, size_t thres = 0) {
-  size_t r = get_rand();
-  return r > thres ? r % mod : r;
+// xoshiro256**, one per thread
+struct rng_t {
+  uint64_t s[4];
+
+  rng_t() {
+    std::random_device rd;
+    uint64_t seed = ((uint64_t)rd() << 32) ^ rd() ^ get_current_ts_seed();
+
+    for (auto &i : s)
+      i = splitmix64(seed);
+  }
+
+  uint64_t next() {
+    const uint64_t r = rotl(s[1] * 5, 7) * 9;
+    const uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+
+    return r;
+  }
+
+  static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+};
+
+static uint64_t get_rand() {
+  thread_local rng_t rng;
+  return rng.next();
 }
 
+static uint64_t get_rand_modulo(uint64_t mod) { return get_rand() % mod; }
+
 constexpr const char alphanums[] =
     "1234567890ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz=_";
 constexpr const size_t apn_siz = (sizeof(alphanums) / sizeof(*alphanums)) - 1;
+static_assert(apn_siz == 64, "a char takes 6 random bits");
+
+/**
+ * @brief Fill p with len random chars, 10 chars per random number.
+ */
+static void rand_chars(char *__restrict p, size_t len) {
+  uint64_t r = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    if (i % 10 == 0)
+      r = get_rand();
 
-static char get_rand_char() {
-  int rs = get_rand_modulo(apn_siz, apn_siz);
-  return alphanums[rs];
+    p[i] = alphanums[r & 63];
+    r >>= 6;
+  }
 }
 
-static void rand_chars(char *__restrict p, size_t len) {
-  int pd = len <= 3 ? 1 : 3;
-  for (size_t i = 0; i < (len - pd); i++) {
-    p[i] = get_rand_char();
+// raw deflate with permessage-deflate's flush, one stream per thread
+struct deflate_sampler_t {
+  z_stream zs = {};
+  bool ok = false;
+  std::string buf;
+
+  deflate_sampler_t() {
+    ok = deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                      Z_DEFAULT_STRATEGY) == Z_OK;
   }
 
-  if (pd == 3) {
-    p[len - 3] = '=';
-    p[len - 2] = '=';
+  ~deflate_sampler_t() {
+    if (ok)
+      deflateEnd(&zs);
   }
+};
+
+static void sample_deflate(compress_stats_t &st, std::string_view data) {
+  thread_local deflate_sampler_t ds;
+  if (!ds.ok)
+    return;
+
+  ds.buf.resize(deflateBound(&ds.zs, data.size()) + 16);
+
+  const auto start = std::chrono::steady_clock::now();
 
-  p[len - 1] = '\0';
+  deflateReset(&ds.zs);
+  ds.zs.next_in = (Bytef *)data.data();
+  ds.zs.avail_in = data.size();
+  ds.zs.next_out = (Bytef *)ds.buf.data();
+  ds.zs.avail_out = ds.buf.size();
+  int r = deflate(&ds.zs, Z_SYNC_FLUSH);
+
+  const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+
+  if (r != Z_OK)
+    return;
+
+  // the 4 bytes sync flush trailer isn't sent
+  const size_t out = ds.buf.size() - ds.zs.avail_out - 4;
+
+  st.sampled_in.fetch_add(data.size(), std::memory_order_relaxed);
+  st.sampled_out.fetch_add(out, std::memory_order_relaxed);
+  st.sampled_ns.fetch_add(ns, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Decide whether a frame goes through permessage-deflate and account
+ *        it in this worker's stats.
+ * @param allowed false for payloads already compact
+ */
+static bool compress_frame(std::string_view data, bool allowed = true) {
+  const bool c = allowed && get_compression() != COMPRESSION_OFF &&
+                 data.size() >= COMPRESS_MIN_SIZE;
+
+  if (this_worker == nullptr)
+    return c;
+
+  compress_stats_t &st = this_worker->stats;
+
+  if (!c) {
+    st.raw_frames.fetch_add(1, std::memory_order_relaxed);
+    st.raw_bytes.fetch_add(data.size(), std::memory_order_relaxed);
+    return false;
+  }
+
+  const uint64_t n = st.frames.fetch_add(1, std::memory_order_relaxed);
+  st.bytes.fetch_add(data.size(), std::memory_order_relaxed);
+
+  if (n % COMPRESS_SAMPLE_RATE == 0)
+    sample_deflate(st, data);
+
+  return true;
+}
+
+// FNV-1a, only compared against the same connection's own messages
+static uint64_t fingerprint(std::string_view data) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (char c : data) {
+    h ^= (uint8_t)c;
+    h *= 0x100000001b3ULL;
+  }
+
+  return h;
 }
 
 static void inc(WS *ws, std::string_view data) {
@@ -108,84 +318,428 @@ static void inc(WS *ws, std::string_view data) {
   if (ud->n_i > ud->n_o) {
     ud->n_i = 0;
 
-    ud->cached = std::string(data);
+    ud->cached = fingerprint(data);
+    ud->flags |= WSDF_CACHED;
   }
 
-  // printf("n_o(%d) n_i(%d) cached(%s) data(%s)\n", ud->n_o, ud->n_i,
-  //        ud->cached.c_str(), std::string(data).c_str());
+  // printf("n_o(%d) n_i(%d) cached(%lx) data(%s)\n", ud->n_o, ud->n_i,
+  //        ud->cached, std::string(data).c_str());
 }
 
 static void ws_send(WS *ws, std::string_view msg) {
-  ws->send(msg);
+  ws->send(msg, uWS::OpCode::BINARY, compress_frame(msg));
 
   inc(ws, msg);
 }
 
-static void publish_global(WS *ws, std::string_view data) {
-  ws->publish("global", data);
+static std::string topic_name(std::string_view topic, bool bin) {
+  std::string t;
+  broadcast::topic_name(t, topic, bin);
+
+  return t;
+}
+
+// a page only subscribers of that page receive
+static std::string page_topic(uint64_t page, bool bin) {
+  std::string t;
+  broadcast::page_topic(t, page, bin);
+
+  return t;
+}
+
+// both protocols' frames to their topic
+static void add_frames(messages_t &m, std::string_view topic,
+                       broadcast::frames_t &&f) {
+  m.push_back({topic_name(topic, false), std::move(f.text), false});
+  m.push_back({topic_name(topic, true), std::move(f.bin), true});
+}
+
+static messages_t state_messages(broadcast::broadcast_t &&b) {
+  messages_t m;
+  broadcast::messages(b, m);
+
+  return m;
+}
+
+// App publishes to every subscriber, WS to every subscriber but itself
+template <class P> static void publish_local(P *p, const messages_t &m) {
+  for (const auto &i : m)
+    p->publish(i.topic, i.data,
+               i.bin ? uWS::OpCode::BINARY : uWS::OpCode::TEXT,
+               compress_frame(i.data));
+}
+
+// publish on every other worker's loop
+static void forward(messages_t &&m) {
+  // outside of every loop, e.g. the writer thread, every loop is another one
+  if (this_worker != nullptr && workers.size() < 2)
+    return;
+
+  // one copy shared by every loop
+  auto msg = std::make_shared<const messages_t>(std::move(m));
+
+  std::lock_guard lk(workers_m);
+  for (auto &w : workers) {
+    uWS::Loop *loop = w->loop;
+    if (w.get() == this_worker || loop == nullptr)
+      continue;
+
+    worker_t *wp = w.get();
+    loop->defer([wp, msg]() {
+      App *app = wp->app;
+      if (app)
+        publish_local(app, *msg);
+    });
+  }
+}
+
+static void publish(WS *ws, messages_t &&m) {
+  publish_local(ws, m);
+  forward(std::move(m));
   // inc(ws, data);
 }
 
-uint64_t uc = 0;
+// unlike publish, also reaches the sender
+static void publish_all(messages_t &&m) {
+  publish_local(this_worker->app.load(), m);
+  forward(std::move(m));
+}
+
+#ifdef WITH_COLOR
+static void publish_state(WS *ws, uint64_t i, const cbox_t &s) {
+#else
+static void publish_state(WS *ws, uint64_t i, int s) {
+#endif // WITH_COLOR
+  if (get_tick_ms() > 0) {
+    broadcast::add(this_worker->delta, i, s);
+    return;
+  }
+
+  // this worker's buffers, allocating only while they grow
+  worker_t *w = this_worker;
+  broadcast::single(w->single, i, s);
+  broadcast::messages(w->single, w->single_msgs);
+
+  publish_local(ws, w->single_msgs);
+  if (workers.size() > 1)
+    forward(messages_t(w->single_msgs));
+}
+
+/**
+ * @brief Apply a validated batch in one pass over the state, in index order,
+ *        and broadcast it as one delta.
+ * @return 0 success, 1 dropped as the writer's ring is full, -1 err
+ */
+static int apply_batch(WS *ws, commands::toggles_t &toggles) {
+  // validated already, queued as a whole or not at all
+  if (writer::running())
+    return writer::push(toggles) ? 0 : 1;
+
+  // stable, the last color sent for an index wins
+  std::stable_sort(toggles.begin(), toggles.end(),
+                   [](const commands::toggle_t &a,
+                      const commands::toggle_t &b) { return a.i < b.i; });
+
+  const bool tick = get_tick_ms() > 0;
+  broadcast::delta_t &d = tick ? this_worker->delta : this_worker->batch;
+
+  for (const auto &t : toggles) {
+#ifdef WITH_COLOR
+    if (switch_state(t.i, t.s) < 0)
+      return -1;
+
+    cbox_t s = {};
+    get_state(t.i, s);
+    broadcast::add(d, t.i, s);
+#else
+    int r = switch_state(t.i);
+    if (r < 0)
+      return -1;
+
+    broadcast::add(d, t.i, r);
+#endif // WITH_COLOR
+  }
 
-static std::string p_uc() { return std::string("uc;") + std::to_string(uc); }
+  if (tick)
+    return 0;
 
-static void publish_user_count(WS *ws) { publish_global(ws, p_uc()); }
+  broadcast::broadcast_t b;
+  if (broadcast::flush(d, b) > 0)
+    publish(ws, state_messages(std::move(b)));
 
-static void send_user_count(WS *ws) { ws->send(p_uc()); }
+  return 0;
+}
 
-static void increment_user_count(WS *ws) {
-  uc++;
-  publish_user_count(ws);
+static void flush_delta(worker_t *w) {
+  broadcast::broadcast_t b;
+  if (broadcast::flush(w->delta, b) == 0)
+    return;
+
+  // the senders get their own toggles back too, states are absolute
+  publish_all(state_messages(std::move(b)));
 }
 
-static void decrement_user_count(WS *ws) {
-  uc--;
-  publish_user_count(ws);
+// the senders get their own toggles back too, like with ticks
+static void on_writer_batch(broadcast::broadcast_t &&b) {
+  forward(state_messages(std::move(b)));
 }
 
-static void ws_end(WS *ws, int code = 0, std::string_view msg = {}) {
-  // decrement_user_count(ws);
-  ws->end(code, msg);
+static void on_tick(us_timer_t *t) {
+  flush_delta(*(worker_t **)us_timer_ext(t));
 }
 
-using ws_list_t = std::vector<WS *>;
-ws_list_t connected_wses;
+// process-wide, shared by every worker
+std::atomic<uint64_t> uc = 0;
+
+static broadcast::frames_t p_uc() {
+  const uint64_t n = uc;
+
+  broadcast::frames_t f = {std::string("uc;") + std::to_string(n), {}};
+  proto::p_uc(f.bin, n);
+  return f;
+}
+
+static messages_t uc_messages() {
+  messages_t m;
+  add_frames(m, TOPIC_META, p_uc());
+  return m;
+}
+
+static void send_user_count(WS *ws) {
+  broadcast::frames_t f = p_uc();
+
+  const std::string &d = ws->getUserData()->flags & WSDF_BIN ? f.bin : f.text;
+  ws->send(d, uWS::OpCode::BINARY, compress_frame(d));
+}
+
+// opens and closes only count, the timer publishes. A reconnect storm costs
+// one fan-out per interval instead of one per connection
+static void increment_user_count() { uc++; }
+
+static void decrement_user_count() { uc--; }
+
+// last count published, first worker's loop only
+uint64_t uc_published = 0;
+
+static void on_uc_timer(us_timer_t *) {
+  const uint64_t n = uc;
+  if (n == uc_published)
+    return;
+
+  uc_published = n;
+  publish_all(uc_messages());
+}
+
+static void on_lag_timer(us_timer_t *t) {
+  worker_t *w = *(worker_t **)us_timer_ext(t);
+
+  const int64_t now = now_us();
+  const int64_t late = now - w->lag_last_us - LAG_INTERVAL_MS * 1000;
+  w->lag_last_us = now;
+
+  const uint64_t l = late > 0 ? late : 0;
+  w->lag.samples.fetch_add(1, std::memory_order_relaxed);
+  w->lag.sum_us.fetch_add(l, std::memory_order_relaxed);
+  if (l > w->lag.max_us.load(std::memory_order_relaxed))
+    w->lag.max_us.store(l, std::memory_order_relaxed);
+}
+
+// state change topics
+static void unsubscribe_state(WS *ws) {
+  auto *ud = ws->getUserData();
+  const bool bin = ud->flags & WSDF_BIN;
+
+  ws->unsubscribe(topic_name(TOPIC_GLOBAL, bin));
+
+  for (uint64_t p = 0; p < ud->sub_count; p++)
+    ws->unsubscribe(page_topic(ud->sub_page + p, bin));
+}
 
-static ws_list_t::iterator find_cws(WS *ws) {
-  if (connected_wses.empty())
-    return connected_wses.end();
+static void subscribe_state(WS *ws) {
+  auto *ud = ws->getUserData();
+  const bool bin = ud->flags & WSDF_BIN;
+
+  if (ud->flags & WSDF_SHED)
+    return;
 
-  auto i = connected_wses.begin();
-  while (i != connected_wses.end()) {
-    if (*i == ws)
-      return i;
-    i++;
+  // viewport clients only want their pages
+  if (ud->sub_count == 0)
+    ws->subscribe(topic_name(TOPIC_GLOBAL, bin));
+
+  for (uint64_t p = 0; p < ud->sub_count; p++)
+    ws->subscribe(page_topic(ud->sub_page + p, bin));
+}
+
+static void unsubscribe_all(WS *ws) {
+  ws->unsubscribe(topic_name(TOPIC_META, ws->getUserData()->flags & WSDF_BIN));
+  unsubscribe_state(ws);
+}
+
+static void subscribe_all(WS *ws) {
+  ws->subscribe(topic_name(TOPIC_META, ws->getUserData()->flags & WSDF_BIN));
+  subscribe_state(ws);
+}
+
+// a slow consumer stops getting state changes instead of buffering them all
+static void shed(WS *ws) {
+  unsubscribe_state(ws);
+  ws->getUserData()->flags |= WSDF_SHED;
+}
+
+static void resume(WS *ws) {
+  auto *ud = ws->getUserData();
+  ud->flags &= ~WSDF_SHED;
+  subscribe_state(ws);
+
+  // whatever changed in between is gone, the client refetches its pages
+  if (ud->flags & WSDF_BIN) {
+    std::string o;
+    proto::p_resync(o, ud->sub_page, ud->sub_count);
+    ws->send(o, uWS::OpCode::BINARY, false);
+  } else {
+    std::string o = "rs;";
+    util::append_uint(o, ud->sub_page);
+    o += ';';
+    util::append_uint(o, ud->sub_count);
+    ws->send(o, uWS::OpCode::BINARY, false);
   }
+}
+
+// resumed once drained to a quarter of the threshold
+static void check_backpressure(WS *ws) {
+  const unsigned int shed_at = get_shed_bytes();
+  const unsigned int buffered = ws->getBufferedAmount();
+  const bool shedding = ws->getUserData()->flags & WSDF_SHED;
 
-  return connected_wses.end();
+  if (!shedding && buffered > shed_at)
+    shed(ws);
+  else if (shedding && buffered <= shed_at / 4)
+    resume(ws);
 }
 
-static void add_cws(WS *ws) {
-  if (find_cws(ws) != connected_wses.end())
+// catches consumers that stopped reading altogether, drain never fires for
+// those
+static void on_shed_timer(us_timer_t *t) {
+  worker_t *w = *(worker_t **)us_timer_ext(t);
+
+  for (WS *ws : w->connected_wses)
+    check_backpressure(ws);
+}
+
+static uint64_t ip_key(WS *ws) { return fingerprint(ws->getRemoteAddress()); }
+
+static void bucket_refill(bucket_t &b, uint32_t now, double rate) {
+  // a second's worth at most
+  const double burst = std::max(rate, 1.0);
+  const double t = b.tokens + (uint32_t)(now - b.ts) * rate / 1000;
+
+  b.tokens = std::min(t, burst);
+  b.ts = now;
+}
+
+// an IP's connections are spread over every worker by the kernel
+static double ip_rate_per_worker() {
+  return (double)get_ip_rate_limit() / std::max<size_t>(workers.size(), 1);
+}
+
+static void add_ip(WS *ws) {
+  if (get_ip_rate_limit() == 0)
+    return;
+
+  ip_bucket_t &ib = this_worker->ip_buckets[ip_key(ws)];
+  if (ib.conns++ == 0)
+    ib.b = {(float)std::max(ip_rate_per_worker(), 1.0),
+            (uint32_t)get_current_ts()};
+}
+
+static void remove_ip(WS *ws) {
+  if (get_ip_rate_limit() == 0)
     return;
+
+  auto it = this_worker->ip_buckets.find(ip_key(ws));
+  if (it != this_worker->ip_buckets.end() && --it->second.conns == 0)
+    this_worker->ip_buckets.erase(it);
+}
+
+/**
+ * @brief Take n tokens from both the connection's and its IP's bucket.
+ * @return false when either is short, nothing is taken then
+ */
+static bool allow_toggles(WS *ws, size_t n) {
+  const unsigned int rate = get_rate_limit();
+  const unsigned int ip_rate = get_ip_rate_limit();
+  if (rate == 0 && ip_rate == 0)
+    return true;
+
+  const uint32_t now = (uint32_t)get_current_ts();
+
+  bucket_t *cb = nullptr;
+  if (rate) {
+    cb = &ws->getUserData()->bucket;
+    bucket_refill(*cb, now, rate);
+  }
+
+  bucket_t *ib = nullptr;
+  if (ip_rate) {
+    auto it = this_worker->ip_buckets.find(ip_key(ws));
+    if (it != this_worker->ip_buckets.end()) {
+      ib = &it->second.b;
+      bucket_refill(*ib, now, ip_rate_per_worker());
+    }
+  }
+
+  if ((cb && cb->tokens < n) || (ib && ib->tokens < n))
+    return false;
+
+  if (cb)
+    cb->tokens -= n;
+  if (ib)
+    ib->tokens -= n;
+
+  return true;
+}
+
+static void send_rate_limited(WS *ws) {
+  if (ws->getUserData()->flags & WSDF_BIN)
+    ws->send(std::string(1, (char)proto::OP_RATE_LIMITED),
+             uWS::OpCode::BINARY, false);
+  else
+    ws->send("rl;", uWS::OpCode::BINARY, false);
+}
+
+static void ws_end(WS *ws, int code = 0, std::string_view msg = {}) {
+  // decrement_user_count(ws);
+  ws->end(code, msg);
+}
+
+static void add_cws(WS *ws) {
+  ws_list_t &connected_wses = this_worker->connected_wses;
+
+  ws->getUserData()->cws_idx = (uint32_t)connected_wses.size();
   connected_wses.push_back(ws);
 }
 
 static void remove_cws(WS *ws) {
-  auto i = find_cws(ws);
-  if (i == connected_wses.end())
+  ws_list_t &connected_wses = this_worker->connected_wses;
+  const size_t i = ws->getUserData()->cws_idx;
+
+  if (i >= connected_wses.size() || connected_wses[i] != ws)
     return;
 
-  connected_wses.erase(i);
+  // swap with the last one
+  WS *last = connected_wses.back();
+  connected_wses[i] = last;
+  last->getUserData()->cws_idx = (uint32_t)i;
+  connected_wses.pop_back();
 }
 
 static void handle_ws_command_outs(WS *ws, commands::command_outs_t &out) {
   for (const auto &i : out) {
     if (i.flags & 1) {
-      ws->send(i.out);
+      ws->send(i.data(), uWS::OpCode::BINARY,
+               compress_frame(i.data(), (i.flags & 2) == 0));
     } else if ((i.flags & 1) == 0) {
-      ws_send(ws, i.out);
+      ws_send(ws, i.data());
     } else {
       fprintf(stderr,
               "[server::handle_ws_command_outs ERROR] Unknown command_out_t "
@@ -200,41 +754,69 @@ static void alsfyuwlefasliuyrfgarhbwsgawlrg_a(WS *ws) {
   auto *ud = ws->getUserData();
 
   const long long cur = get_current_ts();
-  if ((cur - ud->last_ts) < (((cur & 1) == 0) ? 90 : 165)) {
-    srand(cur);
-    int rs = get_rand() & 1;
-    if (rs) {
-      ws_send(ws, "l;");
-      char b[3];
-      rand_chars(b, 3);
-      int n = get_rand_modulo(10);
-      ws_send(ws, std::string(b) + std::to_string(n));
-      ud->n_o = n > 0 ? n : ud->n_o;
-    }
+  // wraps every ~49 days, only short differences matter
+  const uint32_t elapsed = (uint32_t)cur - ud->last_ts;
+  if (elapsed < (((cur & 1) == 0) ? 90 : 165)) {
+    // every challenge frame in one write
+    ws->cork([ws, ud]() {
+      if (get_rand() & 1) {
+        ws_send(ws, "l;");
+
+        const int n = get_rand_modulo(10);
+        char b[3];
+        rand_chars(b, 2);
+        b[2] = '0' + n;
+        ws_send(ws, std::string_view(b, sizeof(b)));
+        ud->n_o = n > 0 ? n : ud->n_o;
+      }
 
-    size_t x = get_rand_modulo(ud->n_o) * 2 + ud->n_o;
-    for (size_t i = 0; i < x; i++) {
-      char b[9];
-      rand_chars(b, 9);
-      ws_send(ws, std::string(b));
-    }
+      char b[8];
+      b[6] = '=';
+      b[7] = '=';
 
-    ws_send(ws, "h;");
+      size_t x = get_rand_modulo(ud->n_o) * 2 + ud->n_o;
+      for (size_t i = 0; i < x; i++) {
+        rand_chars(b, 6);
+        ws_send(ws, std::string_view(b, sizeof(b)));
+      }
+
+      ws_send(ws, "h;");
+    });
 
     ud->flags |= WSDF_C;
   }
 
-  ud->last_ts = cur;
+  ud->last_ts = (uint32_t)cur;
 }
 
-int run() {
-  signal(SIGINT, on_sigint);
-  signal(SIGTERM, on_sigterm);
+static void run_worker(worker_t *w) {
+  this_worker = w;
 
   App app;
 
   App::WebSocketBehavior<ws_data_t> behavior;
-  // leave every other option to its default for now
+
+  // whether a message is compressed is still decided per frame, see
+  // compress_frame
+  switch (get_compression()) {
+  case COMPRESSION_SHARED:
+    behavior.compression =
+        uWS::CompressOptions(uWS::SHARED_COMPRESSOR | uWS::SHARED_DECOMPRESSOR);
+    break;
+  case COMPRESSION_DEDICATED:
+    behavior.compression = uWS::CompressOptions(uWS::DEDICATED_COMPRESSOR |
+                                                uWS::SHARED_DECOMPRESSOR);
+    break;
+  case COMPRESSION_OFF:
+    break;
+  }
+
+  if (get_max_backpressure() > 0)
+    behavior.maxBackpressure = get_max_backpressure();
+
+  if (get_max_payload() > 0)
+    behavior.maxPayloadLength = get_max_payload();
+
   behavior.open = [](WS *ws) {
     add_cws(ws);
     auto *ud = ws->getUserData();
@@ -243,24 +825,28 @@ int run() {
     ud->n_o = 4;
     ud->n_i = 0;
     ud->flags = WSDF_NONE;
-    ud->last_ts = get_current_ts();
-    ud->cached.clear();
-
-    ws->subscribe("global");
-    increment_user_count(ws);
+    ud->last_ts = (uint32_t)get_current_ts();
+    ud->cached = 0;
+    ud->sub_page = 0;
+    ud->sub_count = 0;
+    ud->bucket = {(float)std::max(get_rate_limit(), 1u), ud->last_ts};
+
+    add_ip(ws);
+    subscribe_all(ws);
+    increment_user_count();
     send_user_count(ws);
   };
 
   behavior.close = [](WS *ws, int code, std::string_view msg) {
     remove_cws(ws);
-
-    bool e = connected_wses.empty();
-    auto *u = e ? ws : connected_wses.front();
-    decrement_user_count(u);
-    if (!e)
-      send_user_count(u);
+    remove_ip(ws);
+    decrement_user_count();
   };
 
+  if (get_shed_bytes() > 0) {
+    behavior.drain = [](WS *ws) { check_backpressure(ws); };
+  }
+
   // handle dropped too?
   // behavior.dropped = ;
 
@@ -269,10 +855,10 @@ int run() {
 
     try {
       if (ud->flags & WSDF_C) {
-        // printf("SHOULD BE: n_o(%d) n_i(%d) cached(%s) data(%s)\n", ud->n_o,
-        //        ud->n_i, ud->cached.c_str(), std::string(msg).c_str());
+        // printf("SHOULD BE: n_o(%d) n_i(%d) cached(%lx) data(%s)\n", ud->n_o,
+        //        ud->n_i, ud->cached, std::string(msg).c_str());
 
-        if (!ud->cached.empty() && msg != ud->cached) {
+        if ((ud->flags & WSDF_CACHED) && fingerprint(msg) != ud->cached) {
           ws_end(ws, 69);
           return;
         }
@@ -281,8 +867,48 @@ int run() {
         return;
       }
 
-      commands::command_outs_t out;
-      int status = commands::run(msg, out);
+      if (msg == "bin;") {
+        // switch this connection to the binary protocol
+        if ((ud->flags & WSDF_BIN) == 0) {
+          unsubscribe_all(ws);
+          ud->flags |= WSDF_BIN;
+          subscribe_all(ws);
+        }
+
+        ws->send("bin;");
+        return;
+      }
+
+      if (msg.find("sc;") == 0) {
+        uint64_t page = 0;
+        uint64_t count = 0;
+        if (commands::subs(msg, page, count) == -1) {
+          ws_end(ws, 69);
+          return;
+        }
+
+        unsubscribe_all(ws);
+        // bound by STATE_PAGE_COUNT and MAX_SUBS_PAGES
+        ud->sub_page = (uint32_t)page;
+        ud->sub_count = (uint8_t)count;
+        subscribe_all(ws);
+        return;
+      }
+
+      const bool bin = (ud->flags & WSDF_BIN) && proto::is_binary(msg);
+
+      commands::command_outs_t &out = this_worker->out;
+      out.clear();
+
+      uint64_t i = A_TRILLION;
+#ifdef WITH_COLOR
+      cbox_t s = {};
+      int status = bin ? commands::run_bin(msg, out, i, s)
+                       : commands::run(msg, out, i, s);
+#else
+      int status = bin ? commands::run_bin(msg, out, i)
+                       : commands::run(msg, out, i);
+#endif // WITH_COLOR
 
       if (status < 0) {
         ws_end(ws, 69);
@@ -292,17 +918,39 @@ int run() {
       switch (status) {
       case 0:
         handle_ws_command_outs(ws, out);
+        out.clear();
         break;
       case 1: {
+        if (!allow_toggles(ws, 1)) {
+          send_rate_limited(ws);
+          break;
+        }
+
+        if (writer::running()) {
+          // applied later, rejected now like switch_state would
+          if (i > A_TRILLION - 1) {
+            ws_end(ws, 69);
+            return;
+          }
+
+          // the writer is behind, drop it rather than stall the loop
 #ifdef WITH_COLOR
-        cbox_t s;
-        uint64_t i = A_TRILLION;
-        int r = util::parse_cbox_wc(std::string(msg), i, s);
+          if (!writer::push(i, s)) {
+#else
+          if (!writer::push(i)) {
+#endif // WITH_COLOR
+            send_rate_limited(ws);
+            break;
+          }
 
-        if (r == 0)
-          r = switch_state(i, s);
+          alsfyuwlefasliuyrfgarhbwsgawlrg_a(ws);
+          break;
+        }
+
+#ifdef WITH_COLOR
+        int r = switch_state(i, s);
 #else
-        int r = switch_state(std::stoull(std::string(msg)));
+        int r = switch_state(i);
 #endif // WITH_COLOR
 
         if (r < 0) {
@@ -312,14 +960,35 @@ int run() {
 
 #ifdef WITH_COLOR
         get_state(i, s);
-        publish_global(ws, commands::p_state_wc(i, s));
+        publish_state(ws, i, s);
 #else
-        publish_global(ws, commands::p_state(std::string(msg), r));
+        publish_state(ws, i, r);
 #endif // WITH_COLOR
 
         alsfyuwlefasliuyrfgarhbwsgawlrg_a(ws);
         break;
       }
+      case 2: {
+        // a batch bigger than the burst never gets through
+        if (!allow_toggles(ws, out.toggles.size())) {
+          send_rate_limited(ws);
+          break;
+        }
+
+        int r = apply_batch(ws, out.toggles);
+        if (r == 1) {
+          send_rate_limited(ws);
+          break;
+        }
+
+        if (r != 0) {
+          ws_end(ws, 69);
+          return;
+        }
+
+        alsfyuwlefasliuyrfgarhbwsgawlrg_a(ws);
+        break;
+      }
       } // switch
     } catch (...) {
       ws_end(ws, 420);
@@ -331,10 +1000,14 @@ int run() {
 
   app.ws<ws_data_t>("/game", std::move(behavior));
 
+  // every worker listens on the same port, uSockets sets SO_REUSEPORT unless
+  // LIBUS_LISTEN_EXCLUSIVE_PORT is given so the kernel balances connections
   int port = get_port();
-  app.listen(port, [port](us_listen_socket_t *listen_socket) {
+  size_t id = w->id;
+  app.listen(port, [port, id](us_listen_socket_t *listen_socket) {
     if (listen_socket)
-      fprintf(stderr, "[server] Listening on port %d \n", port);
+      fprintf(stderr, "[server] Listening on port %d (thread %zu)\n", port,
+              id);
     else {
       fprintf(stderr, "[server ERROR] Listening socket is null\nPORT might "
                       "already in use\n");
@@ -343,12 +1016,89 @@ int run() {
     }
   });
 
-  _app_ptr = &app;
-  _loop_ptr = uWS::Loop::get();
+  const unsigned int tick = get_tick_ms();
+  if (tick > 0) {
+    w->tick_timer =
+        us_create_timer((us_loop_t *)uWS::Loop::get(), 1, sizeof(worker_t *));
+    *(worker_t **)us_timer_ext(w->tick_timer) = w;
+    us_timer_set(w->tick_timer, on_tick, tick, tick);
+  }
+
+  if (w->id == 0) {
+    w->uc_timer = us_create_timer((us_loop_t *)uWS::Loop::get(), 1, 0);
+    us_timer_set(w->uc_timer, on_uc_timer, UC_INTERVAL_MS, UC_INTERVAL_MS);
+  }
+
+  w->lag_timer =
+      us_create_timer((us_loop_t *)uWS::Loop::get(), 1, sizeof(worker_t *));
+  *(worker_t **)us_timer_ext(w->lag_timer) = w;
+  w->lag_last_us = now_us();
+  us_timer_set(w->lag_timer, on_lag_timer, LAG_INTERVAL_MS, LAG_INTERVAL_MS);
+
+  if (get_shed_bytes() > 0) {
+    w->shed_timer =
+        us_create_timer((us_loop_t *)uWS::Loop::get(), 1, sizeof(worker_t *));
+    *(worker_t **)us_timer_ext(w->shed_timer) = w;
+    us_timer_set(w->shed_timer, on_shed_timer, SHED_INTERVAL_MS,
+                 SHED_INTERVAL_MS);
+  }
+
+  {
+    std::lock_guard lk(workers_m);
+    w->app = &app;
+    w->loop = uWS::Loop::get();
+  }
+
+  // shutdown might have been dispatched before this loop was visible
+  if (shutting_down)
+    app.close();
 
   app.run();
 
-  _app_ptr = nullptr;
+  std::lock_guard lk(workers_m);
+  w->app = nullptr;
+  w->loop = nullptr;
+}
+
+int run() {
+  signal(SIGINT, on_sigint);
+  signal(SIGTERM, on_sigterm);
+
+  const unsigned int n = get_threads();
+  fprintf(stderr, "[server] Starting %u thread(s)\n", n);
+
+  {
+    // print_stats may already be reading
+    std::lock_guard lk(workers_m);
+    workers.clear();
+    for (unsigned int i = 0; i < n; i++) {
+      workers.push_back(std::make_unique<worker_t>());
+      workers.back()->id = i;
+    }
+  }
+
+  workers_ready = true;
+
+  if (get_single_writer())
+    writer::start(on_writer_batch);
+
+  for (unsigned int i = 1; i < n; i++)
+    workers[i]->thread = std::thread(run_worker, workers[i].get());
+
+  // first worker runs on this thread
+  run_worker(workers[0].get());
+
+  for (unsigned int i = 1; i < n; i++)
+    workers[i]->thread.join();
+
+  // nothing pushes anymore, the rest is applied but every loop is gone
+  writer::stop();
+
+  workers_ready = false;
+  {
+    std::lock_guard lk(workers_m);
+    workers.clear();
+  }
   shutting_down = false;
 
   signal(SIGINT, SIG_DFL);
@@ -360,7 +1110,7 @@ int run() {
 }
 
 int shutdown() {
-  if (!_loop_ptr || !_app_ptr)
+  if (!workers_ready)
     return -1;
 
   if (shutting_down)
@@ -368,17 +1118,46 @@ int shutdown() {
 
   shutting_down = true;
 
-  _loop_ptr->defer([]() {
-    if (!_app_ptr) {
-      fprintf(stderr, "[server::shutdown ERROR] _app_ptr "
-                      "is null on callback\n");
-      return;
-    }
+  for (auto &w : workers) {
+    uWS::Loop *loop = w->loop;
+    if (!loop)
+      continue;
+
+    worker_t *wp = w.get();
+    loop->defer([wp]() {
+      App *app = wp->app;
+      if (!app) {
+        fprintf(stderr, "[server::shutdown ERROR] app "
+                        "is null on callback\n");
+        return;
+      }
 
-    fprintf(stderr, "[server] Shutting down...\n");
+      fprintf(stderr, "[server] Shutting down thread %zu...\n", wp->id);
 
-    _app_ptr->close();
-  });
+      if (wp->tick_timer) {
+        flush_delta(wp);
+        us_timer_close(wp->tick_timer);
+        wp->tick_timer = nullptr;
+      }
+
+      if (wp->uc_timer) {
+        us_timer_close(wp->uc_timer);
+        wp->uc_timer = nullptr;
+      }
+
+      if (wp->shed_timer) {
+        us_timer_close(wp->shed_timer);
+        wp->shed_timer = nullptr;
+      }
+
+      if (wp->lag_timer) {
+        us_timer_close(wp->lag_timer);
+        wp->lag_timer = nullptr;
+      }
+
+      app->close();
+    });
+  }
 
   constexpr char m[] = "[server] Shutting down callback dispatched\n";
   constexpr size_t ms = (sizeof(m) / sizeof(*m)) - 1;
@@ -387,4 +1166,87 @@ int shutdown() {
   return 0;
 }
 
+void print_stats() {
+  uint64_t frames = 0;
+  uint64_t bytes = 0;
+  uint64_t raw_frames = 0;
+  uint64_t raw_bytes = 0;
+  uint64_t sampled_in = 0;
+  uint64_t sampled_out = 0;
+  uint64_t sampled_ns = 0;
+  uint64_t lag_samples = 0;
+  uint64_t lag_sum_us = 0;
+  uint64_t lag_max_us = 0;
+
+  {
+    std::lock_guard lk(workers_m);
+    for (const auto &w : workers) {
+      lag_samples += w->lag.samples.exchange(0, std::memory_order_relaxed);
+      lag_sum_us += w->lag.sum_us.exchange(0, std::memory_order_relaxed);
+      lag_max_us = std::max<uint64_t>(
+          lag_max_us, w->lag.max_us.exchange(0, std::memory_order_relaxed));
+
+      const compress_stats_t &st = w->stats;
+      frames += st.frames.load(std::memory_order_relaxed);
+      bytes += st.bytes.load(std::memory_order_relaxed);
+      raw_frames += st.raw_frames.load(std::memory_order_relaxed);
+      raw_bytes += st.raw_bytes.load(std::memory_order_relaxed);
+      sampled_in += st.sampled_in.load(std::memory_order_relaxed);
+      sampled_out += st.sampled_out.load(std::memory_order_relaxed);
+      sampled_ns += st.sampled_ns.load(std::memory_order_relaxed);
+    }
+  }
+
+  constexpr const char *modes[] = {"off", "shared", "dedicated"};
+
+  fprintf(stderr, "[server::print_stats] compression: %s\n",
+          modes[get_compression()]);
+  fprintf(stderr,
+          "[server::print_stats] compressed: %zu frame(s) %zu byte(s), "
+          "uncompressed: %zu frame(s) %zu byte(s)\n",
+          frames, bytes, raw_frames, raw_bytes);
+
+  fprintf(stderr,
+          "[server::print_stats] loop lag since last stats: avg %.1f us, "
+          "max %zu us\n",
+          lag_samples ? (double)lag_sum_us / lag_samples : 0.0, lag_max_us);
+
+#ifdef SPARSE_STATE
+  const sparse::stats_t ss = sparse::get_stats();
+
+  fprintf(stderr,
+          "[server::print_stats] sparse state: %lu set checkbox(es) in %lu "
+          "array, %lu bitmap, %lu run chunk(s), %.1f MB\n",
+          ss.set, ss.chunks[sparse::CONTAINER_ARRAY],
+          ss.chunks[sparse::CONTAINER_BITMAP],
+          ss.chunks[sparse::CONTAINER_RUN], ss.bytes / 1048576.0);
+#endif // SPARSE_STATE
+
+  if (writer::running()) {
+    const writer::stats_t ws = writer::get_stats();
+
+    fprintf(stderr,
+            "[server::print_stats] writer: %zu toggle(s) in %zu batch(es), "
+            "latency avg: %.1f us max: %.1f us, %zu dropped on a full "
+            "ring\n",
+            ws.applied, ws.batches,
+            ws.applied ? (double)ws.latency_ns_sum / ws.applied / 1000 : 0.0,
+            (double)ws.latency_ns_max / 1000, ws.dropped);
+  }
+
+  if (sampled_in == 0)
+    return;
+
+  const double ratio = (double)sampled_out / sampled_in;
+  const double ns_per_byte = (double)sampled_ns / sampled_in;
+
+  // per frame handed to uWS, dedicated compressors pay the CPU once per
+  // receiving connection
+  fprintf(stderr,
+          "[server::print_stats] sampled ratio: %.1f%%, %.1f us/KB, est. "
+          "saved: %.0f byte(s), est. CPU: %.1f ms\n",
+          ratio * 100, ns_per_byte * 1024 / 1000, bytes * (1 - ratio),
+          bytes * ns_per_byte / 1e6);
+}
+
 } // namespace atcboxes::server
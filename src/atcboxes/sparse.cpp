@@ -0,0 +1,749 @@
+#include "atcboxes/sparse.h"
+
+#ifdef SPARSE_STATE
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+namespace atcboxes::sparse {
+
+struct run_t {
+  uint16_t first;
+  uint16_t last;
+};
+
+#ifdef WITH_COLOR
+using value_t = cbox_t;
+constexpr size_t VALUE_BYTES = sizeof(cbox_t);
+#else
+// array and run containers only hold set checkboxes, no value needed
+using value_t = bool;
+constexpr size_t VALUE_BYTES = 0;
+#endif // WITH_COLOR
+
+// container bytes per entry, chunks are converted to the smallest
+constexpr size_t ARRAY_BYTES = sizeof(uint16_t) + VALUE_BYTES;
+constexpr size_t RUN_BYTES = sizeof(run_t) + VALUE_BYTES;
+constexpr size_t BITMAP_BYTES = CHUNK_SIZE_BYTES;
+static_assert(ARRAY_MAX == BITMAP_BYTES / ARRAY_BYTES);
+
+struct chunk_t {
+  container_e type = CONTAINER_ARRAY;
+  // set checkboxes, an empty chunk is deleted
+  uint32_t card = 0;
+  // array: sorted offsets
+  std::vector<uint16_t> keys;
+  // run: sorted, adjacent runs always differ in value
+  std::vector<run_t> runs;
+#ifdef WITH_COLOR
+  // array: one per key. run: one per run. bitmap: one per offset
+  std::vector<cbox_t> values;
+#else
+  // bitmap: one bit per offset
+  std::vector<uint64_t> bits;
+#endif // WITH_COLOR
+};
+
+// chunks are found through blocks of BLOCK_SIZE pointers, a block is allocated
+// on the first write to one of its chunks and kept. A chunk pointer only
+// changes under its stripe lock.
+constexpr size_t BLOCK_SIZE = 4096;
+constexpr size_t BLOCK_COUNT = (CHUNK_COUNT + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+struct block_t {
+  std::atomic<chunk_t *> chunks[BLOCK_SIZE];
+};
+
+static std::atomic<block_t *> blocks[BLOCK_COUNT];
+
+struct alignas(64) stripe_t {
+  std::mutex m;
+};
+
+static stripe_t stripes[STRIPE_COUNT];
+
+static std::mutex &stripe(uint64_t c) { return stripes[c % STRIPE_COUNT].m; }
+
+/**
+ * @param alloc allocate the block when missing
+ * @return chunk c's pointer, nullptr when its block is missing
+ */
+static std::atomic<chunk_t *> *slot(uint64_t c, bool alloc) {
+  std::atomic<block_t *> &b = blocks[c / BLOCK_SIZE];
+
+  block_t *p = b.load(std::memory_order_acquire);
+  if (p == nullptr) {
+    if (!alloc)
+      return nullptr;
+
+    block_t *n = new block_t();
+
+    if (b.compare_exchange_strong(p, n, std::memory_order_acq_rel))
+      p = n;
+    else
+      delete n;
+  }
+
+  return &p->chunks[c % BLOCK_SIZE];
+}
+
+#ifdef WITH_COLOR
+static uint32_t pack(const cbox_t &v) {
+  uint32_t p;
+  memcpy(&p, &v, sizeof(p));
+
+  return p;
+}
+
+static bool is_set(const cbox_t &v) { return pack(v) != 0; }
+
+static bool same(const cbox_t &a, const cbox_t &b) {
+  return pack(a) == pack(b);
+}
+#else
+static bool is_set(bool v) { return v; }
+
+static bool same(bool a, bool b) { return a == b; }
+#endif // WITH_COLOR
+
+static value_t run_value(const chunk_t &ch, size_t r) {
+#ifdef WITH_COLOR
+  return ch.values[r];
+#else
+  (void)ch;
+  (void)r;
+  return true;
+#endif // WITH_COLOR
+}
+
+static void push_value(chunk_t &ch, const value_t &v) {
+#ifdef WITH_COLOR
+  ch.values.push_back(v);
+#else
+  (void)ch;
+  (void)v;
+#endif // WITH_COLOR
+}
+
+static void run_insert(chunk_t &ch, size_t r, run_t run, const value_t &v) {
+  ch.runs.insert(ch.runs.begin() + r, run);
+#ifdef WITH_COLOR
+  ch.values.insert(ch.values.begin() + r, v);
+#else
+  (void)v;
+#endif // WITH_COLOR
+}
+
+static void run_erase(chunk_t &ch, size_t r) {
+  ch.runs.erase(ch.runs.begin() + r);
+#ifdef WITH_COLOR
+  ch.values.erase(ch.values.begin() + r);
+#endif // WITH_COLOR
+}
+
+/**
+ * @return index of the run holding o, SIZE_MAX none
+ */
+static size_t find_run(const std::vector<run_t> &runs, uint32_t o) {
+  auto it = std::upper_bound(
+      runs.begin(), runs.end(), o,
+      [](uint32_t o, const run_t &r) { return o < r.first; });
+
+  if (it == runs.begin() || (--it)->last < o)
+    return SIZE_MAX;
+
+  return it - runs.begin();
+}
+
+static value_t chunk_get(const chunk_t &ch, uint32_t o) {
+  switch (ch.type) {
+  case CONTAINER_ARRAY: {
+    auto it = std::lower_bound(ch.keys.begin(), ch.keys.end(), o);
+    if (it == ch.keys.end() || *it != o)
+      return {};
+
+#ifdef WITH_COLOR
+    return ch.values[it - ch.keys.begin()];
+#else
+    return true;
+#endif // WITH_COLOR
+  }
+  case CONTAINER_BITMAP:
+#ifdef WITH_COLOR
+    return ch.values[o];
+#else
+    return (ch.bits[o / 64] >> (o % 64)) & 1;
+#endif // WITH_COLOR
+  case CONTAINER_RUN: {
+    const size_t r = find_run(ch.runs, o);
+    if (r == SIZE_MAX)
+      return {};
+
+    return run_value(ch, r);
+  }
+  default:
+    break;
+  }
+
+  return {};
+}
+
+static void array_assign(chunk_t &ch, uint32_t o, const value_t &v) {
+  auto it = std::lower_bound(ch.keys.begin(), ch.keys.end(), o);
+#ifdef WITH_COLOR
+  const size_t pos = it - ch.keys.begin();
+#endif // WITH_COLOR
+
+  if (it != ch.keys.end() && *it == o) {
+    if (is_set(v)) {
+#ifdef WITH_COLOR
+      ch.values[pos] = v;
+#endif // WITH_COLOR
+      return;
+    }
+
+    ch.keys.erase(it);
+#ifdef WITH_COLOR
+    ch.values.erase(ch.values.begin() + pos);
+#endif // WITH_COLOR
+    ch.card--;
+    return;
+  }
+
+  if (!is_set(v))
+    return;
+
+  ch.keys.insert(it, (uint16_t)o);
+#ifdef WITH_COLOR
+  ch.values.insert(ch.values.begin() + pos, v);
+#endif // WITH_COLOR
+  ch.card++;
+}
+
+static void bitmap_assign(chunk_t &ch, uint32_t o, const value_t &v) {
+#ifdef WITH_COLOR
+  const bool was = is_set(ch.values[o]);
+  ch.values[o] = v;
+#else
+  uint64_t &w = ch.bits[o / 64];
+  const uint64_t b = (uint64_t)1 << (o % 64);
+  const bool was = (w & b) != 0;
+
+  w = v ? w | b : w & ~b;
+#endif // WITH_COLOR
+
+  if (was && !is_set(v))
+    ch.card--;
+  else if (!was && is_set(v))
+    ch.card++;
+}
+
+/**
+ * @brief Join runs in [from, to] continuing the previous one with the same
+ *        value.
+ */
+static void merge_runs(chunk_t &ch, size_t from, size_t to) {
+  size_t r = from;
+
+  while (r < to && r + 1 < ch.runs.size()) {
+    if (ch.runs[r].last + 1 != ch.runs[r + 1].first ||
+        !same(run_value(ch, r), run_value(ch, r + 1))) {
+      r++;
+      continue;
+    }
+
+    ch.runs[r].last = ch.runs[r + 1].last;
+    run_erase(ch, r + 1);
+    to--;
+  }
+}
+
+static void run_assign(chunk_t &ch, uint32_t o, const value_t &v) {
+  size_t r = find_run(ch.runs, o);
+
+  if (r == SIZE_MAX) {
+    if (!is_set(v))
+      return;
+
+    r = std::upper_bound(
+            ch.runs.begin(), ch.runs.end(), o,
+            [](uint32_t o, const run_t &r) { return o < r.first; }) -
+        ch.runs.begin();
+
+    run_insert(ch, r, {(uint16_t)o, (uint16_t)o}, v);
+    ch.card++;
+  } else {
+    const run_t old = ch.runs[r];
+    const value_t old_v = run_value(ch, r);
+
+    if (same(old_v, v))
+      return;
+
+    // split around o, o in between when it stays set
+    size_t at = r;
+    run_erase(ch, r);
+
+    if (o > old.first)
+      run_insert(ch, at++, {old.first, (uint16_t)(o - 1)}, old_v);
+
+    if (is_set(v))
+      run_insert(ch, at++, {(uint16_t)o, (uint16_t)o}, v);
+    else
+      ch.card--;
+
+    if (o < old.last)
+      run_insert(ch, at++, {(uint16_t)(o + 1), old.last}, old_v);
+  }
+
+  merge_runs(ch, r > 0 ? r - 1 : 0, r + 3);
+}
+
+#ifndef WITH_COLOR
+static void set_bits(uint64_t *w, uint32_t a, uint32_t b) {
+  while (a < b) {
+    const uint32_t e = std::min(b, (a / 64 + 1) * 64);
+    const uint32_t n = e - a;
+
+    w[a / 64] |= (n == 64 ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1))
+                 << (a % 64);
+    a = e;
+  }
+}
+#endif // WITH_COLOR
+
+/**
+ * @brief Write n elements of ch starting from element from to dst, zeroed by
+ *        the caller.
+ * @return whether any of them is set
+ */
+static bool chunk_read(const chunk_t &ch, uint32_t from, uint32_t n,
+                       CBOX_T *dst) {
+  // offsets covered
+  const uint32_t lo = from * STATE_PER_ELEMENT;
+  const uint32_t hi = (from + n) * STATE_PER_ELEMENT;
+  bool any = false;
+
+  switch (ch.type) {
+  case CONTAINER_ARRAY: {
+    auto it = std::lower_bound(ch.keys.begin(), ch.keys.end(), lo);
+
+    for (; it != ch.keys.end() && *it < hi; it++) {
+      const uint32_t o = *it - lo;
+#ifdef WITH_COLOR
+      dst[o] = ch.values[it - ch.keys.begin()];
+#else
+      dst[o / 64] |= (uint64_t)1 << (o % 64);
+#endif // WITH_COLOR
+      any = true;
+    }
+
+    break;
+  }
+  case CONTAINER_BITMAP:
+#ifdef WITH_COLOR
+    memcpy(dst, ch.values.data() + from, n * sizeof(cbox_t));
+
+    for (uint32_t i = 0; i < n && !any; i++)
+      any = is_set(dst[i]);
+#else
+    memcpy(dst, ch.bits.data() + from, n * sizeof(uint64_t));
+
+    for (uint32_t i = 0; i < n && !any; i++)
+      any = dst[i] != 0;
+#endif // WITH_COLOR
+    break;
+  case CONTAINER_RUN: {
+    auto it = std::lower_bound(
+        ch.runs.begin(), ch.runs.end(), lo,
+        [](const run_t &r, uint32_t lo) { return r.last < lo; });
+
+    for (; it != ch.runs.end() && it->first < hi; it++) {
+      const uint32_t a = std::max<uint32_t>(it->first, lo) - lo;
+      const uint32_t b = std::min<uint32_t>(it->last + 1, hi) - lo;
+#ifdef WITH_COLOR
+      std::fill(dst + a, dst + b, ch.values[it - ch.runs.begin()]);
+#else
+      set_bits(dst, a, b);
+#endif // WITH_COLOR
+      any = true;
+    }
+
+    break;
+  }
+  default:
+    break;
+  }
+
+  return any;
+}
+
+/**
+ * @brief Call f(offset, value) for every set checkbox of a whole chunk's
+ *        elements, in order.
+ */
+template <class F> static void for_each_set(const CBOX_T *src, F &&f) {
+  for (uint32_t e = 0; e < CHUNK_ELEMENT_COUNT; e++) {
+#ifdef WITH_COLOR
+    if (is_set(src[e]))
+      f(e, src[e]);
+#else
+    for (uint64_t w = src[e]; w != 0; w &= w - 1)
+      f(e * 64 + __builtin_ctzll(w), true);
+#endif // WITH_COLOR
+  }
+}
+
+/**
+ * @return the smallest container of a whole chunk's elements, nullptr when
+ *         none is set
+ */
+static chunk_t *from_dense(const CBOX_T *src) {
+  uint32_t card = 0;
+  uint32_t run_count = 0;
+
+#ifdef WITH_COLOR
+  for (uint32_t o = 0; o < CHUNK_SIZE; o++) {
+    if (!is_set(src[o]))
+      continue;
+
+    card++;
+    if (o == 0 || !same(src[o], src[o - 1]))
+      run_count++;
+  }
+#else
+  uint64_t carry = 0;
+  for (uint32_t e = 0; e < CHUNK_ELEMENT_COUNT; e++) {
+    const uint64_t w = src[e];
+
+    card += __builtin_popcountll(w);
+    // a run starts at every set bit following an unset one
+    run_count += __builtin_popcountll(w & ~((w << 1) | carry));
+    carry = w >> 63;
+  }
+#endif // WITH_COLOR
+
+  if (card == 0)
+    return nullptr;
+
+  chunk_t *ch = new chunk_t();
+  ch->card = card;
+
+  const size_t array_bytes = card * ARRAY_BYTES;
+  const size_t run_bytes = run_count * RUN_BYTES;
+
+  if (run_bytes < std::min(array_bytes, BITMAP_BYTES)) {
+    ch->type = CONTAINER_RUN;
+    ch->runs.reserve(run_count);
+
+    for_each_set(src, [ch](uint32_t o, const value_t &v) {
+      run_t *last = ch->runs.empty() ? nullptr : &ch->runs.back();
+
+      if (last && last->last + 1u == o &&
+          same(run_value(*ch, ch->runs.size() - 1), v)) {
+        last->last = o;
+        return;
+      }
+
+      ch->runs.push_back({(uint16_t)o, (uint16_t)o});
+      push_value(*ch, v);
+    });
+  } else if (array_bytes <= BITMAP_BYTES) {
+    ch->type = CONTAINER_ARRAY;
+    ch->keys.reserve(card);
+
+    for_each_set(src, [ch](uint32_t o, const value_t &v) {
+      ch->keys.push_back(o);
+      push_value(*ch, v);
+    });
+  } else {
+    ch->type = CONTAINER_BITMAP;
+#ifdef WITH_COLOR
+    ch->values.assign(src, src + CHUNK_ELEMENT_COUNT);
+#else
+    ch->bits.assign(src, src + CHUNK_ELEMENT_COUNT);
+#endif // WITH_COLOR
+  }
+
+  return ch;
+}
+
+/**
+ * @return whether ch outgrew (or shrank out of) its container
+ */
+static bool misfit(const chunk_t &ch) {
+  switch (ch.type) {
+  case CONTAINER_ARRAY:
+    return ch.card > ARRAY_MAX;
+  case CONTAINER_BITMAP:
+    return ch.card < ARRAY_MAX / 2;
+  case CONTAINER_RUN:
+    return ch.runs.size() * RUN_BYTES >
+           std::min(ch.card * ARRAY_BYTES, BITMAP_BYTES);
+  default:
+    break;
+  }
+
+  return false;
+}
+
+/**
+ * @return ch in the smallest container
+ */
+static chunk_t *optimize(const chunk_t &ch) {
+  thread_local std::vector<CBOX_T> dense(CHUNK_ELEMENT_COUNT);
+
+  std::fill(dense.begin(), dense.end(), CBOX_T{});
+  chunk_read(ch, 0, CHUNK_ELEMENT_COUNT, dense.data());
+
+  return from_dense(dense.data());
+}
+
+/**
+ * @brief Caller holds c's stripe lock.
+ */
+static value_t lookup(uint64_t c, uint32_t o) {
+  std::atomic<chunk_t *> *s = slot(c, false);
+  const chunk_t *ch = s ? s->load(std::memory_order_relaxed) : nullptr;
+
+  return ch ? chunk_get(*ch, o) : value_t{};
+}
+
+/**
+ * @brief Write offset o of chunk c, an unset v removes it. Caller holds c's
+ *        stripe lock.
+ */
+static void assign(uint64_t c, uint32_t o, const value_t &v) {
+  std::atomic<chunk_t *> *s = slot(c, is_set(v));
+  if (s == nullptr)
+    return;
+
+  chunk_t *ch = s->load(std::memory_order_relaxed);
+  if (ch == nullptr) {
+    if (!is_set(v))
+      return;
+
+    ch = new chunk_t();
+    s->store(ch, std::memory_order_release);
+  }
+
+  switch (ch->type) {
+  case CONTAINER_ARRAY:
+    array_assign(*ch, o, v);
+    break;
+  case CONTAINER_BITMAP:
+    bitmap_assign(*ch, o, v);
+    break;
+  case CONTAINER_RUN:
+    run_assign(*ch, o, v);
+    break;
+  default:
+    break;
+  }
+
+  if (ch->card == 0) {
+    s->store(nullptr, std::memory_order_release);
+    delete ch;
+  } else if (misfit(*ch)) {
+    s->store(optimize(*ch), std::memory_order_release);
+    delete ch;
+  }
+}
+
+#ifdef WITH_COLOR
+void toggle(uint64_t i, const cbox_t &s, cbox_t &next) {
+  const uint64_t c = i / CHUNK_SIZE;
+  const uint32_t o = i % CHUNK_SIZE;
+
+  std::lock_guard lk(stripe(c));
+
+  const cbox_t prev = lookup(c, o);
+
+  next = s;
+  next.a = (s.a & (~1)) | ((prev.a & 1) ^ 1);
+
+  assign(c, o, next);
+}
+
+void set(uint64_t i, const cbox_t &s) {
+  std::lock_guard lk(stripe(i / CHUNK_SIZE));
+
+  assign(i / CHUNK_SIZE, i % CHUNK_SIZE, s);
+}
+
+int get(uint64_t i, cbox_t &s) {
+  std::lock_guard lk(stripe(i / CHUNK_SIZE));
+
+  s = lookup(i / CHUNK_SIZE, i % CHUNK_SIZE);
+
+  return s.a & 1;
+}
+#else
+int toggle(uint64_t i) {
+  const uint64_t c = i / CHUNK_SIZE;
+  const uint32_t o = i % CHUNK_SIZE;
+
+  std::lock_guard lk(stripe(c));
+
+  const bool on = !lookup(c, o);
+  assign(c, o, on);
+
+  return on ? 1 : 0;
+}
+
+void set(uint64_t i, bool on) {
+  std::lock_guard lk(stripe(i / CHUNK_SIZE));
+
+  assign(i / CHUNK_SIZE, i % CHUNK_SIZE, on);
+}
+
+int get(uint64_t i) {
+  std::lock_guard lk(stripe(i / CHUNK_SIZE));
+
+  return lookup(i / CHUNK_SIZE, i % CHUNK_SIZE) ? 1 : 0;
+}
+#endif // WITH_COLOR
+
+bool read(uint64_t first, size_t n, CBOX_T *dst) {
+  memset((void *)dst, 0, n * STATE_ELEMENT_SIZE);
+
+  const uint64_t end = first + n;
+  bool any = false;
+
+  for (uint64_t e = first; e < end;) {
+    const uint64_t c = e / CHUNK_ELEMENT_COUNT;
+    const uint32_t from = e % CHUNK_ELEMENT_COUNT;
+    const uint32_t len =
+        std::min<uint64_t>(CHUNK_ELEMENT_COUNT - from, end - e);
+
+    // most chunks are empty, don't lock those
+    std::atomic<chunk_t *> *s = slot(c, false);
+    if (s && s->load(std::memory_order_relaxed)) {
+      std::lock_guard lk(stripe(c));
+
+      if (const chunk_t *ch = s->load(std::memory_order_relaxed))
+        any |= chunk_read(*ch, from, len, dst + (e - first));
+    }
+
+    e += len;
+  }
+
+  return any;
+}
+
+bool empty(uint64_t first, size_t n) {
+  if (n == 0)
+    return true;
+
+  const uint64_t last = (first + n - 1) / CHUNK_ELEMENT_COUNT;
+
+  for (uint64_t c = first / CHUNK_ELEMENT_COUNT; c <= last; c++) {
+    std::atomic<chunk_t *> *s = slot(c, false);
+
+    if (s && s->load(std::memory_order_relaxed))
+      return false;
+  }
+
+  return true;
+}
+
+void set_chunk(uint64_t c, const CBOX_T *src) {
+  chunk_t *ch = from_dense(src);
+
+  std::lock_guard lk(stripe(c));
+
+  std::atomic<chunk_t *> *s = slot(c, ch != nullptr);
+  if (s)
+    delete s->exchange(ch, std::memory_order_release);
+}
+
+/**
+ * @brief Call f(slot) for every chunk, holding its stripe lock.
+ */
+template <class F> static void for_each_chunk(F &&f) {
+  for (size_t b = 0; b < BLOCK_COUNT; b++) {
+    block_t *p = blocks[b].load(std::memory_order_acquire);
+    if (p == nullptr)
+      continue;
+
+    for (size_t k = 0; k < BLOCK_SIZE; k++) {
+      std::atomic<chunk_t *> &s = p->chunks[k];
+      if (s.load(std::memory_order_relaxed) == nullptr)
+        continue;
+
+      std::lock_guard lk(stripe(b * BLOCK_SIZE + k));
+      if (s.load(std::memory_order_relaxed) != nullptr)
+        f(s);
+    }
+  }
+}
+
+container_e container(uint64_t c) {
+  std::lock_guard lk(stripe(c));
+
+  std::atomic<chunk_t *> *s = slot(c, false);
+  const chunk_t *ch = s ? s->load(std::memory_order_relaxed) : nullptr;
+
+  return ch ? ch->type : CONTAINER_COUNT;
+}
+
+uint64_t count_active() {
+  uint64_t n = 0;
+
+  for_each_chunk([&n](std::atomic<chunk_t *> &s) {
+    const chunk_t *ch = s.load(std::memory_order_relaxed);
+#ifdef WITH_COLOR
+    // set isn't checked, a colored checkbox can be unchecked
+    if (ch->type == CONTAINER_RUN) {
+      for (size_t r = 0; r < ch->runs.size(); r++)
+        if (ch->values[r].a & 1)
+          n += ch->runs[r].last - ch->runs[r].first + 1;
+
+      return;
+    }
+
+    for (const cbox_t &v : ch->values)
+      n += v.a & 1;
+#else
+    n += ch->card;
+#endif // WITH_COLOR
+  });
+
+  return n;
+}
+
+void clear() {
+  for_each_chunk([](std::atomic<chunk_t *> &s) {
+    delete s.exchange(nullptr, std::memory_order_release);
+  });
+}
+
+stats_t get_stats() {
+  stats_t st = {};
+
+  for (size_t b = 0; b < BLOCK_COUNT; b++)
+    if (blocks[b].load(std::memory_order_relaxed))
+      st.bytes += sizeof(block_t);
+
+  for_each_chunk([&st](std::atomic<chunk_t *> &s) {
+    const chunk_t *ch = s.load(std::memory_order_relaxed);
+
+    st.chunks[ch->type]++;
+    st.set += ch->card;
+    st.bytes += sizeof(chunk_t) + ch->keys.capacity() * sizeof(uint16_t) +
+                ch->runs.capacity() * sizeof(run_t);
+#ifdef WITH_COLOR
+    st.bytes += ch->values.capacity() * sizeof(cbox_t);
+#else
+    st.bytes += ch->bits.capacity() * sizeof(uint64_t);
+#endif // WITH_COLOR
+  });
+
+  return st;
+}
+
+} // namespace atcboxes::sparse
+
+#endif // SPARSE_STATE
@@ -0,0 +1,679 @@
+#include "atcboxes/state_io.h"
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace atcboxes::state_io {
+
+// fallback backend threads
+constexpr unsigned int POOL_THREADS = 4;
+
+static bool use_direct = false;
+static bool use_uring = false;
+
+struct op_t {
+  int fd;
+  char *buf;
+  size_t len;
+  uint64_t off;
+  bool write;
+};
+
+/**
+ * io_uring through raw syscalls, one submission per op
+ */
+struct uring_t {
+  int fd = -1;
+  void *sq_ptr = MAP_FAILED;
+  size_t sq_size = 0;
+  void *cq_ptr = MAP_FAILED;
+  size_t cq_size = 0;
+  io_uring_sqe *sqes = (io_uring_sqe *)MAP_FAILED;
+  size_t sqes_size = 0;
+
+  unsigned *sq_tail = nullptr;
+  unsigned *sq_mask = nullptr;
+  unsigned *sq_array = nullptr;
+  unsigned *cq_head = nullptr;
+  unsigned *cq_tail = nullptr;
+  unsigned *cq_mask = nullptr;
+  io_uring_cqe *cqes = nullptr;
+};
+
+static void uring_free(uring_t &r) {
+  if (r.sqes != MAP_FAILED)
+    munmap(r.sqes, r.sqes_size);
+  if (r.cq_ptr != MAP_FAILED && r.cq_ptr != r.sq_ptr)
+    munmap(r.cq_ptr, r.cq_size);
+  if (r.sq_ptr != MAP_FAILED)
+    munmap(r.sq_ptr, r.sq_size);
+  if (r.fd != -1)
+    close(r.fd);
+
+  r = uring_t();
+}
+
+/**
+ * @return 0 success, -1 err
+ */
+static int uring_setup(uring_t &r, unsigned int entries) {
+  io_uring_params p = {};
+  r.fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if (r.fd < 0) {
+    r.fd = -1;
+    return -1;
+  }
+
+  r.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+
+  // both rings in one mapping since 5.4
+  const bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single)
+    r.sq_size = r.cq_size = std::max(r.sq_size, r.cq_size);
+
+  r.sq_ptr = mmap(nullptr, r.sq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQ_RING);
+  if (r.sq_ptr == MAP_FAILED)
+    goto err;
+
+  if (single) {
+    r.cq_ptr = r.sq_ptr;
+  } else {
+    r.cq_ptr = mmap(nullptr, r.cq_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_CQ_RING);
+    if (r.cq_ptr == MAP_FAILED)
+      goto err;
+  }
+
+  r.sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+  r.sqes = (io_uring_sqe *)mmap(nullptr, r.sqes_size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, r.fd,
+                                IORING_OFF_SQES);
+  if (r.sqes == MAP_FAILED)
+    goto err;
+
+  {
+    char *sq = (char *)r.sq_ptr;
+    char *cq = (char *)r.cq_ptr;
+
+    r.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r.sq_array = (unsigned *)(sq + p.sq_off.array);
+    r.cq_head = (unsigned *)(cq + p.cq_off.head);
+    r.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r.cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+  }
+
+  return 0;
+
+err:
+  perror("[state_io ERROR] mmap");
+  uring_free(r);
+  return -1;
+}
+
+static int uring_enter(uring_t &r, unsigned int submit, unsigned int wait) {
+  for (;;) {
+    int ret = (int)syscall(__NR_io_uring_enter, r.fd, submit, wait,
+                           wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    if (ret >= 0 || errno != EINTR)
+      return ret;
+  }
+}
+
+/**
+ * @param iov kept alive until the op completes
+ * @return 0 success, -1 err
+ */
+static int uring_submit(uring_t &r, uint64_t tag, const op_t &op,
+                        iovec &iov) {
+  // only this thread moves the tail
+  const unsigned int tail = *r.sq_tail;
+  const unsigned int idx = tail & *r.sq_mask;
+
+  iov = {op.buf, op.len};
+
+  io_uring_sqe &sqe = r.sqes[idx];
+  memset(&sqe, 0, sizeof(sqe));
+  // the vectored ops go back to 5.1
+  sqe.opcode = op.write ? IORING_OP_WRITEV : IORING_OP_READV;
+  sqe.fd = op.fd;
+  sqe.off = op.off;
+  sqe.addr = (uint64_t)&iov;
+  sqe.len = 1;
+  sqe.user_data = tag;
+
+  r.sq_array[idx] = idx;
+  __atomic_store_n(r.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  return uring_enter(r, 1, 0) == 1 ? 0 : -1;
+}
+
+/**
+ * @param res bytes transferred, -errno err
+ * @return 0 success, -1 err
+ */
+static int uring_wait(uring_t &r, uint64_t &tag, int64_t &res) {
+  for (;;) {
+    const unsigned int head = *r.cq_head;
+
+    if (head != __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE)) {
+      const io_uring_cqe &cqe = r.cqes[head & *r.cq_mask];
+      tag = cqe.user_data;
+      res = cqe.res;
+
+      __atomic_store_n(r.cq_head, head + 1, __ATOMIC_RELEASE);
+      return 0;
+    }
+
+    if (uring_enter(r, 0, 1) < 0)
+      return -1;
+  }
+}
+
+// how long a failed ring gets to hand back the ops still in flight
+constexpr int DRAIN_TIMEOUT_MS = 10'000;
+
+/**
+ * @brief Reap n completions without io_uring_enter after it failed, the
+ *        kernel still posts them to the shared ring. Their buffers are only
+ *        safe to reuse once they're back.
+ * @return ops that never came back
+ */
+static unsigned int uring_drain(uring_t &r, unsigned int n) {
+  for (int ms = 0; n > 0 && ms < DRAIN_TIMEOUT_MS; ms++) {
+    unsigned int head = *r.cq_head;
+
+    while (n > 0 && head != __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE)) {
+      head++;
+      n--;
+    }
+
+    __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+
+    if (n > 0)
+      usleep(1000);
+  }
+
+  return n;
+}
+
+/**
+ * pread/pwrite on a few threads, for kernels without io_uring or where it's
+ * filtered out (containers often do)
+ */
+struct pool_t {
+  std::vector<std::thread> threads;
+  std::mutex m;
+  std::condition_variable todo_cv;
+  std::condition_variable done_cv;
+  std::deque<std::pair<uint64_t, op_t>> todo;
+  std::deque<std::pair<uint64_t, int64_t>> done;
+  bool stopping = false;
+};
+
+static void pool_run(pool_t *p) {
+  std::unique_lock lk(p->m);
+
+  for (;;) {
+    p->todo_cv.wait(lk, [p]() { return p->stopping || !p->todo.empty(); });
+    if (p->todo.empty())
+      return;
+
+    const auto [tag, op] = p->todo.front();
+    p->todo.pop_front();
+    lk.unlock();
+
+    ssize_t r = op.write ? pwrite(op.fd, op.buf, op.len, op.off)
+                         : pread(op.fd, op.buf, op.len, op.off);
+    const int64_t res = r < 0 ? -errno : r;
+
+    lk.lock();
+    p->done.emplace_back(tag, res);
+    p->done_cv.notify_one();
+  }
+}
+
+// one op per slot, up to QUEUE_DEPTH in flight on either backend
+struct queue_t {
+  uring_t ring;
+  pool_t pool;
+  bool uring = false;
+
+  op_t ops[QUEUE_DEPTH];
+  iovec iovs[QUEUE_DEPTH];
+  // bytes of the slot's op transferred so far
+  size_t moved[QUEUE_DEPTH];
+  unsigned int in_flight = 0;
+  // the ring failed, in_flight ops never came back and the kernel might still
+  // use their buffers
+  bool broken = false;
+};
+
+/**
+ * @return 0 success, -1 err
+ */
+static int queue_open(queue_t &q) {
+  q.uring = use_uring && uring_setup(q.ring, QUEUE_DEPTH) == 0;
+  if (q.uring)
+    return 0;
+
+  for (unsigned int i = 0; i < POOL_THREADS; i++)
+    q.pool.threads.emplace_back(pool_run, &q.pool);
+
+  return 0;
+}
+
+static void queue_close(queue_t &q) {
+  if (q.uring) {
+    uring_free(q.ring);
+    return;
+  }
+
+  {
+    std::lock_guard lk(q.pool.m);
+    q.pool.stopping = true;
+  }
+
+  q.pool.todo_cv.notify_all();
+  for (std::thread &t : q.pool.threads)
+    t.join();
+}
+
+static int queue_push(queue_t &q, unsigned int slot) {
+  const op_t op = q.ops[slot];
+
+  if (q.uring)
+    return uring_submit(q.ring, slot, op, q.iovs[slot]);
+
+  {
+    std::lock_guard lk(q.pool.m);
+    q.pool.todo.emplace_back(slot, op);
+  }
+
+  q.pool.todo_cv.notify_one();
+  return 0;
+}
+
+/**
+ * @return 0 success, -1 err
+ */
+static int queue_submit(queue_t &q, unsigned int slot, const op_t &op) {
+  q.ops[slot] = op;
+  q.moved[slot] = 0;
+
+  if (queue_push(q, slot) != 0)
+    return -1;
+
+  q.in_flight++;
+  return 0;
+}
+
+/**
+ * @brief Wait until an op is done. Short writes are resubmitted, a short read
+ *        is EOF.
+ * @param moved bytes the op transferred
+ * @return 0 success, -1 err (slot still set), -2 the ring failed and every op
+ *         in flight is abandoned (no slot). Those that didn't come back are
+ *         left in in_flight, their buffers can't be freed
+ */
+static int queue_wait(queue_t &q, unsigned int &slot, size_t &moved) {
+  if (q.broken)
+    return -2;
+
+  for (;;) {
+    uint64_t tag = 0;
+    int64_t res = 0;
+
+    if (q.uring) {
+      if (uring_wait(q.ring, tag, res) != 0) {
+        perror("[state_io ERROR] io_uring_enter");
+        q.broken = true;
+        q.in_flight = uring_drain(q.ring, q.in_flight);
+
+        if (q.in_flight > 0)
+          fprintf(stderr,
+                  "[state_io ERROR] %u op(s) never completed, their "
+                  "buffers are left to the kernel\n",
+                  q.in_flight);
+
+        return -2;
+      }
+    } else {
+      std::unique_lock lk(q.pool.m);
+      q.pool.done_cv.wait(lk, [&q]() { return !q.pool.done.empty(); });
+      tag = q.pool.done.front().first;
+      res = q.pool.done.front().second;
+      q.pool.done.pop_front();
+    }
+
+    slot = (unsigned int)tag;
+    op_t &op = q.ops[slot];
+
+    if (res == -EINTR || res == -EAGAIN) {
+      if (queue_push(q, slot) == 0)
+        continue;
+
+      res = -EIO;
+    }
+
+    if (res < 0) {
+      q.in_flight--;
+      errno = (int)-res;
+      perror("[state_io ERROR]");
+      return -1;
+    }
+
+    q.moved[slot] += res;
+
+    if (op.write && res > 0 && (size_t)res < op.len) {
+      op.buf += res;
+      op.off += res;
+      op.len -= res;
+
+      if (queue_push(q, slot) == 0)
+        continue;
+
+      q.in_flight--;
+      return -1;
+    }
+
+    q.in_flight--;
+    moved = q.moved[slot];
+    return 0;
+  }
+}
+
+/**
+ * @return fd, -1 err
+ */
+static int open_direct(const char *path, int flags, bool direct) {
+  if (direct) {
+    int fd = open(path, flags | O_DIRECT, 0644);
+    if (fd != -1 || errno != EINVAL)
+      return fd;
+
+    // tmpfs and a few others
+    fprintf(stderr, "[state_io] O_DIRECT not supported for `%s`\n", path);
+  }
+
+  return open(path, flags, 0644);
+}
+
+void init(bool direct) {
+  use_direct = direct;
+
+  uring_t r;
+  use_uring = uring_setup(r, 1) == 0;
+  uring_free(r);
+
+  fprintf(stderr, "[state_io::init] Backend: %s%s\n", backend_name(),
+          use_direct ? ", direct I/O" : "");
+}
+
+const char *backend_name() { return use_uring ? "io_uring" : "threads"; }
+
+bool direct() { return use_direct; }
+
+int64_t read_file(const char *path, void *dst, size_t size, uint64_t off) {
+  // only the aligned part can go direct, the tail is read through the cache
+  const bool direct =
+      use_direct && (uintptr_t)dst % ALIGN == 0 && off % ALIGN == 0;
+  const size_t direct_size = direct ? size - size % ALIGN : 0;
+
+  int fd = open_direct(path, O_RDONLY, direct);
+  if (fd == -1) {
+    perror("[state_io::read_file ERROR]");
+    return -1;
+  }
+
+  int bfd = direct_size < size ? open(path, O_RDONLY) : fd;
+  if (bfd == -1) {
+    perror("[state_io::read_file ERROR]");
+    close(fd);
+    return -1;
+  }
+
+  queue_t q;
+  queue_open(q);
+
+  std::vector<unsigned int> free_slots;
+  for (unsigned int i = 0; i < QUEUE_DEPTH; i++)
+    free_slots.push_back(i);
+
+  int64_t total = 0;
+  uint64_t next = 0;
+  bool eof = false;
+  bool failed = false;
+
+  for (;;) {
+    while (!eof && !failed && next < size && !free_slots.empty()) {
+      op_t op = {fd, (char *)dst + next, std::min(CHUNK_SIZE, size - next),
+                 off + next, false};
+
+      // split at the direct boundary
+      if (next >= direct_size)
+        op.fd = bfd;
+      else
+        op.len = std::min<size_t>(op.len, direct_size - next);
+
+      if (queue_submit(q, free_slots.back(), op) != 0) {
+        failed = true;
+        break;
+      }
+
+      free_slots.pop_back();
+      next += op.len;
+    }
+
+    if (q.in_flight == 0)
+      break;
+
+    unsigned int slot = 0;
+    size_t moved = 0;
+    const int r = queue_wait(q, slot, moved);
+    if (r == -2) {
+      failed = true;
+      break;
+    }
+
+    if (r != 0) {
+      failed = true;
+    } else {
+      total += moved;
+      eof = eof || moved < q.ops[slot].len;
+    }
+
+    free_slots.push_back(slot);
+  }
+
+  // closing the ring cancels what's left, dst may still be written to
+  if (q.in_flight > 0)
+    fprintf(stderr, "[state_io::read_file ERROR] Reads of `%s` left in "
+                    "flight\n",
+            path);
+
+  queue_close(q);
+
+  if (bfd != fd)
+    close(bfd);
+  close(fd);
+
+  return failed ? -1 : total;
+}
+
+struct writer_t {
+  int fd = -1;
+  // unaligned tail with direct I/O
+  int bfd = -1;
+  bool direct = false;
+  queue_t q;
+
+  char *bufs[QUEUE_DEPTH] = {};
+  std::vector<unsigned int> free_slots;
+  // filling slot, QUEUE_DEPTH none
+  unsigned int cur = QUEUE_DEPTH;
+  size_t fill = 0;
+  // file offset of the filling buffer
+  uint64_t off = 0;
+  bool failed = false;
+};
+
+static void writer_reap(writer_t *w) {
+  unsigned int slot = 0;
+  size_t moved = 0;
+
+  const int r = queue_wait(w->q, slot, moved);
+  if (r != 0)
+    w->failed = true;
+
+  // no buffer comes back from a failed ring
+  if (r != -2)
+    w->free_slots.push_back(slot);
+}
+
+static void writer_submit(writer_t *w, size_t len) {
+  const op_t op = {w->fd, w->bufs[w->cur], len, w->off, true};
+
+  if (queue_submit(w->q, w->cur, op) != 0) {
+    w->failed = true;
+    w->free_slots.push_back(w->cur);
+  }
+
+  w->off += len;
+  w->cur = QUEUE_DEPTH;
+  w->fill = 0;
+}
+
+writer_t *open_writer(const char *path) {
+  writer_t *w = new writer_t();
+
+  w->fd = open_direct(path, O_WRONLY | O_CREAT | O_TRUNC, use_direct);
+  if (w->fd == -1) {
+    perror("[state_io::open_writer ERROR]");
+    delete w;
+    return nullptr;
+  }
+
+  w->direct = use_direct && (fcntl(w->fd, F_GETFL) & O_DIRECT);
+  w->bfd = w->direct ? open(path, O_WRONLY) : w->fd;
+  if (w->bfd == -1) {
+    perror("[state_io::open_writer ERROR]");
+    close(w->fd);
+    delete w;
+    return nullptr;
+  }
+
+  for (unsigned int i = 0; i < QUEUE_DEPTH; i++) {
+    w->bufs[i] = (char *)aligned_alloc(ALIGN, CHUNK_SIZE);
+
+    if (w->bufs[i] == nullptr) {
+      perror("[state_io::open_writer ERROR] aligned_alloc");
+
+      for (char *b : w->bufs)
+        free(b);
+
+      if (w->bfd != w->fd)
+        close(w->bfd);
+      close(w->fd);
+      delete w;
+      return nullptr;
+    }
+
+    w->free_slots.push_back(i);
+  }
+
+  queue_open(w->q);
+  return w;
+}
+
+int write(writer_t *w, const void *data, size_t size) {
+  const char *p = (const char *)data;
+
+  while (size > 0 && !w->failed) {
+    if (w->cur == QUEUE_DEPTH) {
+      // every buffer in flight, wait for the oldest to come back
+      if (w->free_slots.empty())
+        writer_reap(w);
+
+      if (w->failed)
+        break;
+
+      w->cur = w->free_slots.back();
+      w->free_slots.pop_back();
+    }
+
+    const size_t n = std::min(size, CHUNK_SIZE - w->fill);
+    memcpy(w->bufs[w->cur] + w->fill, p, n);
+    w->fill += n;
+    p += n;
+    size -= n;
+
+    if (w->fill == CHUNK_SIZE)
+      writer_submit(w, CHUNK_SIZE);
+  }
+
+  return w->failed ? -1 : 0;
+}
+
+int close_writer(writer_t *w) {
+  if (w->cur != QUEUE_DEPTH && w->fill > 0) {
+    const char *buf = w->bufs[w->cur];
+    // the unaligned tail can't go direct
+    const size_t tail = w->direct ? w->fill % ALIGN : 0;
+    const size_t head = w->fill - tail;
+    const uint64_t tail_off = w->off + head;
+
+    if (head > 0 && !w->failed)
+      writer_submit(w, head);
+
+    if (tail > 0 && !w->failed &&
+        pwrite(w->bfd, buf + head, tail, tail_off) != (ssize_t)tail) {
+      perror("[state_io::close_writer ERROR] pwrite");
+      w->failed = true;
+    }
+  }
+
+  while (w->q.in_flight > 0 && !w->q.broken)
+    writer_reap(w);
+
+  // ops a failed ring never gave back keep their buffers
+  const bool leak = w->q.in_flight > 0;
+
+  queue_close(w->q);
+
+  int status = w->failed ? -1 : 0;
+
+  if (status == 0 && fsync(w->fd) != 0) {
+    perror("[state_io::close_writer ERROR] fsync");
+    status = -1;
+  }
+
+  if (w->bfd != w->fd)
+    close(w->bfd);
+  close(w->fd);
+
+  if (!leak)
+    for (char *b : w->bufs)
+      free(b);
+
+  delete w;
+  return status;
+}
+
+} // namespace atcboxes::state_io
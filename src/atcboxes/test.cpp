@@ -1,15 +1,1208 @@
+#include "atcboxes/alloc_count.h"
 #include "atcboxes/atcboxes.h"
+#include "atcboxes/broadcast.h"
+#include "atcboxes/commands.h"
+#include "atcboxes/journal.h"
+#include "atcboxes/page_codec.h"
+#include "atcboxes/proto.h"
+#include "atcboxes/server.h"
+#include "atcboxes/sparse.h"
+#include "atcboxes/state_io.h"
 #include "atcboxes/test.h"
+#include "atcboxes/util.h"
+#include "atcboxes/writer.h"
+#include <algorithm>
 #include <cassert>
 #include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <random>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <thread>
 #include <threads.h>
+#include <unistd.h>
+#include <vector>
 
 namespace atcboxes::test {
 
-// !TODO: color support
+// the std::regex parsers the hand-rolled ones replaced, kept to compare
+static std::pair<int64_t, int64_t> get_subs_pc_regex(const std::string &s) {
+  std::regex word_regex("(\\d+)");
+  auto begin = std::sregex_iterator(s.begin(), s.end(), word_regex);
+
+  auto end = std::sregex_iterator();
+  if (begin == end)
+    return {-1, -1};
+
+  std::string p = (*begin).str();
+  begin++;
+
+  if (begin == end)
+    return {-1, -1};
+
+  std::string c = (*begin).str();
+
+  return {std::stoll(p), std::stoll(c)};
+}
+
+#ifdef WITH_COLOR
+static int parse_cbox_wc_regex(const std::string &msg, uint64_t &i,
+                               cbox_t &s) {
+  std::regex word_regex("(\\d+)");
+  auto begin = std::sregex_iterator(msg.begin(), msg.end(), word_regex);
+
+  auto end = std::sregex_iterator();
+
+  std::vector<uint64_t> l = {};
+
+  while (begin != end) {
+    std::string c = begin->str();
+
+    try {
+      l.push_back(std::stoull(c));
+    } catch (...) {
+      return -1;
+    }
+
+    begin++;
+  }
+
+  if (l.size() != 5)
+    return -2;
+
+  i = l.at(0);
+  s.r = l.at(1);
+  s.g = l.at(2);
+  s.b = l.at(3);
+  s.a = l.at(4);
+
+  return 0;
+}
+#endif // WITH_COLOR
+
+template <class F> static void bench_parse(std::string_view name, F &&f) {
+  constexpr int iterations = 100'000;
+
+#ifdef COUNT_ALLOCS
+  alloc_count::start();
+#endif // COUNT_ALLOCS
+  auto start = std::chrono::steady_clock::now();
+
+  int fails = 0;
+  for (int n = 0; n < iterations; n++)
+    fails += f() != 0;
+
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+
+#ifdef COUNT_ALLOCS
+  const uint64_t allocs = alloc_count::stop();
+
+  fprintf(stderr,
+          "[test::bench_parse] %-12.*s %.1f allocation(s)/op, %.1f ns/op%s\n",
+          (int)name.size(), name.data(), (double)allocs / iterations,
+          (double)ns / iterations, fails ? " FAILED" : "");
+#else
+  fprintf(stderr, "[test::bench_parse] %-12.*s %.1f ns/op%s\n",
+          (int)name.size(), name.data(), (double)ns / iterations,
+          fails ? " FAILED" : "");
+#endif // COUNT_ALLOCS
+}
+
+static void bench_parsers() {
+  const std::string subs = "12;4";
+
+  bench_parse("subs regex", [&subs]() {
+    auto pc = get_subs_pc_regex(subs);
+    return pc.first == 12 && pc.second == 4 ? 0 : -1;
+  });
+
+  bench_parse("subs", [&subs]() {
+    uint64_t pc[2];
+    return util::parse_uints(subs, pc, 2);
+  });
+
+#ifdef WITH_COLOR
+  const std::string cbox = "999999;255;128;0;1";
+  uint64_t i = 0;
+  cbox_t s = {};
+
+  bench_parse("cbox regex", [&]() { return parse_cbox_wc_regex(cbox, i, s); });
+  bench_parse("cbox", [&]() { return util::parse_cbox_wc(cbox, i, s); });
+
+  // the regex version took these as channel 0 and the index 1
+  assert(util::parse_cbox_wc("1;256;0;0;1", i, s) != 0);
+  assert(util::parse_cbox_wc("1;0;0;1", i, s) != 0);
+  assert(util::parse_cbox_wc("1;0;0;0;1;", i, s) != 0);
+  assert(util::parse_cbox_wc("-1;0;0;0;1", i, s) != 0);
+#endif // WITH_COLOR
+}
+
+#ifdef COUNT_ALLOCS
+/**
+ * @brief Run a text command like the server does, on warmed up buffers,
+ *        toggles applied and published twice to leave the state as it was.
+ */
+static int dispatch(std::string_view cmd, commands::command_outs_t &out,
+                    broadcast::broadcast_t &b, broadcast::messages_t &m) {
+  out.clear();
+
+  uint64_t i = 0;
+#ifdef WITH_COLOR
+  cbox_t s = {};
+  int r = commands::run(cmd, out, i, s);
+  if (r == 1) {
+    cbox_t prev = {};
+    get_state(i, prev);
+
+    // publish_state without a tick, minus uWS's own publish
+    for (const cbox_t &c : {s, prev}) {
+      cbox_t next = {};
+      switch_state(i, c);
+      get_state(i, next);
+      broadcast::single(b, i, next);
+      broadcast::messages(b, m);
+    }
+  }
+#else
+  int r = commands::run(cmd, out, i);
+  if (r == 1) {
+    for (int n = 0; n < 2; n++) {
+      broadcast::single(b, i, switch_state(i));
+      broadcast::messages(b, m);
+    }
+  }
+#endif // WITH_COLOR
+
+  return r;
+}
+
+static void bench_dispatch_allocs(std::string_view name, std::string_view cmd) {
+  constexpr int iterations = 1'000'000;
+
+  commands::command_outs_t out;
+  broadcast::broadcast_t b;
+  broadcast::messages_t m;
+  dispatch(cmd, out, b, m);
+
+  alloc_count::start();
+  auto start = std::chrono::steady_clock::now();
+
+  for (int n = 0; n < iterations; n++)
+    dispatch(cmd, out, b, m);
+
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  const uint64_t allocs = alloc_count::stop();
+
+  fprintf(stderr,
+          "[test::bench_dispatch_allocs] %-8.*s %lu allocation(s), %.1f "
+          "ns/op\n",
+          (int)name.size(), name.data(), allocs, (double)ns / iterations);
+}
+#endif // COUNT_ALLOCS
+
+/**
+ * @brief Batches take checkbox indices up to the last checkbox, past the
+ *        last state element without color.
+ */
+static void check_batch() {
+  commands::command_outs_t out;
+  uint64_t i = 0;
+#ifdef WITH_COLOR
+  cbox_t s = {};
+  const std::string color = ";1;2;3;1";
+  auto text = [&](std::string_view cmd) {
+    return commands::run(cmd, out, i, s);
+  };
+  auto bin_cmd = [&](std::string_view cmd) {
+    return commands::run_bin(cmd, out, i, s);
+  };
+#else
+  const std::string color;
+  auto text = [&](std::string_view cmd) { return commands::run(cmd, out, i); };
+  auto bin_cmd = [&](std::string_view cmd) {
+    return commands::run_bin(cmd, out, i);
+  };
+#endif // WITH_COLOR
+
+  const uint64_t high = std::min<uint64_t>(20'000'000, A_TRILLION - 1);
+  const uint64_t last = A_TRILLION - 1;
+
+  std::string cmd = "bt;" + std::to_string(high) + color + ";" +
+                    std::to_string(last) + color;
+  out.clear();
+  assert(text(cmd) == 2 && out.toggles.size() == 2);
+  assert(out.toggles[0].i == high && out.toggles[1].i == last);
+
+  out.clear();
+  assert(text("bt;" + std::to_string(last + 1) + color) == -6);
+
+  // the same with the binary protocol, indices as deltas
+  std::string bin(1, (char)proto::OP_BATCH);
+  proto::put_varint(bin, 2);
+  proto::put_svarint(bin, high);
+#ifdef WITH_COLOR
+  bin.append({1, 2, 3, 1});
+#endif // WITH_COLOR
+  proto::put_svarint(bin, last - high);
+#ifdef WITH_COLOR
+  bin.append({1, 2, 3, 1});
+#endif // WITH_COLOR
+  out.clear();
+  assert(bin_cmd(bin) == 2 && out.toggles.size() == 2);
+  assert(out.toggles[0].i == high && out.toggles[1].i == last);
+
+  bin.resize(1);
+  proto::put_varint(bin, 1);
+  proto::put_svarint(bin, last + 1);
+#ifdef WITH_COLOR
+  bin.append({1, 2, 3, 1});
+#endif // WITH_COLOR
+  out.clear();
+  assert(bin_cmd(bin) == -6);
+
+  fprintf(stderr, "[test::check_batch] Batch index bounds OK\n");
+}
+
+/**
+ * @brief A plain `gp;` keeps its `ws;<page>` header, the version is only added
+ *        for clients asking with one.
+ */
+static void check_gp() {
+  commands::command_outs_t out;
+  uint64_t i = 0;
+#ifdef WITH_COLOR
+  cbox_t s = {};
+  auto text = [&](std::string_view cmd) {
+    return commands::run(cmd, out, i, s);
+  };
+#else
+  auto text = [&](std::string_view cmd) { return commands::run(cmd, out, i); };
+#endif // WITH_COLOR
+
+  out.clear();
+  assert(text("gp;1") == 0 && out.size() == 2);
+  assert(out.begin()->data() == "ws;1");
+  assert(out.begin()[1].data().size() == STATE_PAGE_SIZE_BYTES);
+
+  out.clear();
+  assert(text("gp;1;0") == 0 && out.size() == 2);
+  const std::string_view header = out.begin()->data();
+  assert(header == "ws;1" || header.substr(0, 5) == "ws;1;");
+
+  fprintf(stderr, "[test::check_gp] Page headers OK\n");
+}
+
+/**
+ * @brief Every `we;` encoding, and whichever one encode picks, decodes back
+ *        to the page it was made from.
+ */
+static void check_page_codec() {
+  constexpr page_codec::encoding_e encodings[] = {
+      page_codec::ENC_RAW, page_codec::ENC_RLE, page_codec::ENC_SPARSE,
+      page_codec::ENC_DEFLATE};
+  constexpr const char *names[] = {"empty", "sparse", "dense", "random"};
+
+  std::mt19937_64 rng(7);
+  std::string page;
+  std::string enc;
+  std::string dec;
+
+  for (int p = 0; p < 4; p++) {
+    page.assign(STATE_PAGE_SIZE_BYTES, '\0');
+
+    for (size_t b = 0; b < page.size(); b++) {
+      if (p == 1 && rng() % 1000 == 0)
+        page[b] = (char)(1 + rng() % 255);
+      else if (p == 2)
+        // full but for a few holes
+        page[b] = rng() % 100 == 0 ? 0 : (char)0xff;
+      else if (p == 3)
+        page[b] = (char)rng();
+    }
+
+    for (page_codec::encoding_e e : encodings) {
+      assert(page_codec::encode(e, page, enc) == 0);
+      assert(page_codec::decode(e, enc, dec) == 0);
+      assert(dec == page);
+    }
+
+    const page_codec::encoding_e e = page_codec::encode(page, enc);
+    assert(page_codec::decode(e, enc, dec) == 0);
+    assert(dec == page);
+
+    // a truncated payload is an error, not a shorter page
+    const std::string_view cut(enc.data(), enc.size() - 1);
+    assert(page_codec::decode(e, cut, dec) != 0);
+
+    fprintf(stderr, "[test::check_page_codec] %-6s page: '%c', %zu byte(s)\n",
+            names[p], e, enc.size());
+  }
+
+  fprintf(stderr, "[test::check_page_codec] Page encodings round-trip\n");
+}
+
+/**
+ * @brief A file written through the state_io writer in odd sized pieces
+ *        reads back the same, with and without direct I/O, its unaligned tail
+ *        included. Written next to the state file and removed afterwards.
+ */
+static void check_state_io() {
+  const std::string path = std::string(STATE_FILE) + ".io_test";
+  const bool direct = state_io::direct();
+
+  // a few chunks and an unaligned tail
+  const size_t size = 5 * state_io::CHUNK_SIZE + 12'345;
+  std::vector<char> data(size);
+  std::mt19937_64 rng(3);
+  for (char &c : data)
+    c = (char)rng();
+
+  // room to read past the end of the file, and from an unaligned address
+  const size_t cap = (size / state_io::ALIGN + 2) * state_io::ALIGN;
+  char *back = (char *)aligned_alloc(state_io::ALIGN, cap);
+  assert(back != nullptr);
+
+  for (bool d : {false, true}) {
+    state_io::init(d);
+
+    state_io::writer_t *w = state_io::open_writer(path.c_str());
+    assert(w != nullptr);
+
+    size_t pos = 0;
+    for (size_t n = 1; pos < size; n = n * 7 + 1) {
+      const size_t len =
+          std::min(n % (3 * state_io::CHUNK_SIZE) + 1, size - pos);
+      assert(state_io::write(w, data.data() + pos, len) == 0);
+      pos += len;
+    }
+
+    assert(state_io::close_writer(w) == 0);
+
+    // the whole file, then more than it stopping at EOF, both aligned
+    for (size_t n : {size, cap}) {
+      memset(back, 0, cap);
+      assert(state_io::read_file(path.c_str(), back, n) == (int64_t)size);
+      assert(memcmp(back, data.data(), size) == 0);
+    }
+
+    // an unaligned buffer goes through the page cache
+    memset(back, 0, cap);
+    assert(state_io::read_file(path.c_str(), back + 1, size) ==
+           (int64_t)size);
+    assert(memcmp(back + 1, data.data(), size) == 0);
+
+    fprintf(stderr, "[test::check_state_io] %s, direct I/O %s: OK\n",
+            state_io::backend_name(), d ? "on" : "off");
+  }
+
+  state_io::init(direct);
+  free(back);
+  unlink(path.c_str());
+}
+
+#ifdef WITH_COLOR
+using journal_value_t = cbox_t;
+
+static bool journal_same(const cbox_t &a, const cbox_t &b) {
+  return memcmp(&a, &b, sizeof(cbox_t)) == 0;
+}
+#else
+using journal_value_t = bool;
+
+static bool journal_same(bool a, bool b) { return a == b; }
+#endif // WITH_COLOR
+
+// what replaying a journal leaves each checkbox at
+static std::map<uint64_t, journal_value_t> replayed;
+
+#ifdef WITH_COLOR
+static void journal_apply(uint64_t i, const cbox_t &s) { replayed[i] = s; }
+#else
+static void journal_apply(uint64_t i, bool on) { replayed[i] = on; }
+#endif // WITH_COLOR
+
+/**
+ * @brief Append n records of random checkboxes to ref and the journal, then
+ *        wait for them to be committed.
+ * @param one_commit all on one page, its lock held until they're appended
+ */
+static void journal_commit(std::map<uint64_t, journal_value_t> &ref,
+                           uint64_t &appended, size_t n, bool one_commit,
+                           std::mt19937_64 &rng) {
+  const uint64_t one_page = rng() % STATE_PAGE_COUNT;
+  std::unique_lock<std::mutex> held;
+  if (one_commit)
+    held = journal::lock(one_page);
+
+  for (size_t k = 0; k < n; k++) {
+    // a few repeats, a checkbox's records replay in order
+    const uint64_t i =
+        one_commit ? one_page * SIZE_PER_PAGE + rng() % SIZE_PER_PAGE
+                   : rng() % (k % 4 == 0 ? 64 : A_TRILLION);
+    const uint64_t page = i / SIZE_PER_PAGE;
+
+#ifdef WITH_COLOR
+    const uint64_t r = rng();
+    const cbox_t v = {(uint8_t)r, (uint8_t)(r >> 8), (uint8_t)(r >> 16),
+                      (uint8_t)(r >> 24)};
+#else
+    const bool v = rng() & 1;
+#endif // WITH_COLOR
+
+    std::unique_lock<std::mutex> lk;
+    if (!one_commit)
+      lk = journal::lock(page);
+
+    journal::append(page, i, v);
+    ref[i] = v;
+  }
+
+  if (held)
+    held.unlock();
+
+  appended += n;
+
+  const auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (journal::get_stats().records < appended) {
+    assert(std::chrono::steady_clock::now() < deadline);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+static void check_replayed(const std::map<uint64_t, journal_value_t> &ref) {
+  assert(replayed.size() == ref.size());
+
+  for (const auto &[i, v] : ref) {
+    auto it = replayed.find(i);
+    assert(it != replayed.end() && journal_same(it->second, v));
+  }
+}
+
+/**
+ * @brief Replay what was journaled, with a commit that failed halfway and
+ *        was retried, then with the last commit torn.
+ */
+static void check_journal() {
+  const std::string path = std::string(STATE_FILE) + ".journal_test";
+  const std::string segment = path + ".wal.0";
+
+  // segments left by an earlier run
+  journal::replay(path.c_str(), journal_apply);
+  journal::drop(INT64_MAX);
+  replayed.clear();
+
+  std::mt19937_64 rng(4);
+  std::map<uint64_t, journal_value_t> ref;
+  uint64_t appended = 0;
+
+  assert(journal::start(path.c_str()) == 0);
+
+  journal_commit(ref, appended, 1'000, false, rng);
+
+  // the half written is truncated away and the same records written again
+  journal::fail_commits(1);
+  journal_commit(ref, appended, 1'000, false, rng);
+
+  const std::map<uint64_t, journal_value_t> before_last = ref;
+  const uint64_t appended_before_last = appended;
+  journal_commit(ref, appended, 100, true, rng);
+
+  assert(journal::stop() == 0);
+
+  assert(journal::replay(path.c_str(), journal_apply) == (int64_t)appended);
+  check_replayed(ref);
+
+  // the process died writing the last commit
+  struct stat st;
+  assert(stat(segment.c_str(), &st) == 0);
+  assert(truncate(segment.c_str(), st.st_size - 1) == 0);
+
+  replayed.clear();
+  assert(journal::replay(path.c_str(), journal_apply) ==
+         (int64_t)appended_before_last);
+  check_replayed(before_last);
+
+  journal::drop(INT64_MAX);
+  replayed.clear();
+
+  fprintf(stderr, "[test::check_journal] %lu record(s), a retried and a torn "
+                  "commit: OK\n",
+          appended);
+}
+
+/**
+ * @brief Compare a page of the state file with the state.
+ */
+static void check_saved_page(int fd, uint64_t page) {
+  static std::string saved, copy;
+  saved.resize(STATE_PAGE_SIZE_BYTES);
+
+  assert(pread(fd, saved.data(), STATE_PAGE_SIZE_BYTES,
+               page * STATE_PAGE_SIZE_BYTES) ==
+         (ssize_t)STATE_PAGE_SIZE_BYTES);
+  assert(copy_state_page(page, copy) == 0);
+  assert(saved == copy);
+}
+
+/**
+ * @brief Flip a checkbox of each page, color kept.
+ */
+static void toggle_pages(const std::vector<uint64_t> &pages) {
+  for (uint64_t page : pages) {
+    const uint64_t i = page * SIZE_PER_PAGE + 17;
+#ifdef WITH_COLOR
+    cbox_t s = {};
+    get_state(i, s);
+    switch_state(i, s);
+#else
+    switch_state(i);
+#endif // WITH_COLOR
+  }
+}
+
+/**
+ * @brief A snapshot writes only the dirty pages and clears them, leaving the
+ *        state file equal to the state. Every page is compared when the state
+ *        is small enough, the written ones and their neighbours otherwise.
+ */
+static void check_snapshot() {
+  // two adjacent pages go out in one write
+  const std::vector<uint64_t> pages = {3, 4, STATE_PAGE_COUNT - 1};
+  constexpr bool compare_all = STATE_SIZE_BYTES <= (1ULL << 30);
+
+  snapshot_stats_t st;
+  // whatever earlier checks left dirty, or the whole state the first time
+  assert(snapshot(st) == 0);
+
+  const int fd = open(get_statefile(), O_RDONLY);
+  assert(fd != -1);
+
+  // toggled, then put back
+  for (int round = 0; round < 2; round++) {
+    toggle_pages(pages);
+
+    assert(snapshot(st) == 0);
+    assert(!st.full && st.pages == pages.size() &&
+           st.bytes == pages.size() * STATE_PAGE_SIZE_BYTES);
+
+    // nothing changed since
+    assert(snapshot(st) == 0);
+    assert(!st.full && st.pages == 0 && st.bytes == 0);
+
+    if (compare_all) {
+      for (uint64_t page = 0; page < STATE_PAGE_COUNT; page++)
+        check_saved_page(fd, page);
+    } else {
+      for (uint64_t page : {2UL, 3UL, 4UL, 5UL, STATE_PAGE_COUNT - 2,
+                            STATE_PAGE_COUNT - 1})
+        check_saved_page(fd, page);
+    }
+  }
+
+  close(fd);
+
+  fprintf(stderr, "[test::check_snapshot] %zu dirty page(s) written and "
+                  "cleared, %s page(s) match the file: OK\n",
+          pages.size(), compare_all ? "all" : "written and neighbouring");
+}
+
+/**
+ * @brief Toggle every index of a producer's range twice, leaving it as it
+ *        was, either directly or through the writer. Not a loop thread, a
+ *        full ring is waited out.
+ */
+static void produce(uint64_t base, uint64_t count, bool queue) {
+  for (uint64_t n = 0; n < count; n++) {
+    const uint64_t i = base + n / 2;
+
+#ifdef WITH_COLOR
+    // its own color, only the active bit flips
+    cbox_t s = {};
+    get_state(i, s);
+
+    if (queue)
+      while (!writer::push(i, s))
+        std::this_thread::yield();
+    else
+      switch_state(i, s);
+#else
+    if (queue)
+      while (!writer::push(i))
+        std::this_thread::yield();
+    else
+      switch_state(i);
+#endif // WITH_COLOR
+  }
+}
+
+/**
+ * @brief Toggle throughput and latency of several producers applying toggles
+ *        themselves, like I/O threads do, against queueing them to the
+ *        single writer.
+ */
+static void bench_writer() {
+  constexpr unsigned int producers = 4;
+  constexpr uint64_t per_producer = 2'000'000;
+  constexpr uint64_t total = producers * per_producer;
+
+  for (bool queue : {false, true}) {
+    if (queue)
+      writer::start(nullptr);
+
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned int p = 0; p < producers; p++)
+      threads.emplace_back(produce, p * per_producer, per_producer, queue);
+
+    for (auto &t : threads)
+      t.join();
+
+    writer::stats_t st = {};
+    if (queue) {
+      st = writer::get_stats();
+      writer::stop();
+      st = writer::get_stats();
+      // pushes failing on a full ring were retried
+      assert(st.applied == total);
+    }
+
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+
+    fprintf(stderr,
+            "[test::bench_writer] %-7s %u producer(s): %.2f M toggles/s",
+            queue ? "writer" : "direct", producers, total * 1e3 / ns);
+
+    if (queue)
+      fprintf(stderr,
+              ", %zu batch(es), latency avg: %.1f us max: %.1f us, %zu "
+              "push(es) on a full ring\n",
+              st.batches, (double)st.latency_ns_sum / st.applied / 1000,
+              (double)st.latency_ns_max / 1000, st.dropped);
+    else
+      // applied by the time switch_state returns
+      fprintf(stderr, ", latency avg: %.3f us\n",
+              (double)ns * producers / total / 1000);
+  }
+}
+
+// ws_data_t before it went on a diet
+struct legacy_ws_data_t {
+  char n_o;
+  char n_i;
+  long flags;
+  std::string cached;
+  uint64_t sub_page;
+  uint64_t sub_count;
+  long long last_ts;
+  size_t cws_idx;
+};
+
+static long rss_bytes() {
+  long pages = 0;
+  long resident = 0;
+
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f)
+    return -1;
+
+  if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+    resident = -1;
+
+  fclose(f);
+  return resident < 0 ? -1 : resident * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * @brief Per connection user data as uWS keeps it, one record per socket,
+ *        plus the worker's connection list. uWS's own socket and buffer
+ *        memory isn't part of this.
+ */
+template <class T> static void bench_conn_memory(const char *name, size_t n) {
+  const long before = rss_bytes();
+
+  std::vector<T> data(n);
+  std::vector<void *> cws;
+  cws.reserve(n);
+
+  for (size_t i = 0; i < n; i++) {
+    T &d = data[i];
+    d.n_o = 4;
+    d.last_ts = i;
+    // a challenge answer is 8 chars, the string stays inline
+    if constexpr (std::is_same_v<T, legacy_ws_data_t>)
+      d.cached = "Ab3xY7==";
+    else
+      d.cached = i * 0x9e3779b97f4a7c15ULL;
+    cws.push_back(&d);
+  }
+
+  const long after = rss_bytes();
+
+  fprintf(stderr,
+          "[test::bench_conn_memory] %-6s %8zu connection(s): %zu "
+          "byte(s)/connection, RSS +%.1f MB (%ld -> %ld MB)\n",
+          name, n, sizeof(T) + sizeof(void *),
+          (after - before) / 1048576.0, before / 1048576, after / 1048576);
+}
+
+#ifdef SPARSE_STATE
+// whole chunks in the middle of the state check_sparse works on
+constexpr uint64_t CHECK_CHUNKS = 8;
+constexpr uint64_t CHECK_FIRST_CHUNK = sparse::CHUNK_COUNT / 2;
+constexpr uint64_t CHECK_SIZE = CHECK_CHUNKS * sparse::CHUNK_SIZE;
+constexpr uint64_t CHECK_ELEMENTS = CHECK_CHUNKS * sparse::CHUNK_ELEMENT_COUNT;
+
+#ifdef WITH_COLOR
+using check_ref_t = cbox_t;
+
+static bool ref_same(const cbox_t &a, const cbox_t &b) {
+  return memcmp(&a, &b, sizeof(cbox_t)) == 0;
+}
+
+static bool ref_set(const cbox_t &v) { return !ref_same(v, {}); }
+
+static bool ref_active(const cbox_t &v) { return v.a & 1; }
+
+// what element e of the region is in ref
+static cbox_t ref_element(const std::vector<cbox_t> &ref, uint64_t e) {
+  return ref[e];
+}
+
+static bool element_set(const cbox_t &v) { return ref_set(v); }
+#else
+using check_ref_t = uint8_t;
+
+static bool ref_set(uint8_t v) { return v; }
+
+static bool ref_active(uint8_t v) { return v; }
+
+static uint64_t ref_element(const std::vector<uint8_t> &ref, uint64_t e) {
+  uint64_t v = 0;
+  for (uint64_t b = 0; b < STATE_PER_ELEMENT; b++)
+    v |= (uint64_t)ref[e * STATE_PER_ELEMENT + b] << b;
+
+  return v;
+}
+
+static bool element_set(uint64_t v) { return v != 0; }
+#endif // WITH_COLOR
+
+/**
+ * @brief Compare every way to read the region with ref, a dense copy of it.
+ * @param others active checkboxes outside of the region
+ */
+static void check_sparse_region(const std::vector<check_ref_t> &ref,
+                                uint64_t others, std::mt19937_64 &rng) {
+  const uint64_t base = CHECK_FIRST_CHUNK * sparse::CHUNK_SIZE;
+  const uint64_t first_element = base / STATE_PER_ELEMENT;
+
+  // from an unaligned element up to the end of the region
+  const uint64_t skew = rng() % 5;
+  std::vector<CBOX_T> els(CHECK_ELEMENTS);
+  const bool any =
+      sparse::read(first_element + skew, CHECK_ELEMENTS - skew, els.data());
+
+  bool ref_any = false;
+  for (uint64_t e = skew; e < CHECK_ELEMENTS; e++) {
+    const CBOX_T want = ref_element(ref, e);
+    assert(memcmp(&els[e - skew], &want, sizeof(want)) == 0);
+    ref_any = ref_any || element_set(want);
+  }
+  assert(any == ref_any);
+
+  uint64_t active = 0;
+  for (uint64_t i = 0; i < CHECK_SIZE; i++) {
+#ifdef WITH_COLOR
+    cbox_t s = {};
+    assert(sparse::get(base + i, s) == ref_active(ref[i]));
+    assert(ref_same(s, ref[i]));
+#else
+    assert(sparse::get(base + i) == ref_active(ref[i]));
+#endif // WITH_COLOR
+    active += ref_active(ref[i]);
+  }
+  assert(sparse::count_active() == others + active);
+
+  for (uint64_t c = 0; c < CHECK_CHUNKS; c++) {
+    bool ref_empty = true;
+    for (uint64_t i = 0; i < sparse::CHUNK_SIZE; i++)
+      ref_empty = ref_empty && !ref_set(ref[c * sparse::CHUNK_SIZE + i]);
+
+    assert(sparse::empty(first_element + c * sparse::CHUNK_ELEMENT_COUNT,
+                         sparse::CHUNK_ELEMENT_COUNT) == ref_empty);
+  }
+}
+
+static void ref_put(std::vector<check_ref_t> &ref, uint64_t c, uint64_t o,
+                    const check_ref_t &v) {
+#ifdef WITH_COLOR
+  sparse::set(c * sparse::CHUNK_SIZE + o, v);
+#else
+  sparse::set(c * sparse::CHUNK_SIZE + o, v != 0);
+#endif // WITH_COLOR
+  ref[o] = v;
+}
+
+/**
+ * @brief Compare chunk c with ref, a dense copy of its checkboxes.
+ */
+static void check_chunk(uint64_t c, const std::vector<check_ref_t> &ref) {
+  const uint64_t first = c * sparse::CHUNK_ELEMENT_COUNT;
+  std::vector<CBOX_T> els(sparse::CHUNK_ELEMENT_COUNT);
+  const bool any = sparse::read(first, els.size(), els.data());
+
+  bool ref_any = false;
+  for (uint64_t e = 0; e < els.size(); e++) {
+    const CBOX_T want = ref_element(ref, e);
+    assert(memcmp(&els[e], &want, sizeof(want)) == 0);
+    ref_any = ref_any || element_set(want);
+  }
+  assert(any == ref_any);
+  assert(sparse::empty(first, els.size()) == !ref_any);
+
+  for (uint64_t o = 0; o < sparse::CHUNK_SIZE; o++) {
+#ifdef WITH_COLOR
+    cbox_t s = {};
+    assert(sparse::get(c * sparse::CHUNK_SIZE + o, s) == ref_active(ref[o]));
+    assert(ref_same(s, ref[o]));
+#else
+    assert(sparse::get(c * sparse::CHUNK_SIZE + o) == ref_active(ref[o]));
+#endif // WITH_COLOR
+  }
+}
+
+/**
+ * @brief Walk one chunk across every container threshold: an array grown
+ *        past ARRAY_MAX, a bitmap shrunk below ARRAY_MAX / 2, a run split in
+ *        its middle and chunks cleared to empty, checking the container and
+ *        the contents at each step. The chunk is put back afterwards.
+ */
+static void check_sparse_containers() {
+  const uint64_t c = CHECK_FIRST_CHUNK;
+  const uint64_t first = c * sparse::CHUNK_ELEMENT_COUNT;
+
+  std::vector<CBOX_T> orig(sparse::CHUNK_ELEMENT_COUNT);
+  sparse::read(first, orig.size(), orig.data());
+
+  const std::vector<CBOX_T> zeros(sparse::CHUNK_ELEMENT_COUNT);
+  sparse::set_chunk(c, zeros.data());
+  assert(sparse::container(c) == sparse::CONTAINER_COUNT);
+
+  std::vector<check_ref_t> ref(sparse::CHUNK_SIZE);
+  check_chunk(c, ref);
+
+  // k'th checkbox, none of them making a run with the previous one
+#ifdef WITH_COLOR
+  auto offset = [](uint64_t k) { return k; };
+  auto value = [](uint64_t k) {
+    return cbox_t{(uint8_t)(1 + k % 2), 0, 0, 1};
+  };
+  const check_ref_t unset = {};
+  const check_ref_t run = {7, 0, 0, 1};
+#else
+  auto offset = [](uint64_t k) { return 2 * k; };
+  auto value = [](uint64_t) { return (check_ref_t)1; };
+  const check_ref_t unset = 0;
+  const check_ref_t run = 1;
+#endif // WITH_COLOR
+
+  // an array up to ARRAY_MAX, a bitmap past it
+  for (uint64_t k = 0; k < sparse::ARRAY_MAX; k++)
+    ref_put(ref, c, offset(k), value(k));
+
+  assert(sparse::container(c) == sparse::CONTAINER_ARRAY);
+  check_chunk(c, ref);
+
+  ref_put(ref, c, offset(sparse::ARRAY_MAX), value(sparse::ARRAY_MAX));
+  assert(sparse::container(c) == sparse::CONTAINER_BITMAP);
+  check_chunk(c, ref);
+
+  // a bitmap down to ARRAY_MAX / 2, an array below it
+  for (uint64_t k = sparse::ARRAY_MAX; k >= sparse::ARRAY_MAX / 2; k--)
+    ref_put(ref, c, offset(k), unset);
+
+  assert(sparse::container(c) == sparse::CONTAINER_BITMAP);
+  check_chunk(c, ref);
+
+  ref_put(ref, c, offset(sparse::ARRAY_MAX / 2 - 1), unset);
+  assert(sparse::container(c) == sparse::CONTAINER_ARRAY);
+  check_chunk(c, ref);
+
+  for (uint64_t k = 0; k < sparse::ARRAY_MAX / 2 - 1; k++)
+    ref_put(ref, c, offset(k), unset);
+
+  assert(sparse::container(c) == sparse::CONTAINER_COUNT);
+  check_chunk(c, ref);
+
+  // one long run, grown from an array
+  constexpr uint64_t run_first = 1000;
+  constexpr uint64_t run_last = 60'000;
+  static_assert(run_last - run_first + 1 > sparse::ARRAY_MAX);
+
+  for (uint64_t o = run_first; o <= run_last; o++)
+    ref_put(ref, c, o, run);
+
+  assert(sparse::container(c) == sparse::CONTAINER_RUN);
+  check_chunk(c, ref);
+
+  // split in its middle, then the middle written back
+  constexpr uint64_t mid = (run_first + run_last) / 2;
+  ref_put(ref, c, mid, unset);
+  assert(sparse::container(c) == sparse::CONTAINER_RUN);
+  check_chunk(c, ref);
+
+#ifdef WITH_COLOR
+  // a run of its own between the halves
+  ref_put(ref, c, mid, value(0));
+  assert(sparse::container(c) == sparse::CONTAINER_RUN);
+  check_chunk(c, ref);
+#endif // WITH_COLOR
+
+  ref_put(ref, c, mid, run);
+  assert(sparse::container(c) == sparse::CONTAINER_RUN);
+  check_chunk(c, ref);
+
+  // read back and written over itself
+  std::vector<CBOX_T> chunk(sparse::CHUNK_ELEMENT_COUNT);
+  sparse::read(first, chunk.size(), chunk.data());
+  sparse::set_chunk(c, chunk.data());
+  assert(sparse::container(c) == sparse::CONTAINER_RUN);
+  check_chunk(c, ref);
+
+  // cleared from the front, shrinking into an array at the end
+  for (uint64_t o = run_first; o <= run_last; o++)
+    ref_put(ref, c, o, unset);
+
+  assert(sparse::container(c) == sparse::CONTAINER_COUNT);
+  check_chunk(c, ref);
+
+  sparse::set_chunk(c, orig.data());
+
+  std::vector<CBOX_T> back(sparse::CHUNK_ELEMENT_COUNT);
+  sparse::read(first, back.size(), back.data());
+  assert(memcmp(back.data(), orig.data(), back.size() * sizeof(CBOX_T)) == 0);
+
+  fprintf(stderr, "[test::check_sparse_containers] Containers convert "
+                  "across their thresholds\n");
+}
+
+/**
+ * @brief Random, clustered and sequential toggles and writes on a few chunks
+ *        of the state, checked against a dense copy after each round so
+ *        every container and conversion between them is compared. The
+ *        chunks are put back as they were afterwards.
+ */
+static void check_sparse() {
+  constexpr const char *patterns[] = {"random", "clustered", "sequential",
+                                      "every 2nd"};
+  const uint64_t base = CHECK_FIRST_CHUNK * sparse::CHUNK_SIZE;
+  const uint64_t first_element = base / STATE_PER_ELEMENT;
+
+  std::mt19937_64 rng(42);
+  std::vector<CBOX_T> orig(CHECK_ELEMENTS);
+  sparse::read(first_element, CHECK_ELEMENTS, orig.data());
+
+  std::vector<check_ref_t> ref(CHECK_SIZE);
+  uint64_t active = 0;
+  for (uint64_t i = 0; i < CHECK_SIZE; i++) {
+#ifdef WITH_COLOR
+    ref[i] = orig[i];
+#else
+    ref[i] = (orig[i / STATE_PER_ELEMENT] >> (i % STATE_PER_ELEMENT)) & 1;
+#endif // WITH_COLOR
+    active += ref_active(ref[i]);
+  }
+
+  const uint64_t others = sparse::count_active() - active;
+  check_sparse_region(ref, others, rng);
+
+  const std::vector<CBOX_T> zeros(sparse::CHUNK_ELEMENT_COUNT);
+
+  for (int round = 0; round < 16; round++) {
+    const int p = round % 4;
+
+    // every pattern starts from empty chunks too
+    if (round % 8 == 0) {
+      for (uint64_t c = 0; c < CHECK_CHUNKS; c++)
+        sparse::set_chunk(CHECK_FIRST_CHUNK + c, zeros.data());
+
+      std::fill(ref.begin(), ref.end(), check_ref_t{});
+      check_sparse_region(ref, others, rng);
+    }
+
+    // random ones sparse enough for array chunks first, then dense
+    uint64_t ops = 20'000 + rng() % 200'000;
+    if (p == 0)
+      ops = round < 8 ? 2'000 + rng() % 30'000 : 200'000 + rng() % 200'000;
+    const uint64_t lo = rng() % CHECK_SIZE;
+    const uint64_t width = p == 0 ? CHECK_SIZE : 1 + rng() % 70'000;
+
+    for (uint64_t k = 0; k < ops; k++) {
+      uint64_t i = 0;
+      if (p == 2)
+        i = (lo + k) % CHECK_SIZE;
+      else if (p == 3)
+        i = (lo + 2 * k) % CHECK_SIZE;
+      else
+        i = (lo + rng() % width) % CHECK_SIZE;
+
+      const uint64_t op = rng() % 10;
+#ifdef WITH_COLOR
+      cbox_t s = {(uint8_t)(rng() % 3), 0, 0, (uint8_t)(rng() & 1)};
+
+      // long runs of one color
+      if (p == 2) {
+        s = {7, 0, 0, 1};
+        sparse::set(base + i, s);
+        ref[i] = s;
+      } else if (op < 6) {
+        cbox_t next = {};
+        sparse::toggle(base + i, s, next);
+
+        cbox_t want = s;
+        want.a = (s.a & ~1) | ((ref[i].a & 1) ^ 1);
+        assert(ref_same(next, want));
+        ref[i] = next;
+      } else {
+        if (rng() % 3 == 0)
+          s = {};
+
+        sparse::set(base + i, s);
+        ref[i] = s;
+      }
+#else
+      if (p == 2) {
+        sparse::set(base + i, true);
+        ref[i] = 1;
+      } else if (op < 6) {
+        ref[i] ^= 1;
+        assert(sparse::toggle(base + i) == ref[i]);
+      } else {
+        ref[i] = rng() & 1;
+        sparse::set(base + i, ref[i]);
+      }
+#endif // WITH_COLOR
+    }
+
+    check_sparse_region(ref, others, rng);
+
+    // a chunk read back and written over itself
+    const uint64_t c = CHECK_FIRST_CHUNK + rng() % CHECK_CHUNKS;
+    std::vector<CBOX_T> chunk(sparse::CHUNK_ELEMENT_COUNT);
+    sparse::read(c * sparse::CHUNK_ELEMENT_COUNT, chunk.size(), chunk.data());
+    sparse::set_chunk(c, chunk.data());
+    check_sparse_region(ref, others, rng);
+
+    const sparse::stats_t st = sparse::get_stats();
+    fprintf(stderr,
+            "[test::check_sparse] %-10s %lu array %lu bitmap %lu run "
+            "chunk(s)\n",
+            patterns[p], st.chunks[sparse::CONTAINER_ARRAY],
+            st.chunks[sparse::CONTAINER_BITMAP],
+            st.chunks[sparse::CONTAINER_RUN]);
+  }
+
+  for (uint64_t c = 0; c < CHECK_CHUNKS; c++)
+    sparse::set_chunk(CHECK_FIRST_CHUNK + c,
+                      orig.data() + c * sparse::CHUNK_ELEMENT_COUNT);
+
+  std::vector<CBOX_T> back(CHECK_ELEMENTS);
+  sparse::read(first_element, CHECK_ELEMENTS, back.data());
+  assert(memcmp(back.data(), orig.data(), CHECK_ELEMENTS * sizeof(CBOX_T)) ==
+         0);
+  assert(sparse::count_active() == others + active);
+
+  fprintf(stderr, "[test::check_sparse] Sparse state matches a dense copy\n");
+}
+
+/**
+ * @brief Toggle cost and memory of the sparse state for a million checkboxes
+ *        scattered over the whole state, every other one in a few chunks and
+ *        all of them packed together. Each is toggled back (and its color
+ *        restored) afterwards.
+ */
+static void bench_sparse() {
+  constexpr uint64_t n = 1'000'000;
+  constexpr uint64_t spread = A_TRILLION / n;
+  constexpr const char *patterns[] = {"scattered", "every 2nd", "packed"};
+
+  std::vector<uint64_t> idx(n);
+#ifdef WITH_COLOR
+  std::vector<cbox_t> prev(n);
+  const cbox_t s = {255, 128, 0, 1};
+#endif // WITH_COLOR
+
+  for (int p = 0; p < 3; p++) {
+    for (uint64_t k = 0; k < n; k++) {
+      if (p == 0)
+        idx[k] = k * spread + (k * 7919) % spread;
+      else
+        idx[k] = p == 1 ? k * 2 : k;
+    }
+
+#ifdef WITH_COLOR
+    for (uint64_t k = 0; k < n; k++)
+      sparse::get(idx[k], prev[k]);
+#endif // WITH_COLOR
+
+    const sparse::stats_t before = sparse::get_stats();
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint64_t i : idx) {
+#ifdef WITH_COLOR
+      switch_state(i, s);
+#else
+      switch_state(i);
+#endif // WITH_COLOR
+    }
+
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+
+    const sparse::stats_t after = sparse::get_stats();
+
+    for (uint64_t k = 0; k < n; k++) {
+#ifdef WITH_COLOR
+      switch_state(idx[k], s);
+      sparse::set(idx[k], prev[k]);
+#else
+      switch_state(idx[k]);
+#endif // WITH_COLOR
+    }
+
+    const int64_t bytes = after.bytes - before.bytes;
+
+    fprintf(stderr,
+            "[test::bench_sparse] %-9s %lu toggle(s): %.1f ns/toggle, chunks "
+            "%+ld array %+ld bitmap %+ld run, %+.1f MB (%.1f byte(s)/"
+            "checkbox)\n",
+            patterns[p], n, (double)ns / n,
+            (int64_t)(after.chunks[sparse::CONTAINER_ARRAY] -
+                      before.chunks[sparse::CONTAINER_ARRAY]),
+            (int64_t)(after.chunks[sparse::CONTAINER_BITMAP] -
+                      before.chunks[sparse::CONTAINER_BITMAP]),
+            (int64_t)(after.chunks[sparse::CONTAINER_RUN] -
+                      before.chunks[sparse::CONTAINER_RUN]),
+            bytes / 1048576.0, (double)bytes / n);
+  }
+}
+#endif // SPARSE_STATE
+
 int run(CBOX_T *cboxes) {
   // size_t li = get_state_element_count() - 1;
   // cboxes[li] = 28765284;
@@ -67,6 +1260,60 @@ int run(CBOX_T *cboxes) {
   // struct timespec t = {1, 0};
   // thrd_sleep(&t, NULL);
 
+  bench_parsers();
+  check_batch();
+  check_gp();
+  check_page_codec();
+  check_state_io();
+  check_journal();
+  check_snapshot();
+  bench_writer();
+#ifdef SPARSE_STATE
+  check_sparse_containers();
+  check_sparse();
+  bench_sparse();
+#endif // SPARSE_STATE
+
+  for (size_t n : {100'000, 1'000'000}) {
+    bench_conn_memory<legacy_ws_data_t>("before", n);
+    bench_conn_memory<server::ws_data_t>("now", n);
+  }
+
+#ifndef COUNT_ALLOCS
+  fprintf(stderr, "[test::run] Built without COUNT_ALLOCS, allocations of "
+                  "the toggle path aren't counted\n");
+#else
+#ifdef WITH_COLOR
+  // put back exactly, color included, before the state gets saved
+  cbox_t prev = {};
+  get_state(999999, prev);
+
+  bench_dispatch_allocs("toggle", "999999;255;128;0;1");
+  cbox_t s = {255, 128, 0, 1};
+  switch_state(999999, s);
+#else
+  bench_dispatch_allocs("toggle", "999999");
+  switch_state(999999);
+#endif // WITH_COLOR
+
+  // answered only while active
+  bench_dispatch_allocs("gcv;", "gcv;999999");
+  bench_dispatch_allocs("gv;", "gv;");
+
+#ifdef WITH_COLOR
+  // writes prev's color and flips the active bit, twice when it has to stay
+  get_state(999999, s);
+  if ((s.a & 1) == (prev.a & 1))
+    switch_state(999999, prev);
+  switch_state(999999, prev);
+
+  get_state(999999, s);
+  assert(memcmp(&s, &prev, sizeof(cbox_t)) == 0);
+#else
+  switch_state(999999);
+#endif // WITH_COLOR
+#endif // COUNT_ALLOCS
+
   return 0;
 }
 
@@ -1,5 +1,5 @@
 #include "atcboxes/util.h"
-#include <regex>
+#include <charconv>
 
 namespace atcboxes::util {
 
@@ -13,44 +13,74 @@ FILE *try_open(const char *filepath, const char *mode) {
   return f;
 }
 
-#ifdef WITH_COLOR
-int parse_cbox_wc(const std::string &msg, uint64_t &i, cbox_t &s) {
-  // idx;r;g;b;a
-  std::regex word_regex("(\\d+)");
-  auto begin = std::sregex_iterator(msg.begin(), msg.end(), word_regex);
+int parse_uint(std::string_view s, uint64_t &out) {
+  const char *end = s.data() + s.size();
+  auto r = std::from_chars(s.data(), end, out);
+
+  return (s.empty() || r.ec != std::errc() || r.ptr != end) ? -1 : 0;
+}
 
-  auto end = std::sregex_iterator();
+void append_uint(std::string &out, uint64_t v) {
+  char b[20];
+  auto r = std::to_chars(b, b + sizeof(b), v);
+  out.append(b, r.ptr - b);
+}
 
-  std::vector<uint64_t> l = {};
+int parse_uints(std::string_view s, uint64_t *out, size_t n) {
+  size_t pos = 0;
 
-  while (begin != end) {
-    std::string c = begin->str();
+  for (size_t i = 0; i < n; i++) {
+    const size_t sep = s.find(';', pos);
 
-    try {
-      l.push_back(std::stoull(c));
-    } catch (...) {
+    // the last field ends the string, every other one ends with a `;`
+    if ((sep == std::string_view::npos) != (i == n - 1))
       return -1;
-    }
 
-    begin++;
+    const size_t len = sep == std::string_view::npos ? sep : sep - pos;
+    if (parse_uint(s.substr(pos, len), out[i]) != 0)
+      return -1;
+
+    pos = sep + 1;
   }
 
-  if (l.size() != 5)
-    return -2;
+  return 0;
+}
+
+#ifdef WITH_COLOR
+int parse_cbox_wc(std::string_view msg, uint64_t &i, cbox_t &s) {
+  uint64_t v[5];
+  if (parse_uints(msg, v, 5) != 0)
+    return -1;
 
-  i = l.at(0);
-  s.r = l.at(1);
-  s.g = l.at(2);
-  s.b = l.at(3);
-  s.a = l.at(4);
+  // would silently truncate
+  if (v[1] > UINT8_MAX || v[2] > UINT8_MAX || v[3] > UINT8_MAX ||
+      v[4] > UINT8_MAX)
+    return -1;
+
+  i = v[0];
+  s.r = v[1];
+  s.g = v[2];
+  s.b = v[3];
+  s.a = v[4];
 
   return 0;
 }
 
 void cbox_t_to_str(uint64_t i, const cbox_t &s, std::string &str) {
-  str = std::to_string(i) + ';' + std::to_string(s.r) + ';' +
-        std::to_string(s.g) + ';' + std::to_string(s.b) + ';' +
-        std::to_string(s.a);
+  str.clear();
+  append_cbox_wc(str, i, s);
+}
+
+void append_cbox_wc(std::string &out, uint64_t i, const cbox_t &s) {
+  append_uint(out, i);
+  out += ';';
+  append_uint(out, s.r);
+  out += ';';
+  append_uint(out, s.g);
+  out += ';';
+  append_uint(out, s.b);
+  out += ';';
+  append_uint(out, s.a);
 }
 #endif // WITH_COLOR
 
@@ -0,0 +1,288 @@
+#include "atcboxes/writer.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace atcboxes::writer {
+
+struct entry_t {
+  uint64_t i;
+#ifdef WITH_COLOR
+  cbox_t s;
+#endif // WITH_COLOR
+  // steady clock, for the latency stats
+  int64_t ts;
+};
+
+// bounded ring with a sequence number per slot. A slot is free for the
+// producer claiming position pos when seq == pos, and filled for the writer
+// when seq == pos + 1.
+struct slot_t {
+  std::atomic<uint64_t> seq;
+  entry_t e;
+};
+
+static std::unique_ptr<slot_t[]> ring;
+alignas(64) static std::atomic<uint64_t> head = 0;
+// writer thread only
+alignas(64) static uint64_t tail = 0;
+
+static std::thread writer_thread;
+static std::atomic<bool> is_running = false;
+static on_batch_t on_batch_cb = nullptr;
+
+// the writer sleeps when the ring is empty
+static std::mutex wake_m;
+static std::condition_variable wake_cv;
+static std::atomic<bool> sleeping = false;
+
+static std::atomic<uint64_t> applied = 0;
+static std::atomic<uint64_t> batches = 0;
+static std::atomic<uint64_t> latency_ns_sum = 0;
+static std::atomic<uint64_t> latency_ns_max = 0;
+static std::atomic<uint64_t> dropped = 0;
+
+static int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// a batch fits in the ring as a whole
+static_assert(commands::MAX_BATCH_TOGGLES <= RING_SIZE);
+
+/**
+ * @brief Claim n consecutive slots from pos, never waiting for the writer.
+ *        Slots are freed in order, so the last one being free means they all
+ *        are.
+ * @return false when the ring is full, nothing claimed
+ */
+static bool claim(size_t n, uint64_t &pos) {
+  pos = head.load(std::memory_order_relaxed);
+
+  for (;;) {
+    slot_t &s = ring[(pos + n - 1) & (RING_SIZE - 1)];
+    const uint64_t seq = s.seq.load(std::memory_order_acquire);
+    const int64_t dif = (int64_t)(seq - (pos + n - 1));
+
+    if (dif == 0) {
+      if (head.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed))
+        return true;
+    } else if (dif < 0) {
+      const uint64_t cur = head.load(std::memory_order_relaxed);
+      // full, the caller drops the toggles rather than wait for the writer
+      if (cur == pos) {
+        dropped.fetch_add(n, std::memory_order_relaxed);
+        return false;
+      }
+
+      pos = cur;
+    } else {
+      pos = head.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+static void fill(uint64_t pos, const entry_t &e) {
+  slot_t &s = ring[pos & (RING_SIZE - 1)];
+  s.e = e;
+  s.seq.store(pos + 1, std::memory_order_release);
+}
+
+static void wake() {
+  if (sleeping.load(std::memory_order_seq_cst)) {
+    std::lock_guard lk(wake_m);
+    wake_cv.notify_one();
+  }
+}
+
+static bool dequeue(entry_t &e) {
+  slot_t &s = ring[tail & (RING_SIZE - 1)];
+  if (s.seq.load(std::memory_order_acquire) != tail + 1)
+    return false;
+
+  e = s.e;
+  s.seq.store(tail + RING_SIZE, std::memory_order_release);
+  tail++;
+  return true;
+}
+
+static void apply(broadcast::delta_t &d, const entry_t &e) {
+#ifdef WITH_COLOR
+  if (switch_state(e.i, e.s) < 0)
+    return;
+
+  cbox_t s = {};
+  get_state(e.i, s);
+  if (on_batch_cb)
+    broadcast::add(d, e.i, s);
+#else
+  int r = switch_state(e.i);
+  if (r < 0)
+    return;
+
+  if (on_batch_cb)
+    broadcast::add(d, e.i, r);
+#endif // WITH_COLOR
+}
+
+/**
+ * @return number of toggles applied
+ */
+static size_t apply_batch(broadcast::delta_t &d) {
+  entry_t e;
+  size_t n = 0;
+  int64_t lat_max = 0;
+  uint64_t lat_sum = 0;
+
+  while (n < MAX_BATCH && dequeue(e)) {
+    apply(d, e);
+    n++;
+
+    const int64_t lat = now_ns() - e.ts;
+    lat_sum += lat;
+    lat_max = std::max(lat_max, lat);
+  }
+
+  if (n == 0)
+    return 0;
+
+  applied.fetch_add(n, std::memory_order_relaxed);
+  batches.fetch_add(1, std::memory_order_relaxed);
+  latency_ns_sum.fetch_add(lat_sum, std::memory_order_relaxed);
+  if ((uint64_t)lat_max > latency_ns_max.load(std::memory_order_relaxed))
+    latency_ns_max.store(lat_max, std::memory_order_relaxed);
+
+  broadcast::broadcast_t b;
+  if (on_batch_cb && broadcast::flush(d, b) > 0)
+    on_batch_cb(std::move(b));
+
+  return n;
+}
+
+static bool ring_empty() {
+  const slot_t &s = ring[tail & (RING_SIZE - 1)];
+  return s.seq.load(std::memory_order_acquire) != tail + 1;
+}
+
+static void run_writer() {
+  broadcast::delta_t d;
+
+  while (is_running) {
+    if (apply_batch(d) > 0)
+      continue;
+
+    sleeping.store(true, std::memory_order_seq_cst);
+
+    {
+      std::unique_lock lk(wake_m);
+      // a push between the check and the wait is caught by the timeout
+      if (is_running && ring_empty())
+        wake_cv.wait_for(lk, std::chrono::milliseconds(1));
+    }
+
+    sleeping.store(false, std::memory_order_relaxed);
+  }
+
+  // producers are done by now
+  while (apply_batch(d) > 0)
+    ;
+}
+
+int start(on_batch_t on_batch) {
+  if (is_running)
+    return 1;
+
+  ring = std::make_unique<slot_t[]>(RING_SIZE);
+  for (size_t i = 0; i < RING_SIZE; i++)
+    ring[i].seq.store(i, std::memory_order_relaxed);
+
+  head = 0;
+  tail = 0;
+  on_batch_cb = on_batch;
+
+  applied = 0;
+  batches = 0;
+  latency_ns_sum = 0;
+  latency_ns_max = 0;
+  dropped = 0;
+
+  is_running = true;
+  writer_thread = std::thread(run_writer);
+
+  fprintf(stderr, "[writer::start] Single writer mode, %zu ring slots\n",
+          RING_SIZE);
+  return 0;
+}
+
+int stop() {
+  if (!is_running)
+    return 1;
+
+  {
+    std::lock_guard lk(wake_m);
+    is_running = false;
+    wake_cv.notify_one();
+  }
+
+  if (writer_thread.joinable())
+    writer_thread.join();
+
+  ring.reset();
+  return 0;
+}
+
+bool running() { return is_running; }
+
+#ifdef WITH_COLOR
+bool push(uint64_t i, const cbox_t &s) {
+#else
+bool push(uint64_t i) {
+#endif // WITH_COLOR
+  uint64_t pos = 0;
+  if (!claim(1, pos))
+    return false;
+
+#ifdef WITH_COLOR
+  fill(pos, {i, s, now_ns()});
+#else
+  fill(pos, {i, now_ns()});
+#endif // WITH_COLOR
+
+  wake();
+  return true;
+}
+
+bool push(const commands::toggles_t &toggles) {
+  const size_t n = toggles.size();
+  uint64_t pos = 0;
+  if (n == 0 || n > commands::MAX_BATCH_TOGGLES || !claim(n, pos))
+    return n == 0;
+
+  const int64_t ts = now_ns();
+  for (size_t k = 0; k < n; k++) {
+#ifdef WITH_COLOR
+    fill(pos + k, {toggles[k].i, toggles[k].s, ts});
+#else
+    fill(pos + k, {toggles[k].i, ts});
+#endif // WITH_COLOR
+  }
+
+  wake();
+  return true;
+}
+
+stats_t get_stats() {
+  return {applied.load(std::memory_order_relaxed),
+          batches.load(std::memory_order_relaxed),
+          latency_ns_sum.load(std::memory_order_relaxed),
+          latency_ns_max.load(std::memory_order_relaxed),
+          dropped.load(std::memory_order_relaxed)};
+}
+
+} // namespace atcboxes::writer